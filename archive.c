@@ -0,0 +1,543 @@
+/* Append-only archive of readings, in memory mapped segment files
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * With -A DIR, every numeric record of every readout is appended to the
+ * archive, straight from the decode thread, as a fixed width record of
+ * time, record ID, storage number, unit code and value.  Each meter has
+ * a directory, named by its secondary address:
+ *
+ *   DIR/units             unit strings, the unit code is the line number
+ *   DIR/SEC/index         one line per segment: SEQ FIRST-TIME
+ *   DIR/SEC/NNNNNNNN.seg  SEG_RECORDS records, in host byte order
+ *
+ * Segments are created at full size and mapped, so an append is a store
+ * to memory, written back by the kernel, without any syscall.  The time
+ * is stored last, a zero time marks the end of a segment, which is all
+ * the recovery needed after a crash.  Fixed data responses, which have
+ * no secondary address, are archived as ID followed by zeros.
+ *
+ * 'export' maps the segments read-only, and uses the index to skip those
+ * before the range asked for.  Only the unit table is shared with the
+ * decode thread, all else is in the files.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbus-master.h"
+
+#define SEG_RECORDS 65536
+#define SEG_SIZE    (SEG_RECORDS * sizeof(struct arec))
+#define UNITS_MAX   65535
+
+struct arec {
+	int64_t  time;			/* 0: end of segment */
+	uint16_t id;
+	uint16_t unit;
+	uint32_t storage;
+	double   value;
+};
+
+/* segment being appended to, per meter */
+struct arch {
+	uint64_t     id;
+	char         sec[17];
+	unsigned     seq;
+	struct arec *map;		/* NULL: unused slot */
+	size_t       num;
+};
+
+static char        *root;
+static struct arch *meters;
+static size_t       meters_num;
+static size_t       meters_max;	/* always power of two */
+
+static char  **units;
+static size_t  units_num;
+static size_t  units_max;
+static FILE   *units_fp;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct arec *seg_map(const char *sec, unsigned seq, int rw)
+{
+	char path[strlen(root) + 32];
+	struct arec *map;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s/%08u.seg", root, sec, seq);
+	fd = open(path, rw ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return NULL;
+
+	if (rw && ftruncate(fd, SEG_SIZE)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, SEG_SIZE, rw ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	return map;
+}
+
+/* Number of records in segment, they are zero after the last */
+static size_t seg_count(struct arec *map)
+{
+	size_t lo = 0, hi = SEG_RECORDS;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (__atomic_load_n(&map[mid].time, __ATOMIC_ACQUIRE))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static FILE *index_open(const char *sec, const char *mode)
+{
+	char path[strlen(root) + 32];
+
+	snprintf(path, sizeof(path), "%s/%s/index", root, sec);
+
+	return fopen(path, mode);
+}
+
+/* Resume appending to the last segment of a meter, if any */
+static int meter_open(struct arch *m)
+{
+	char path[strlen(root) + 20];
+	unsigned seq;
+	char line[64];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", root, m->sec);
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return -1;
+
+	m->seq = 0;
+	fp = index_open(m->sec, "r");
+	if (fp) {
+		while (fgets(line, sizeof(line), fp)) {
+			if (sscanf(line, "%u", &seq) == 1)
+				m->seq = seq;
+		}
+		fclose(fp);
+	}
+
+	m->map = seg_map(m->sec, m->seq, 1);
+	if (!m->map)
+		return -1;
+	m->num = seg_count(m->map);
+
+	return 0;
+}
+
+static uint64_t meter_id(const unsigned char *hdr)
+{
+	uint64_t id = 0;
+
+	for (int i = 0; i < 8; i++)
+		id = id << 8 | hdr[i];
+
+	return id;
+}
+
+static uint64_t fnv1a(const unsigned char *p, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (len--)
+		h = (h ^ *p++) * 1099511628211ULL;
+
+	return h;
+}
+
+static struct arch *slot(struct arch *tbl, size_t max, uint64_t id)
+{
+	size_t i = fnv1a((const unsigned char *)&id, sizeof(id)) & (max - 1);
+
+	while (tbl[i].map && tbl[i].id != id)
+		i = (i + 1) & (max - 1);
+
+	return &tbl[i];
+}
+
+static int grow(void)
+{
+	size_t max = meters_max ? meters_max * 2 : 64;
+	struct arch *tbl;
+
+	tbl = calloc(max, sizeof(*tbl));
+	if (!tbl)
+		return -1;
+
+	for (size_t i = 0; i < meters_max; i++) {
+		if (meters[i].map)
+			*slot(tbl, max, meters[i].id) = meters[i];
+	}
+
+	free(meters);
+	meters = tbl;
+	meters_max = max;
+
+	return 0;
+}
+
+static struct arch *meter_get(const unsigned char *hdr)
+{
+	uint64_t id = meter_id(hdr);
+	struct arch *m;
+
+	/* keep load factor below 3/4 */
+	if ((meters_num + 1) * 4 > meters_max * 3 && grow())
+		return NULL;
+
+	m = slot(meters, meters_max, id);
+	if (m->map)
+		return m;
+
+	m->id = id;
+	snprintf(m->sec, sizeof(m->sec), "%02X%02X%02X%02X%02X%02X%02X%02X",
+		 hdr[3], hdr[2], hdr[1], hdr[0], hdr[4], hdr[5], hdr[6], hdr[7]);
+	if (meter_open(m)) {
+		warn("failed opening archive of %s", m->sec);
+		m->map = NULL;
+		return NULL;
+	}
+	meters_num++;
+
+	return m;
+}
+
+static int unit_code(const char *unit)
+{
+	char *str;
+	int code;
+
+	pthread_mutex_lock(&lock);
+	for (size_t i = 0; i < units_num; i++) {
+		if (!strcmp(units[i], unit)) {
+			pthread_mutex_unlock(&lock);
+			return (int)i;
+		}
+	}
+
+	code = -1;
+	if (units_num >= UNITS_MAX)
+		goto done;
+
+	if (units_num == units_max) {
+		size_t max = units_max ? units_max * 2 : 32;
+		char **tbl;
+
+		tbl = realloc(units, max * sizeof(char *));
+		if (!tbl)
+			goto done;
+		units = tbl;
+		units_max = max;
+	}
+
+	str = strdup(unit);
+	if (!str)
+		goto done;
+
+	/* on disk before any record refers to it */
+	if (fprintf(units_fp, "%s\n", unit) < 0 || fflush(units_fp)) {
+		free(str);
+		goto done;
+	}
+	units[units_num] = str;
+	code = (int)units_num++;
+done:
+	pthread_mutex_unlock(&lock);
+
+	return code;
+}
+
+static int append(struct arch *m, time_t now, struct value *val)
+{
+	struct arec *r;
+	int unit;
+
+	unit = unit_code(val->unit);
+	if (unit == -1)
+		return -1;
+
+	if (m->num == SEG_RECORDS) {
+		struct arec *map = seg_map(m->sec, m->seq + 1, 1);
+
+		if (!map)
+			return -1;
+		munmap(m->map, SEG_SIZE);
+		m->map = map;
+		m->num = 0;
+		m->seq++;
+	}
+
+	if (m->num == 0) {
+		FILE *fp = index_open(m->sec, "a");
+
+		if (!fp)
+			return -1;
+		fprintf(fp, "%u %lld\n", m->seq, (long long)now);
+		if (fclose(fp))
+			return -1;
+	}
+
+	r = &m->map[m->num++];
+	r->id      = val->id;
+	r->unit    = unit;
+	r->storage = val->storage;
+	r->value   = val->real;
+	__atomic_store_n(&r->time, (int64_t)now, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * Append the numeric records of telegram to the archive, record IDs from
+ * first, decoded with the profile, if any.  Only called by the decoder.
+ */
+void archive_telegram(mbus_frame *frame, int first, struct profile *prof)
+{
+	unsigned char hdr[8] = { 0 };
+	time_t now = time(NULL);
+	struct rec_iter it;
+	struct arch *m = NULL;
+	struct value val;
+	int id, rc = 0;
+
+	if (!root)
+		return;
+
+	if (!rec_init(&it, frame)) {
+		mbus_data_record rec;
+
+		m = meter_get(it.hdr);
+		if (!m)
+			return;
+
+		it.id = first;
+		while ((id = rec_next(&it, &rec)) >= 0) {
+			if (profile_value(prof, &it, &rec, id, &val) || !val.numeric)
+				continue;
+			rc |= append(m, now, &val);
+		}
+	} else if (first == 0 && rec_is_fixed(frame)) {
+		memcpy(hdr, frame->data, 4);
+		m = meter_get(hdr);
+		if (!m)
+			return;
+
+		for (id = 0; id < REC_FIXED_NUM; id++) {
+			if (!rec_fixed(frame, id, &val))
+				rc |= append(m, now, &val);
+		}
+	}
+
+	if (rc && m)
+		warn("failed archiving readout of %s", m->sec);
+}
+
+/*
+ * Stream archived records of meter sec, from and to, inclusive, as lines
+ * of TIME ID STORAGE VALUE UNIT, or as JSON objects.  Returns -1 on error.
+ */
+int archive_export(FILE *fp, const char *sec, time_t from, time_t to, int json)
+{
+	long long *first = NULL;
+	unsigned *seqs = NULL;
+	size_t num = 0, max = 0;
+	char line[64];
+	FILE *idx;
+
+	if (!root) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	idx = index_open(sec, "r");
+	if (!idx)
+		return -1;
+
+	while (fgets(line, sizeof(line), idx)) {
+		long long when;
+		unsigned seq;
+
+		if (sscanf(line, "%u %lld", &seq, &when) != 2)
+			continue;
+		/* a segment restarted before its first record */
+		if (num && seqs[num - 1] == seq)
+			continue;
+
+		if (num == max) {
+			size_t n = max ? max * 2 : 64;
+			unsigned *s = realloc(seqs, n * sizeof(*s));
+			long long *f = s ? realloc(first, n * sizeof(*f)) : NULL;
+
+			if (s)
+				seqs = s;
+			if (!f)
+				break;
+			first = f;
+			max = n;
+		}
+		seqs[num]  = seq;
+		first[num] = when;
+		num++;
+	}
+	fclose(idx);
+
+	for (size_t i = 0; i < num; i++) {
+		struct arec *map;
+
+		if (first[i] > to)
+			break;
+		if (i + 1 < num && first[i + 1] < from)
+			continue;
+
+		map = seg_map(sec, seqs[i], 0);
+		if (!map) {
+			warn("failed reading archive segment %u of %s", seqs[i], sec);
+			continue;
+		}
+
+		for (size_t j = 0; j < SEG_RECORDS; j++) {
+			struct arec *r = &map[j];
+			int64_t when = __atomic_load_n(&r->time, __ATOMIC_ACQUIRE);
+			const char *unit = "";
+
+			if (!when)
+				break;
+			if (when < from || when > to)
+				continue;
+
+			pthread_mutex_lock(&lock);
+			if (r->unit < units_num)
+				unit = units[r->unit];
+			pthread_mutex_unlock(&lock);
+
+			if (json && !isfinite(r->value))
+				fprintf(fp, "{\"secondary\":\"%s\",\"time\":%lld,\"id\":%u,\"storage\":%u,"
+					"\"value\":null,\"unit\":\"%s\"}\n", sec, (long long)when,
+					r->id, r->storage, unit);
+			else if (json)
+				fprintf(fp, "{\"secondary\":\"%s\",\"time\":%lld,\"id\":%u,\"storage\":%u,"
+					"\"value\":%.15g,\"unit\":\"%s\"}\n", sec, (long long)when,
+					r->id, r->storage, r->value, unit);
+			else
+				fprintf(fp, "%lld %u %u %.15g %s\n", (long long)when,
+					r->id, r->storage, r->value, unit);
+		}
+		munmap(map, SEG_SIZE);
+	}
+
+	free(seqs);
+	free(first);
+
+	return 0;
+}
+
+size_t archive_meters(void)
+{
+	return meters_num;
+}
+
+int archive_open(const char *dir)
+{
+	char path[strlen(dir) + 8];
+	char line[80];
+
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return -1;
+
+	root = strdup(dir);
+	if (!root)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/units", dir);
+	units_fp = fopen(path, "a+");
+	if (!units_fp)
+		goto error;
+
+	rewind(units_fp);
+	while (fgets(line, sizeof(line), units_fp)) {
+		line[strcspn(line, "\n")] = 0;
+		if (units_num == units_max) {
+			size_t max = units_max ? units_max * 2 : 32;
+			char **tbl = realloc(units, max * sizeof(char *));
+
+			if (!tbl)
+				goto error;
+			units = tbl;
+			units_max = max;
+		}
+		units[units_num] = strdup(line);
+		if (!units[units_num])
+			goto error;
+		units_num++;
+	}
+
+	return 0;
+error:
+	archive_close();
+	return -1;
+}
+
+void archive_close(void)
+{
+	for (size_t i = 0; i < meters_max; i++) {
+		if (meters[i].map)
+			munmap(meters[i].map, SEG_SIZE);
+	}
+	free(meters);
+	meters = NULL;
+	meters_num = meters_max = 0;
+
+	for (size_t i = 0; i < units_num; i++)
+		free(units[i]);
+	free(units);
+	units = NULL;
+	units_num = units_max = 0;
+
+	if (units_fp)
+		fclose(units_fp);
+	units_fp = NULL;
+
+	free(root);
+	root = NULL;
+}
@@ -0,0 +1,82 @@
+/* LD_PRELOAD heap allocation counter, for benchmarking mbus-master
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Counts calls to malloc(), calloc() and realloc(), and free(), using
+ * the glibc internal entry points to avoid dlsym() recursion.  Totals
+ * are written to stderr at exit, or to $MALLOC_COUNT_FILE if set.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void  __libc_free(void *ptr);
+
+static atomic_ulong allocs, frees, bytes;
+
+void *malloc(size_t size)
+{
+	allocs++;
+	bytes += size;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	bytes += nmemb * size;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocs++;
+	bytes += size;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	if (ptr)
+		frees++;
+	__libc_free(ptr);
+}
+
+__attribute__((destructor))
+static void report(void)
+{
+	const char *file = getenv("MALLOC_COUNT_FILE");
+	FILE *fp = stderr;
+
+	if (file && !(fp = fopen(file, "w")))
+		fp = stderr;
+
+	fprintf(fp, "allocs %lu frees %lu bytes %lu\n",
+		(unsigned long)allocs, (unsigned long)frees, (unsigned long)bytes);
+	if (fp != stderr)
+		fclose(fp);
+}
@@ -0,0 +1,585 @@
+/* Simulated M-Bus slaves behind a pty, for benchmarking mbus-master
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Slaves 1..N answer at primary address 1..N, and to their secondary
+ * address when selected.  They ACK SND_NKE, selection, set address and
+ * baud rate switch, and answer REQ_UD2 with a variable data response.
+ * The response records are built in, with counters that advance on each
+ * request, or read from a file of recorded telegrams, one per line in
+ * hex, without the 12 byte header.  With more than one line all but the
+ * last telegram end in more records follow (DIF 0x1F).  Each slave
+ * tracks its FCB, a REQ_UD2 that does not toggle it repeats the last
+ * telegram, until the next SND_NKE.
+ *
+ * Replies can be delayed, and randomly garbled (a collision) or dropped
+ * (a timeout).  On SIGUSR1 the frame counters are written to the -o
+ * FILE, on SIGINT/SIGTERM they are also written to stderr at exit.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SLAVES    250
+#define MAX_TELEGRAMS 16
+#define FRAME_MAX     261
+
+#define ACK           0xE5
+#define SHORT_START   0x10
+#define LONG_START    0x68
+#define STOP          0x16
+
+#define C_SND_NKE     0x40
+#define C_SND_UD      0x53
+#define C_REQ_UD2     0x5B
+#define C_RSP_UD      0x08
+#define C_FCB         0x20
+
+#define CI_SET_ADDR   0x51
+#define CI_SELECT     0x52
+#define CI_RESP_VAR   0x72
+
+#define A_NETWORK     253
+#define A_BROADCAST   254
+#define A_NOREPLY     255
+
+struct slave {
+	int      primary;
+	uint8_t  sec[8];	/* id (BCD, LE), manufacturer, version, medium */
+	int      selected;
+	int      telegram;	/* next to send */
+	int      fcb;		/* of last REQ_UD2, -1: none since SND_NKE */
+	uint32_t counter;
+};
+
+struct telegram {
+	uint8_t data[234];
+	size_t  len;
+};
+
+static struct slave    slaves[MAX_SLAVES];
+static int             num_slaves = 10;
+static struct telegram telegrams[MAX_TELEGRAMS];
+static int             num_telegrams;
+
+static int             delay_ms;
+static int             collision_rate;	/* percent */
+static int             error_rate;	/* percent */
+static char           *outfile;
+
+static unsigned long   frames, replies, collisions, dropped;
+static volatile sig_atomic_t running = 1, dump;
+
+static void sigcb(int signo)
+{
+	if (signo == SIGUSR1)
+		dump = 1;
+	else
+		running = 0;
+}
+
+static void counters(FILE *fp)
+{
+	fprintf(fp, "frames %lu replies %lu collisions %lu dropped %lu\n",
+		frames, replies, collisions, dropped);
+}
+
+static void save_counters(void)
+{
+	FILE *fp;
+
+	if (!outfile)
+		return;
+
+	fp = fopen(outfile, "w");
+	if (!fp) {
+		warn("failed writing %s", outfile);
+		return;
+	}
+	counters(fp);
+	fclose(fp);
+}
+
+static int chance(int percent)
+{
+	return percent > 0 && rand() % 100 < percent;
+}
+
+static uint8_t bcd(int v)
+{
+	return ((v / 10) % 10) << 4 | (v % 10);
+}
+
+static void init_slaves(void)
+{
+	for (int i = 0; i < num_slaves; i++) {
+		struct slave *s = &slaves[i];
+		int id = 10000000 + i + 1;
+
+		s->primary = i + 1;
+		s->sec[0]  = bcd(id);
+		s->sec[1]  = bcd(id / 100);
+		s->sec[2]  = bcd(id / 10000);
+		s->sec[3]  = bcd(id / 1000000);
+		s->sec[4]  = 0x2D;	/* "KAM" */
+		s->sec[5]  = 0x2C;
+		s->sec[6]  = 0x01;	/* version */
+		s->sec[7]  = 0x04;	/* heat */
+		s->counter = 1000 * (i + 1);
+	}
+}
+
+static int hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+
+	return -1;
+}
+
+static void load_telegrams(const char *file)
+{
+	char line[1024];
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		err(1, "failed opening %s", file);
+
+	while (num_telegrams < MAX_TELEGRAMS && fgets(line, sizeof(line), fp)) {
+		struct telegram *t = &telegrams[num_telegrams];
+		char *p = line;
+
+		if (line[0] == '#')
+			continue;
+
+		t->len = 0;
+		while (*p && t->len < sizeof(t->data) - 1) {
+			int hi, lo;
+
+			if ((hi = hexval(p[0])) < 0) {
+				p++;
+				continue;
+			}
+			if ((lo = hexval(p[1])) < 0)
+				break;
+			t->data[t->len++] = hi << 4 | lo;
+			p += 2;
+		}
+		if (t->len)
+			num_telegrams++;
+	}
+	fclose(fp);
+
+	if (!num_telegrams)
+		errx(1, "no telegrams in %s", file);
+}
+
+static void put(int fd, const uint8_t *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Send reply, or not, or garbled, as configured */
+static void reply(int fd, uint8_t *buf, size_t len)
+{
+	if (delay_ms)
+		usleep(delay_ms * 1000);
+
+	if (chance(error_rate)) {
+		dropped++;
+		return;
+	}
+	if (chance(collision_rate)) {
+		buf[len > 1 ? len - 2 : 0] ^= 0x5A;
+		collisions++;
+	}
+
+	put(fd, buf, len);
+	replies++;
+}
+
+static void ack(int fd)
+{
+	uint8_t c = ACK;
+
+	reply(fd, &c, 1);
+}
+
+/* several slaves answering at once */
+static void collide(int fd)
+{
+	uint8_t garbage[] = { ACK ^ 0x24, 0x68, ACK & 0x7F };
+
+	if (delay_ms)
+		usleep(delay_ms * 1000);
+	put(fd, garbage, sizeof(garbage));
+	collisions++;
+}
+
+static void add32(uint8_t *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+static void respond(int fd, struct slave *s, int fcb_toggled)
+{
+	uint8_t buf[FRAME_MAX];
+	size_t len = 0, i;
+	uint8_t cs = 0;
+	int more = 0;
+
+	buf[len++] = LONG_START;
+	buf[len++] = 0;
+	buf[len++] = 0;
+	buf[len++] = LONG_START;
+	buf[len++] = C_RSP_UD;
+	buf[len++] = s->primary;
+	buf[len++] = CI_RESP_VAR;
+	memcpy(&buf[len], s->sec, 8);
+	len += 8;
+	buf[len++] = (uint8_t)replies;	/* access number */
+	buf[len++] = 0;			/* status */
+	buf[len++] = 0;			/* signature */
+	buf[len++] = 0;
+
+	if (num_telegrams) {
+		struct telegram *t;
+
+		/* a repeated FCB means the master missed our reply */
+		if (!fcb_toggled && s->telegram > 0)
+			s->telegram--;
+		if (s->telegram >= num_telegrams)
+			s->telegram = 0;
+
+		t = &telegrams[s->telegram++];
+		memcpy(&buf[len], t->data, t->len);
+		len += t->len;
+		more = s->telegram < num_telegrams;
+		if (!more)
+			s->telegram = 0;
+	} else {
+		s->counter++;
+		buf[len++] = 0x04;	/* energy, Wh */
+		buf[len++] = 0x03;
+		add32(&buf[len], s->counter);
+		len += 4;
+		buf[len++] = 0x04;	/* volume, l */
+		buf[len++] = 0x13;
+		add32(&buf[len], s->counter / 10);
+		len += 4;
+		buf[len++] = 0x02;	/* flow temperature */
+		buf[len++] = 0x5A;
+		buf[len++] = 0x9A;
+		buf[len++] = 0x02;
+		buf[len++] = 0x02;	/* return temperature */
+		buf[len++] = 0x5E;
+		buf[len++] = 0xB8;
+		buf[len++] = 0x01;
+		buf[len++] = 0x04;	/* on time, hours */
+		buf[len++] = 0x22;
+		add32(&buf[len], s->counter / 100);
+		len += 4;
+	}
+	if (more)
+		buf[len++] = 0x1F;
+
+	buf[1] = buf[2] = len - 4;
+	for (i = 4; i < len; i++)
+		cs += buf[i];
+	buf[len++] = cs;
+	buf[len++] = STOP;
+
+	reply(fd, buf, len);
+}
+
+/* match secondary address, F nibbles are wildcards */
+static int match(struct slave *s, const uint8_t *mask)
+{
+	for (int i = 0; i < 8; i++) {
+		if ((mask[i] & 0xF0) != 0xF0 && (mask[i] & 0xF0) != (s->sec[i] & 0xF0))
+			return 0;
+		if ((mask[i] & 0x0F) != 0x0F && (mask[i] & 0x0F) != (s->sec[i] & 0x0F))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int addressed(struct slave *s, int address)
+{
+	if (address == A_BROADCAST || address == A_NOREPLY)
+		return 1;
+	if (address == A_NETWORK)
+		return s->selected;
+
+	return s->primary == address;
+}
+
+static void frame(int fd, const uint8_t *buf, size_t len)
+{
+	uint8_t c, a, ci = 0;
+	const uint8_t *data = NULL;
+	size_t dlen = 0;
+	int matches = 0;
+	struct slave *hit = NULL;
+
+	frames++;
+	if (buf[0] == SHORT_START) {
+		c = buf[1];
+		a = buf[2];
+	} else {
+		c = buf[4];
+		a = buf[5];
+		ci = buf[6];
+		data = &buf[7];
+		dlen = len - 9;
+	}
+
+	/* selection */
+	if (buf[0] == LONG_START && ci == CI_SELECT && dlen >= 8) {
+		for (int i = 0; i < num_slaves; i++) {
+			slaves[i].selected = match(&slaves[i], data);
+			if (slaves[i].selected) {
+				hit = &slaves[i];
+				matches++;
+			}
+		}
+		if (a == A_NOREPLY || !matches)
+			return;
+		if (matches > 1)
+			collide(fd);
+		else
+			ack(fd);
+		return;
+	}
+
+	for (int i = 0; i < num_slaves; i++) {
+		if (addressed(&slaves[i], a)) {
+			hit = &slaves[i];
+			matches++;
+		}
+	}
+	if (!matches)
+		return;
+
+	if ((c & ~C_FCB) == C_SND_NKE) {
+		for (int i = 0; i < num_slaves; i++) {
+			if (!addressed(&slaves[i], a))
+				continue;
+			slaves[i].telegram = 0;
+			slaves[i].fcb = -1;
+			if (a == A_NETWORK)
+				slaves[i].selected = 0;
+		}
+	} else if (ci == CI_SET_ADDR && dlen >= 3 && matches == 1) {
+		hit->primary = data[2];
+	}
+
+	if (a == A_NOREPLY)
+		return;
+	if (matches > 1) {
+		collide(fd);
+		return;
+	}
+
+	if ((c & ~C_FCB) == (C_REQ_UD2 & ~C_FCB)) {
+		int toggled = hit->fcb != (c & C_FCB);
+
+		hit->fcb = c & C_FCB;
+		respond(fd, hit, toggled);
+	} else {
+		/* SND_NKE, SND_UD: set address, baud rate switch, ... */
+		ack(fd);
+	}
+}
+
+/* Reassemble frames from the byte stream, skipping garbage */
+static void input(int fd, uint8_t *buf, size_t *len)
+{
+	size_t need;
+
+	while (*len > 0) {
+		if (buf[0] == SHORT_START)
+			need = 5;
+		else if (buf[0] == LONG_START && *len >= 4)
+			need = buf[1] + 6;
+		else if (buf[0] == LONG_START)
+			return;
+		else {
+			memmove(buf, buf + 1, --*len);
+			continue;
+		}
+
+		if (*len < need)
+			return;
+
+		if (buf[need - 1] == STOP)
+			frame(fd, buf, need);
+		else
+			need = 1;	/* resync */
+
+		memmove(buf, buf + need, *len - need);
+		*len -= need;
+	}
+}
+
+static int usage(int rc)
+{
+	fprintf(stderr,
+		"Usage: mbus-sim [-c PCT] [-d MSEC] [-e PCT] [-n NUM] [-o FILE] [-s SEED] [-t FILE]\n"
+		"\n"
+		"Options:\n"
+		" -c PCT     Garble PCT %% of replies, like a collision, default: 0\n"
+		" -d MSEC    Delay each reply MSEC ms, default: 0\n"
+		" -e PCT     Drop PCT %% of replies, i.e. timeout, default: 0\n"
+		" -n NUM     Number of slaves, primary address 1..NUM, default: 10\n"
+		" -o FILE    Write frame counters to FILE on SIGUSR1 and at exit\n"
+		" -s SEED    Random seed, default: 1\n"
+		" -t FILE    Recorded telegrams, one hex encoded per line\n"
+		"\n"
+		"Prints the pty to use as DEVICE for mbus-master on stdout.\n");
+
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t buf[2 * FRAME_MAX];
+	struct termios tio;
+	unsigned seed = 1;
+	size_t len = 0;
+	int fd, c;
+
+	while ((c = getopt(argc, argv, "c:d:e:hn:o:s:t:")) != EOF) {
+		switch (c) {
+		case 'c':
+			collision_rate = atoi(optarg);
+			break;
+		case 'd':
+			delay_ms = atoi(optarg);
+			break;
+		case 'e':
+			error_rate = atoi(optarg);
+			break;
+		case 'n':
+			num_slaves = atoi(optarg);
+			if (num_slaves < 1 || num_slaves > MAX_SLAVES)
+				errx(1, "number of slaves must be 1-%d", MAX_SLAVES);
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			load_telegrams(optarg);
+			break;
+		case 'h':
+			return usage(0);
+		default:
+			return usage(1);
+		}
+	}
+
+	srand(seed);
+	init_slaves();
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt(fd) || unlockpt(fd))
+		err(1, "failed creating pty");
+
+	tcgetattr(fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(fd, TCSANOW, &tio);
+
+	printf("%s\n", ptsname(fd));
+	fflush(stdout);
+
+	signal(SIGINT, sigcb);
+	signal(SIGTERM, sigcb);
+	signal(SIGUSR1, sigcb);
+	signal(SIGHUP, SIG_IGN);
+
+	while (running) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		ssize_t n;
+
+		if (dump) {
+			save_counters();
+			dump = 0;
+		}
+
+		if (poll(&pfd, 1, 500) <= 0)
+			continue;
+
+		/* master closed its end, wait for the next one */
+		if (pfd.revents & POLLHUP) {
+			usleep(10000);
+			continue;
+		}
+
+		n = read(fd, &buf[len], sizeof(buf) - len);
+		if (n <= 0)
+			continue;
+		len += n;
+		input(fd, buf, &len);
+		if (len == sizeof(buf))
+			len = 0;
+	}
+
+	save_counters();
+	counters(stderr);
+
+	return 0;
+}
@@ -0,0 +1,113 @@
+#!/bin/sh
+# Benchmark mbus-master against simulated slaves on a pty
+#
+# Usage: bench/run.sh [SCENARIO ...]
+#
+# Scenarios are: scan, scan-fast, probe, poll, request.  The default is
+# all of them except the (slow) regular scan.  For each scenario the
+# wall time, bus frames per second, and heap allocations per request
+# are reported, where a request is a meter read, or an address scanned.
+#
+# Environment:
+#   SLAVES      Number of simulated slaves, default: 10
+#   DELAY       Reply delay in ms, default: 0
+#   COLLISIONS  Percent garbled replies, default: 0
+#   ERRORS      Percent dropped replies, default: 0
+#   TELEGRAMS   File of recorded telegrams, see mbus-sim.c
+#   MASTER      mbus-master binary, default: ./mbus-master
+
+dir=$(dirname "$0")
+SLAVES=${SLAVES:-10}
+DELAY=${DELAY:-0}
+COLLISIONS=${COLLISIONS:-0}
+ERRORS=${ERRORS:-0}
+MASTER=${MASTER:-./mbus-master}
+scenarios=${*:-scan-fast probe poll request}
+
+tmp=$(mktemp -d)
+sim=
+trap '[ -n "$sim" ] && kill $sim 2>/dev/null; rm -rf "$tmp"' EXIT
+
+"$dir/mbus-sim" -n "$SLAVES" -d "$DELAY" -c "$COLLISIONS" -e "$ERRORS" \
+		-o "$tmp/sim" ${TELEGRAMS:+-t "$TELEGRAMS"} > "$tmp/pty" 2> "$tmp/sim.err" &
+sim=$!
+while [ ! -s "$tmp/pty" ]; do
+	kill -0 $sim 2>/dev/null || exit 1
+	sleep 0.1
+done
+pty=$(cat "$tmp/pty")
+
+# frames received by the simulator so far
+frames()
+{
+	rm -f "$tmp/sim"
+	kill -USR1 $sim
+	while [ ! -s "$tmp/sim" ]; do
+		sleep 0.1
+	done
+	awk '{ print $2 }' "$tmp/sim"
+}
+
+now()
+{
+	date +%s%N
+}
+
+# run NAME REQUESTS CMD [CMD ...]
+run()
+{
+	name=$1
+	reqs=$2
+	shift 2
+	printf '%s\n' "$@" > "$tmp/cmds"
+
+	before=$(frames)
+	start=$(now)
+	MALLOC_COUNT_FILE="$tmp/malloc" LD_PRELOAD="$dir/malloc-count.so" \
+		"$MASTER" -r "$tmp/registry" -f "$tmp/cmds" "$pty" > "$tmp/$name.out" 2> "$tmp/$name.err"
+	end=$(now)
+	after=$(frames)
+	allocs=$(awk '{ print $2 }' "$tmp/malloc")
+
+	awk -v name="$name" -v start="$start" -v end="$end" -v tx=$((after - before)) \
+	    -v allocs="$allocs" -v reqs="$reqs" 'BEGIN {
+		ms = (end - start) / 1000000
+		printf "%-10s %9.0f %7d %9.1f %10.1f\n", name, ms, tx, ms ? tx * 1000 / ms : 0, allocs / reqs
+	}'
+}
+
+printf "%d slaves, %d ms delay, %d%% collisions, %d%% errors\n" \
+       "$SLAVES" "$DELAY" "$COLLISIONS" "$ERRORS"
+printf "%-10s %9s %7s %9s %10s\n" Scenario "Time (ms)" Frames Frames/s Allocs/req
+
+for scenario in $scenarios; do
+	case $scenario in
+	scan)
+		run scan 251 "scan"
+		;;
+	scan-fast)
+		run scan-fast 251 "scan fast"
+		;;
+	probe)
+		run probe "$SLAVES" "probe fresh"
+		;;
+	poll)
+		# poll needs a registry, from a probe
+		[ -s "$tmp/registry" ] || run probe "$SLAVES" "probe fresh" > /dev/null
+		run poll "$SLAVES" "poll"
+		;;
+	request)
+		set --
+		i=1
+		while [ $i -le "$SLAVES" ]; do
+			set -- "$@" "request $i"
+			i=$((i + 1))
+		done
+		run request "$SLAVES" "$@"
+		;;
+	*)
+		echo "unknown scenario $scenario" >&2
+		exit 1
+		;;
+	esac
+done
@@ -0,0 +1,673 @@
+/* One worker thread per M-Bus, i.e., serial port
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Each bus has its own libmbus handle, owned by a worker thread which
+ * runs commands from a FIFO queue.  The main thread reads commands and
+ * submits them to one or all buses, so a broadcast 'scan' or 'poll'
+ * takes as long as the slowest bus, not the sum of all of them.
+ *
+ * Commands are submitted with a done callback, called by the worker, so
+ * the main thread does not have to wait for them.  An aborted bus skips
+ * all jobs queued before the abort, and long running commands check for
+ * it with bus_active() between each request on the bus.
+ *
+ * Jobs are queued by priority, FIFO within the same priority, so a
+ * client asking for a meter is not stuck behind a batch of scheduled
+ * polls.  A mergeable job, e.g. 'request 5', is not queued again while
+ * an identical one is waiting, instead its submitter is added to that
+ * job's waiters.  The bus is asked once, and the output is copied to
+ * the output of each waiter.
+ *
+ * A DEVICE given as tcp://HOST:PORT is an M-Bus to TCP converter, with
+ * a libmbus TCP context instead of a serial port.  It is a bus like any
+ * other, with its own worker, but the line speed and parity are set in
+ * the converter.  Converters drop idle connections, so the socket is
+ * checked before each job and reconnected if the peer has closed it.
+ */
+
+#define _GNU_SOURCE		/* fopencookie() */
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "mbus-master.h"
+
+struct waiter {
+	bus_done    done;
+	void       *arg;		/* to done */
+	FILE       *out;		/* NULL: default */
+};
+
+struct job {
+	struct job *next;
+	bus_cmd     cb;
+	int         flags;
+	unsigned long seq;
+	struct waiter w[JOB_WAITERS];
+	int         num;		/* waiters, at least one */
+	char       *args;		/* NULL, or buf */
+	char       *buf;
+	size_t      size;		/* of buf */
+	int         decoded;	/* rc of its telegrams, see bus_rc() */
+};
+
+static struct bus *buses[BUS_MAX];
+static int         num_buses;
+
+static __thread struct bus *self;	/* of worker thread */
+static __thread FILE       *curr_out;	/* of command, NULL: default */
+static __thread int        *curr_rc;	/* of its telegrams, NULL: none */
+static FILE                *default_out;	/* NULL: stdout */
+
+#define PRIO(flags) ((flags) & JOB_PRIO_MASK)
+
+/* Copy output of a merged job to all its waiters */
+static ssize_t tee_write(void *cookie, const char *buf, size_t len)
+{
+	struct job *job = cookie;
+
+	for (int i = 0; i < job->num; i++) {
+		FILE *fp = job->w[i].out ?: default_out ?: stdout;
+
+		fwrite(buf, 1, len, fp);
+		if (sink_ending())
+			sink_end(fp);
+	}
+
+	return len;
+}
+
+static FILE *tee_open(struct job *job)
+{
+	static const cookie_io_functions_t io = { .write = tee_write };
+
+	if (job->num < 2)
+		return job->w[0].out;
+
+	return fopencookie(job, "w", io) ?: job->w[0].out;
+}
+
+/* Peer closed, or error on, an idle TCP connection */
+static int tcp_closed(mbus_handle *handle)
+{
+	struct pollfd pfd = { .fd = handle->fd, .events = POLLIN };
+	char c;
+
+	/* reconnect failed last time */
+	if (handle->fd < 0)
+		return 1;
+
+	if (poll(&pfd, 1, 0) <= 0)
+		return 0;
+	if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+		return 1;
+
+	/* stale bytes are purged by the command, EOF is not */
+	return recv(handle->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+/* start of a reply, a full long frame and the network, in seconds */
+static double tcp_timeout(struct bus *bus)
+{
+	return (330.0 + 261 * 11) / bus->baudrate + (50 + TCP_LATENCY) / 1000.0;
+}
+
+/*
+ * libmbus copies its global timeout to the socket when it connects, so
+ * that is set before connecting, and the socket of a connected bus is
+ * updated in place when the converter speed changes.
+ */
+int bus_tcp_timeout(struct bus *bus)
+{
+	double sec = tcp_timeout(bus);
+	struct timeval tv = {
+		.tv_sec  = (time_t)sec,
+		.tv_usec = (suseconds_t)((sec - (time_t)sec) * 1000000),
+	};
+
+	if (bus->handle->fd < 0)
+		return 0;
+
+	if (setsockopt(bus->handle->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	    setsockopt(bus->handle->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))) {
+		warn("bus %d: failed setting timeout on %s", bus->id, bus->device);
+		return -1;
+	}
+	dbg("bus %d: TCP timeout now %.2f s", bus->id, sec);
+
+	return 0;
+}
+
+static void tcp_reconnect(struct bus *bus)
+{
+	log("bus %d: %s closed connection, reconnecting.", bus->id, bus->device);
+	mbus_disconnect(bus->handle);
+	if (mbus_connect(bus->handle) == -1)
+		warnx("%s: %s", bus->device, mbus_error_str());
+	else
+		bus_tcp_timeout(bus);
+
+	/* slaves may have been reset, or talked to, by someone else */
+	slaves_unknown(bus);
+}
+
+/* tcp://HOST:PORT, split in place, returns -1 if not a TCP device */
+static int tcp_parse(char *device, char **host, uint16_t *port)
+{
+	char *ptr;
+	long val;
+
+	if (strncmp(device, "tcp://", 6))
+		return -1;
+
+	*host = device + 6;
+	ptr = strrchr(*host, ':');
+	if (!ptr || ptr == *host)
+		return -1;
+
+	*ptr++ = 0;
+	errno = 0;
+	val = strtol(ptr, &ptr, 10);
+	if (errno || *ptr || val < 1 || val > 65535)
+		return -1;
+	*port = val;
+
+	return 0;
+}
+
+static void *worker(void *arg)
+{
+	struct bus *bus = arg;
+
+	self = bus;
+	pthread_mutex_lock(&bus->lock);
+	while (1) {
+		struct job *job;
+		int skip, rc;
+		FILE *out;
+
+		while (!bus->head && !bus->stop)
+			pthread_cond_wait(&bus->cond, &bus->lock);
+		if (!bus->head)
+			break;
+
+		job = bus->head;
+		bus->head = job->next;
+		if (!bus->head)
+			bus->tail = NULL;
+		bus->busy = 1;
+		bus->current = job;
+		bus->started = time(NULL);
+		bus->progress[0] = 0;
+		skip = job->seq < bus->aborted;
+		pthread_mutex_unlock(&bus->lock);
+
+		if (bus->tcp && !skip && tcp_closed(bus->handle))
+			tcp_reconnect(bus);
+
+		/* no more waiters can be added now */
+		out = tee_open(job);
+		curr_out = out;
+		if (out && out != job->w[0].out) {
+			pthread_mutex_lock(&bus->lock);
+			bus->tee = out;
+			pthread_mutex_unlock(&bus->lock);
+		}
+		job->decoded = 0;
+		curr_rc = job->w[0].done ? &job->decoded : NULL;
+		rc = skip ? 1 : job->cb(bus->handle, job->args);
+		curr_rc = NULL;
+		if (job->w[0].done) {
+			/* waiters get all output before they are told we're done */
+			decode_flush();
+			rc |= job->decoded;
+			if (out && out != job->w[0].out) {
+				pthread_mutex_lock(&bus->lock);
+				bus->tee = NULL;
+				pthread_mutex_unlock(&bus->lock);
+				sink_end(out);
+				fclose(out);
+			} else
+				sink_end(out ?: bus_out());
+			for (int i = 0; i < job->num; i++)
+				job->w[i].done(job->w[i].arg, rc);
+		} else
+			sink_end(bus_out());
+		curr_out = NULL;
+
+		pthread_mutex_lock(&bus->lock);
+		bus->current = NULL;
+		job->next = bus->free;
+		bus->free = job;
+		bus->rc |= rc;
+		bus->busy = 0;
+		pthread_cond_broadcast(&bus->cond);
+	}
+	pthread_mutex_unlock(&bus->lock);
+
+	return NULL;
+}
+
+struct bus *bus_open(const char *device)
+{
+	struct bus *bus;
+
+	if (num_buses >= BUS_MAX) {
+		warnx("too many buses, max %d.", BUS_MAX);
+		return NULL;
+	}
+
+	bus = calloc(1, sizeof(*bus));
+	if (!bus)
+		return NULL;
+
+	bus->id       = num_buses;
+	bus->device   = strdup(device);
+	bus->baudrate = 2400;
+	bus->speed    = 2400;
+
+	bus->request.type    = MBUS_FRAME_TYPE_SHORT;
+	bus->request.start1  = MBUS_FRAME_SHORT_START;
+	bus->request.stop    = MBUS_FRAME_STOP;
+	bus->parity   = 1;
+
+	if (!strncmp(device, "tcp://", 6)) {
+		char buf[strlen(device) + 1], *host;
+		uint16_t port;
+
+		strcpy(buf, device);
+		if (tcp_parse(buf, &host, &port)) {
+			warnx("%s: invalid address, expected tcp://HOST:PORT", device);
+			goto fail;
+		}
+		bus->tcp    = 1;
+		bus->handle = mbus_context_tcp(host, port);
+		mbus_tcp_set_timeout_set(tcp_timeout(bus));
+	} else
+		bus->handle = mbus_context_serial(device);
+	if (!bus->handle) {
+		warnx("Failed initializing M-Bus context: %s", mbus_error_str());
+		goto fail;
+	}
+
+	if (mbus_connect(bus->handle) == -1) {
+		warnx("%s: %s", device, mbus_error_str());
+		mbus_context_free(bus->handle);
+		goto fail;
+	}
+
+	pthread_mutex_init(&bus->lock, NULL);
+	pthread_cond_init(&bus->cond, NULL);
+	if (pthread_create(&bus->thread, NULL, worker, bus)) {
+		warn("failed starting worker for %s", device);
+		mbus_disconnect(bus->handle);
+		mbus_context_free(bus->handle);
+		goto fail;
+	}
+
+	buses[num_buses++] = bus;
+
+	return bus;
+fail:
+	free(bus->device);
+	free(bus);
+	return NULL;
+}
+
+/* Stops worker when queue is drained, then closes the port */
+void bus_close(struct bus *bus)
+{
+	pthread_mutex_lock(&bus->lock);
+	bus->stop = 1;
+	pthread_cond_broadcast(&bus->cond);
+	pthread_mutex_unlock(&bus->lock);
+	pthread_join(bus->thread, NULL);
+
+	mbus_disconnect(bus->handle);
+	mbus_context_free(bus->handle);
+	pthread_mutex_destroy(&bus->lock);
+	pthread_cond_destroy(&bus->cond);
+
+	for (int i = 0; i < num_buses; i++) {
+		if (buses[i] == bus)
+			buses[i] = NULL;
+	}
+
+	while (bus->free) {
+		struct job *job = bus->free;
+
+		bus->free = job->next;
+		free(job->buf);
+		free(job);
+	}
+	free(bus->regs);
+	free(bus->targets);
+	free(bus->frames);
+	free(bus->fcbs);
+	free(bus->device);
+	free(bus);
+}
+
+/* Done jobs are kept for reuse, with their args buffer */
+static struct job *job_get(struct bus *bus, size_t len)
+{
+	struct job *job;
+
+	pthread_mutex_lock(&bus->lock);
+	job = bus->free;
+	if (job)
+		bus->free = job->next;
+	pthread_mutex_unlock(&bus->lock);
+
+	if (!job && !(job = calloc(1, sizeof(*job))))
+		return NULL;
+
+	if (job->size < len) {
+		char *buf = realloc(job->buf, len);
+
+		if (!buf) {
+			free(job->buf);
+			free(job);
+			return NULL;
+		}
+		job->buf  = buf;
+		job->size = len;
+	}
+	job->next = NULL;
+
+	return job;
+}
+
+/* After the last job of the same or higher priority, bus locked */
+static void enqueue(struct bus *bus, struct job *job)
+{
+	struct job **pp = &bus->head;
+
+	while (*pp && PRIO((*pp)->flags) >= PRIO(job->flags))
+		pp = &(*pp)->next;
+
+	job->next = *pp;
+	*pp = job;
+	if (!job->next)
+		bus->tail = job;
+}
+
+static void dequeue(struct bus *bus, struct job *job)
+{
+	struct job **pp = &bus->head, *prev = NULL;
+
+	while (*pp && *pp != job) {
+		prev = *pp;
+		pp = &(*pp)->next;
+	}
+	if (!*pp)
+		return;
+
+	*pp = job->next;
+	if (bus->tail == job)
+		bus->tail = prev;
+	job->next = NULL;
+}
+
+/* Add waiter to an identical queued job, bus locked, returns 0 if merged */
+static int merge(struct bus *bus, bus_cmd cb, const char *args, int flags, bus_done done, void *arg)
+{
+	struct job *job;
+
+	for (job = bus->head; job; job = job->next) {
+		if (!(job->flags & JOB_MERGE) || job->cb != cb || job->num >= JOB_WAITERS)
+			continue;
+		if (!job->w[0].done || strcmp(job->args ?: "", args ?: ""))
+			continue;
+		if (job->seq < bus->aborted)
+			continue;
+
+		job->w[job->num++] = (struct waiter){ done, arg, curr_out };
+		if (PRIO(flags) > PRIO(job->flags)) {
+			dequeue(bus, job);
+			job->flags = (job->flags & ~JOB_PRIO_MASK) | PRIO(flags);
+			enqueue(bus, job);
+		}
+		dbg("bus %d: merged with queued job, %d waiters", bus->id, job->num);
+
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Queue command on bus, done (optional) is called by the worker with its
+ * rc.  The output of the command goes where that of the calling thread
+ * goes, see bus_set_out().
+ */
+int bus_submit(struct bus *bus, bus_cmd cb, const char *args, int flags, bus_done done, void *arg)
+{
+	size_t len = args ? strlen(args) + 1 : 0;
+	struct job *job;
+
+	if ((flags & JOB_MERGE) && done) {
+		int rc;
+
+		pthread_mutex_lock(&bus->lock);
+		rc = merge(bus, cb, args, flags, done, arg);
+		pthread_mutex_unlock(&bus->lock);
+		if (!rc)
+			return 0;
+	}
+
+	job = job_get(bus, len);
+	if (!job)
+		return -1;
+
+	job->cb    = cb;
+	job->flags = flags;
+	job->w[0]  = (struct waiter){ done, arg, curr_out };
+	job->num   = 1;
+	job->args  = args ? memcpy(job->buf, args, len) : NULL;
+
+	pthread_mutex_lock(&bus->lock);
+	job->seq  = bus->seq++;
+	enqueue(bus, job);
+	pthread_cond_broadcast(&bus->cond);
+	pthread_mutex_unlock(&bus->lock);
+
+	return 0;
+}
+
+/* Wait for all submitted jobs to complete, returns their combined rc */
+int bus_wait(struct bus *bus)
+{
+	int rc;
+
+	pthread_mutex_lock(&bus->lock);
+	while (bus->head || bus->busy)
+		pthread_cond_wait(&bus->cond, &bus->lock);
+	rc = bus->rc;
+	bus->rc = 0;
+	pthread_mutex_unlock(&bus->lock);
+
+	return rc;
+}
+
+/* Stop the running command, and skip all queued, returns number of jobs */
+int bus_abort(struct bus *bus)
+{
+	int num = 0;
+
+	pthread_mutex_lock(&bus->lock);
+	bus->aborted = bus->seq;
+	for (struct job *job = bus->head; job; job = job->next)
+		num++;
+	if (bus->current)
+		num++;
+	pthread_mutex_unlock(&bus->lock);
+
+	return num;
+}
+
+/* For loops in commands, 0 when the program stops or the bus is aborted */
+int bus_active(void)
+{
+	struct bus *bus = self;
+	int active;
+
+	if (!running)
+		return 0;
+	if (!bus)
+		return 1;
+
+	pthread_mutex_lock(&bus->lock);
+	active = !bus->current || bus->current->seq >= bus->aborted;
+	pthread_mutex_unlock(&bus->lock);
+
+	return active;
+}
+
+/* Progress of running command, e.g. current address, shown by 'status' */
+void bus_progress(const char *fmt, ...)
+{
+	struct bus *bus = self;
+	va_list ap;
+
+	if (!bus)
+		return;
+
+	pthread_mutex_lock(&bus->lock);
+	va_start(ap, fmt);
+	vsnprintf(bus->progress, sizeof(bus->progress), fmt, ap);
+	va_end(ap);
+	pthread_mutex_unlock(&bus->lock);
+}
+
+void bus_status(struct bus *bus, struct bus_status *st)
+{
+	memset(st, 0, sizeof(*st));
+
+	pthread_mutex_lock(&bus->lock);
+	if (bus->current) {
+		st->cb      = bus->current->cb;
+		st->started = bus->started;
+		snprintf(st->args, sizeof(st->args), "%s", bus->current->args ?: "");
+		snprintf(st->progress, sizeof(st->progress), "%s", bus->progress);
+	}
+	for (struct job *job = bus->head; job; job = job->next)
+		st->queued++;
+	pthread_mutex_unlock(&bus->lock);
+}
+
+int bus_count(void)
+{
+	return num_buses;
+}
+
+struct bus *bus_get(int id)
+{
+	if (id < 0 || id >= num_buses)
+		return NULL;
+
+	return buses[id];
+}
+
+/* Find bus owning handle, for per-bus state in command callbacks */
+struct bus *bus_find(mbus_handle *handle)
+{
+	for (int i = 0; i < num_buses; i++) {
+		if (buses[i] && buses[i]->handle == handle)
+			return buses[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Outputs fp copies to, if it is the tee of a merged job, for the decode
+ * thread to tell them apart, e.g. for the CSV header.  Returns how many,
+ * 0 if fp is not a tee.
+ */
+int bus_tee_outs(FILE *fp, FILE **outs, int max)
+{
+	int num = 0;
+
+	for (int i = 0; i < num_buses; i++) {
+		struct bus *bus = buses[i];
+
+		if (!bus)
+			continue;
+
+		pthread_mutex_lock(&bus->lock);
+		if (fp && bus->tee == fp) {
+			for (int j = 0; j < bus->current->num && num < max; j++)
+				outs[num++] = bus->current->w[j].out ?: default_out ?: stdout;
+		}
+		pthread_mutex_unlock(&bus->lock);
+	}
+
+	return num;
+}
+
+/* Output of the command run by the calling thread */
+FILE *bus_out(void)
+{
+	return curr_out ?: default_out ?: stdout;
+}
+
+/*
+ * Where the decode thread puts the rc of telegrams received by the
+ * calling worker, the job's own when someone waits for it, so a command
+ * fails if its output did.  NULL: left for decode_wait().
+ */
+int *bus_rc(void)
+{
+	return curr_rc;
+}
+
+/* Set output for commands run, or submitted, by calling thread, NULL: default */
+void bus_set_out(FILE *fp)
+{
+	curr_out = fp;
+}
+
+/* Output when none is set, e.g. the output ring, NULL: stdout */
+void bus_default_out(FILE *fp)
+{
+	default_out = fp;
+}
+
+/* Bus of calling worker thread, NULL if not a bus worker */
+struct bus *bus_self(void)
+{
+	return self;
+}
+
+int bus_id(mbus_handle *handle)
+{
+	struct bus *bus = bus_find(handle);
+
+	return bus ? bus->id : 0;
+}
@@ -0,0 +1,265 @@
+/* Reading cache, last readout of each device with a time to live
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The last readout of each device is kept as the raw telegrams, as they
+ * were received.  A 'request' within the TTL is answered from here, the
+ * telegrams are queued to the decoder like those of a fresh readout, so
+ * output format, record selection and delta output work the same.  Use
+ * 'request -fresh' to always ask the device, which updates the cache.
+ *
+ * Entries are keyed on the bus and the address as given, primary or
+ * secondary.  Bus workers store and replay concurrently, so the table
+ * is protected by a mutex.  Telegrams are replayed from a copy, the
+ * decoder may block, the lock is not held meanwhile.
+ *
+ * When a device is given another primary address, or speed, whatever
+ * is cached for the old and new address is dropped by cache_forget().
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mbus-master.h"
+
+struct entry {
+	int         bus;
+	char        addr[17];		/* "": free slot */
+	time_t      when;
+	mbus_frame *frames;
+	size_t      num;
+	size_t      max;		/* room in frames */
+};
+
+static struct entry   *entries;
+static size_t          entries_num;
+static size_t          entries_max;	/* always power of two */
+static unsigned        ttl;		/* seconds, 0: off */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a, case insensitive for secondary addresses */
+static uint32_t hash(int bus, const char *addr)
+{
+	uint32_t h = 2166136261u;
+
+	h = (h ^ (unsigned char)bus) * 16777619u;
+	while (*addr)
+		h = (h ^ (unsigned char)toupper((unsigned char)*addr++)) * 16777619u;
+
+	return h;
+}
+
+static struct entry *slot(struct entry *tbl, size_t max, int bus, const char *addr)
+{
+	size_t i = hash(bus, addr) & (max - 1);
+
+	while (tbl[i].addr[0] && (tbl[i].bus != bus || strcasecmp(tbl[i].addr, addr)))
+		i = (i + 1) & (max - 1);
+
+	return &tbl[i];
+}
+
+static int rehash(size_t max)
+{
+	struct entry *tbl;
+
+	tbl = calloc(max, sizeof(*tbl));
+	if (!tbl)
+		return -1;
+
+	for (size_t i = 0; i < entries_max; i++) {
+		if (entries[i].addr[0])
+			*slot(tbl, max, entries[i].bus, entries[i].addr) = entries[i];
+	}
+
+	free(entries);
+	entries = tbl;
+	entries_max = max;
+
+	return 0;
+}
+
+static int grow(void)
+{
+	return rehash(entries_max ? entries_max * 2 : 64);
+}
+
+static void flush(void)
+{
+	for (size_t i = 0; i < entries_max; i++)
+		free(entries[i].frames);
+	free(entries);
+	entries = NULL;
+	entries_num = entries_max = 0;
+}
+
+/* Set time to live, in seconds, 0 disables and empties the cache */
+void cache_set(unsigned sec)
+{
+	pthread_mutex_lock(&lock);
+	ttl = sec;
+	if (!sec)
+		flush();
+	pthread_mutex_unlock(&lock);
+}
+
+unsigned cache_ttl(void)
+{
+	return ttl;
+}
+
+size_t cache_entries(void)
+{
+	return entries_num;
+}
+
+/* same device, primary addresses may be given as e.g. 5 or 005 */
+static int same(const struct entry *e, int bus, const char *addr)
+{
+	if (e->bus != bus)
+		return 0;
+	if (mbus_is_secondary_address(addr) || mbus_is_secondary_address(e->addr))
+		return !strcasecmp(e->addr, addr);
+
+	return atoi(e->addr) == atoi(addr);
+}
+
+/* Drop what is cached for address on bus, e.g. when it is reassigned */
+void cache_forget(int bus, const char *addr)
+{
+	size_t num = 0;
+
+	if (!addr)
+		return;
+
+	pthread_mutex_lock(&lock);
+	for (size_t i = 0; i < entries_max; i++) {
+		struct entry *e = &entries[i];
+
+		if (!e->addr[0] || !same(e, bus, addr))
+			continue;
+
+		free(e->frames);
+		memset(e, 0, sizeof(*e));
+		entries_num--;
+		num++;
+	}
+
+	/* free slots may break probe chains, it is only a cache */
+	if (num && rehash(entries_max))
+		flush();
+	pthread_mutex_unlock(&lock);
+
+	if (num)
+		dbg("bus %d: dropped %zu cached readouts of %s", bus, num, addr);
+}
+
+/* Store complete readout from device, num telegrams */
+int cache_put(int bus, const char *addr, const mbus_frame *frames, size_t num)
+{
+	struct entry *e;
+	int rc = -1;
+
+	if (!addr || strlen(addr) >= sizeof(e->addr))
+		return -1;
+
+	pthread_mutex_lock(&lock);
+	if (!ttl)
+		goto done;
+
+	/* keep load factor below 3/4 */
+	if ((entries_num + 1) * 4 > entries_max * 3 && grow())
+		goto done;
+
+	e = slot(entries, entries_max, bus, addr);
+	if (e->max < num) {
+		mbus_frame *tmp = realloc(e->frames, num * sizeof(mbus_frame));
+
+		if (!tmp)
+			goto done;
+		e->frames = tmp;
+		e->max = num;
+	}
+	if (!e->addr[0]) {
+		e->bus = bus;
+		strcpy(e->addr, addr);
+		entries_num++;
+	}
+
+	memcpy(e->frames, frames, num * sizeof(mbus_frame));
+	e->num  = num;
+	e->when = time(NULL);
+	rc = 0;
+done:
+	pthread_mutex_unlock(&lock);
+
+	return rc;
+}
+
+/*
+ * Replay last readout from device, if younger than the TTL, calling cb
+ * for each telegram.  Returns number of telegrams, or 0 on cache miss.
+ */
+size_t cache_replay(int bus, const char *addr, cache_cb cb, void *arg)
+{
+	mbus_frame *frames = NULL;
+	struct entry *e;
+	size_t num = 0;
+
+	if (!addr)
+		return 0;
+
+	pthread_mutex_lock(&lock);
+	if (!ttl || !entries)
+		goto done;
+
+	e = slot(entries, entries_max, bus, addr);
+	if (!e->addr[0] || !e->num || time(NULL) - e->when >= (time_t)ttl)
+		goto done;
+
+	frames = malloc(e->num * sizeof(mbus_frame));
+	if (!frames)
+		goto done;
+
+	dbg("bus %d: %s from cache, %lld s old", bus, addr, (long long)(time(NULL) - e->when));
+	memcpy(frames, e->frames, e->num * sizeof(mbus_frame));
+	num = e->num;
+done:
+	pthread_mutex_unlock(&lock);
+
+	for (size_t i = 0; i < num; i++)
+		cb(arg, &frames[i], i, num);
+	free(frames);
+
+	return num;
+}
+
+void cache_free(void)
+{
+	pthread_mutex_lock(&lock);
+	flush();
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,191 @@
+/* Decode and output worker, fed raw telegrams by the bus workers
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Bus workers only send requests and receive raw replies.  Each reply is
+ * received straight into a telegram slot, queued to the decode thread,
+ * and the worker goes on with the next request while the decode thread
+ * parses and writes out the previous reply.  There is a fixed number of
+ * slots, a worker blocks when all are in use, so a slow output cannot
+ * make the queue grow without bounds.
+ *
+ * Decoding in one thread has a side benefit, the libmbus decoders use
+ * static buffers and are not safe to call from several bus workers.
+ */
+
+#include <string.h>
+
+#include "mbus-master.h"
+
+static struct telegram  slots[DECODE_SLOTS];
+static struct telegram *free_list;
+static struct telegram *head, *tail;	/* queued, oldest first */
+static int              busy;		/* decoding one */
+static int              rc;
+static int              started;
+static int              stop;
+
+static pthread_t        thread;
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   cond = PTHREAD_COND_INITIALIZER;
+static decode_cb        decode;
+
+static void *decoder(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		struct telegram *t;
+		int result;
+
+		while (!head && !stop)
+			pthread_cond_wait(&cond, &lock);
+		if (!head)
+			break;
+
+		t = head;
+		head = t->next;
+		if (!head)
+			tail = NULL;
+		busy = 1;
+		pthread_mutex_unlock(&lock);
+
+		bus_set_out(t->out);
+		result = decode(t);
+		bus_set_out(NULL);
+
+		pthread_mutex_lock(&lock);
+		t->next = free_list;
+		free_list = t;
+		if (t->rc)
+			*t->rc |= result;
+		else
+			rc |= result;
+		busy = 0;
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+int decode_start(decode_cb cb)
+{
+	decode = cb;
+	for (int i = 0; i < DECODE_SLOTS; i++) {
+		slots[i].next = free_list;
+		free_list = &slots[i];
+	}
+
+	if (pthread_create(&thread, NULL, decoder, NULL))
+		return -1;
+	started = 1;
+
+	return 0;
+}
+
+/* Decode whatever is queued, then stop */
+void decode_stop(void)
+{
+	if (!started)
+		return;
+
+	pthread_mutex_lock(&lock);
+	stop = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+}
+
+/* Get a free slot to receive a telegram into, blocks while all are in use */
+struct telegram *decode_slot(void)
+{
+	struct telegram *t;
+
+	pthread_mutex_lock(&lock);
+	while (!free_list)
+		pthread_cond_wait(&cond, &lock);
+	t = free_list;
+	free_list = t->next;
+	pthread_mutex_unlock(&lock);
+
+	t->next = NULL;
+	t->out  = bus_out();
+	t->rc   = bus_rc();
+	t->replayed = 0;
+	t->frame.data_size = 0;
+	t->frame.next = NULL;
+
+	return t;
+}
+
+/* Queue received telegram for decoding */
+void decode_put(struct telegram *t)
+{
+	pthread_mutex_lock(&lock);
+	if (tail)
+		tail->next = t;
+	else
+		head = t;
+	tail = t;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* Return unused slot, e.g. when receive failed */
+void decode_drop(struct telegram *t)
+{
+	pthread_mutex_lock(&lock);
+	t->next = free_list;
+	free_list = t;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Wait for all queued telegrams to be written, returns the combined rc
+ * of those not decoded for a job, see bus_rc().
+ */
+int decode_wait(void)
+{
+	int result;
+
+	pthread_mutex_lock(&lock);
+	while (head || busy)
+		pthread_cond_wait(&cond, &lock);
+	result = rc;
+	rc = 0;
+	pthread_mutex_unlock(&lock);
+
+	return result;
+}
+
+/* Like decode_wait(), for a bus worker, the rc is left for decode_wait() */
+void decode_flush(void)
+{
+	pthread_mutex_lock(&lock);
+	while (head || busy)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
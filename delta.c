@@ -0,0 +1,189 @@
+/* Delta output, only records that changed since the last poll
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * For each meter, keyed by the 8 byte fixed header ID, we keep a hash of
+ * each record's raw bytes, keyed by record ID and checked against its
+ * DIF/VIF, so records that move around count as changed.  Only the first
+ * DELTA_RECORDS records of each meter are tracked, any after that are
+ * always written.  Every Nth readout of a meter is a keyframe, where all
+ * records are written.
+ *
+ * Only the decode thread uses the cache, so there is no locking.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbus-master.h"
+
+#define DELTA_RECORDS 64
+
+struct delta_rec {
+	uint64_t      hash;
+	unsigned char dif, vif;
+	unsigned char valid;
+};
+
+struct meter {
+	uint64_t          id;
+	unsigned          readouts;
+	struct delta_rec *recs;		/* DELTA_RECORDS */
+};
+
+static struct meter *meters;
+static size_t        meters_num;
+static size_t        meters_max;	/* always power of two */
+
+static volatile unsigned keyframe;	/* 0: delta output off */
+
+static uint64_t fnv1a(const unsigned char *p, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (len--)
+		h = (h ^ *p++) * 1099511628211ULL;
+
+	return h;
+}
+
+static uint64_t meter_id(const unsigned char *hdr)
+{
+	uint64_t id = 0;
+
+	for (int i = 0; i < 8; i++)
+		id = id << 8 | hdr[i];
+
+	return id;
+}
+
+static struct meter *slot(struct meter *tbl, size_t max, uint64_t id)
+{
+	size_t i = fnv1a((const unsigned char *)&id, sizeof(id)) & (max - 1);
+
+	while (tbl[i].recs && tbl[i].id != id)
+		i = (i + 1) & (max - 1);
+
+	return &tbl[i];
+}
+
+static int grow(void)
+{
+	size_t max = meters_max ? meters_max * 2 : 64;
+	struct meter *tbl;
+
+	tbl = calloc(max, sizeof(*tbl));
+	if (!tbl)
+		return -1;
+
+	for (size_t i = 0; i < meters_max; i++) {
+		if (meters[i].recs)
+			*slot(tbl, max, meters[i].id) = meters[i];
+	}
+
+	free(meters);
+	meters = tbl;
+	meters_max = max;
+
+	return 0;
+}
+
+/* Set keyframe interval, in readouts per meter, 0 disables delta output */
+void delta_set(unsigned interval)
+{
+	keyframe = interval;
+}
+
+unsigned delta_get(void)
+{
+	return keyframe;
+}
+
+/*
+ * Start of readout from meter with fixed header hdr.  Returns the meter,
+ * or NULL if delta output is off, or the cache is full, and sets *key if
+ * this readout is a keyframe.
+ */
+struct meter *delta_begin(const unsigned char *hdr, int *key)
+{
+	unsigned interval = keyframe;
+	uint64_t id = meter_id(hdr);
+	struct meter *m;
+
+	*key = 1;
+	if (!interval)
+		return NULL;
+
+	/* keep load factor below 3/4 */
+	if ((meters_num + 1) * 4 > meters_max * 3 && grow())
+		return NULL;
+
+	m = slot(meters, meters_max, id);
+	if (!m->recs) {
+		m->recs = calloc(DELTA_RECORDS, sizeof(struct delta_rec));
+		if (!m->recs)
+			return NULL;
+		m->id = id;
+		meters_num++;
+	}
+
+	*key = m->readouts++ % interval == 0;
+
+	return m;
+}
+
+/* Check record last returned by rec_next(), returns 1 if it has changed */
+int delta_changed(struct meter *m, struct rec_iter *it, mbus_data_record *rec, int id)
+{
+	struct delta_rec *r;
+	uint64_t hash;
+
+	if (!m || id < 0 || id >= DELTA_RECORDS)
+		return 1;
+
+	hash = fnv1a(&it->data[it->start], it->pos - it->start);
+	r = &m->recs[id];
+	if (r->valid && r->dif == rec->drh.dib.dif && r->vif == rec->drh.vib.vif && r->hash == hash)
+		return 0;
+
+	r->hash  = hash;
+	r->dif   = rec->drh.dib.dif;
+	r->vif   = rec->drh.vib.vif;
+	r->valid = 1;
+
+	return 1;
+}
+
+size_t delta_meters(void)
+{
+	return meters_num;
+}
+
+void delta_free(void)
+{
+	for (size_t i = 0; i < meters_max; i++)
+		free(meters[i].recs);
+	free(meters);
+	meters = NULL;
+	meters_num = meters_max = 0;
+}
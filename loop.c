@@ -0,0 +1,194 @@
+/* Event loop of the main thread, command input and worker wakeups
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The main thread never blocks on a bus.  It waits in poll() for input
+ * on any of the registered descriptors, e.g. the command input, and for
+ * wakeups from other threads, e.g. a bus worker that is done with a job.
+ * A wakeup is a byte written to a pipe, which is safe to do also from a
+ * signal handler.  Bus I/O is owned by the bus workers, their ports are
+ * not polled here.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "mbus-master.h"
+
+#define LOOP_MAX 32
+
+static struct pollfd pfd[LOOP_MAX + 1];	/* [0] is the wakeup pipe */
+static struct {
+	int     fd;
+	loop_cb cb;			/* NULL: deleted */
+	void   *arg;
+} handlers[LOOP_MAX + 1];
+static int nfds;
+static int wakeup[2] = { -1, -1 };
+
+int loop_init(void)
+{
+	if (pipe(wakeup))
+		return -1;
+
+	for (int i = 0; i < 2; i++) {
+		fcntl(wakeup[i], F_SETFL, fcntl(wakeup[i], F_GETFL) | O_NONBLOCK);
+		fcntl(wakeup[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	pfd[0].fd     = wakeup[0];
+	pfd[0].events = POLLIN;
+	nfds = 1;
+
+	return 0;
+}
+
+void loop_exit(void)
+{
+	for (int i = 0; i < 2; i++) {
+		if (wakeup[i] != -1)
+			close(wakeup[i]);
+		wakeup[i] = -1;
+	}
+	nfds = 0;
+}
+
+static int add(int fd, short events, loop_cb cb, void *arg)
+{
+	if (nfds >= (int)NELEMS(pfd)) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	pfd[nfds].fd       = fd;
+	pfd[nfds].events   = events;
+	pfd[nfds].revents  = 0;		/* slot may be reused in dispatch */
+	handlers[nfds].fd  = fd;
+	handlers[nfds].cb  = cb;
+	handlers[nfds].arg = arg;
+	nfds++;
+
+	return 0;
+}
+
+int loop_add(int fd, loop_cb cb, void *arg)
+{
+	return add(fd, POLLIN, cb, arg);
+}
+
+/* Call cb when fd is writable, pause it while there is nothing to write */
+int loop_add_out(int fd, loop_cb cb, void *arg)
+{
+	return add(fd, POLLOUT, cb, arg);
+}
+
+/* Safe to call from a callback, also for another descriptor */
+void loop_del(int fd)
+{
+	for (int i = 1; i < nfds; i++) {
+		if (handlers[i].fd != fd || !handlers[i].cb)
+			continue;
+
+		/* slot is compacted in loop_run() */
+		pfd[i].fd      = -1;
+		handlers[i].cb = NULL;
+	}
+}
+
+/*
+ * Stop, or resume, reading from fd, e.g. while its command is running.
+ * A negative fd is ignored by poll(), also for POLLHUP.
+ */
+void loop_pause(int fd, int pause)
+{
+	for (int i = 1; i < nfds; i++) {
+		if (handlers[i].fd == fd && handlers[i].cb)
+			pfd[i].fd = pause ? -1 : fd;
+	}
+}
+
+/* Any thread, or signal handler */
+void loop_wake(void)
+{
+	int saved = errno;
+	ssize_t len = 0;
+
+	/* a full pipe is fine, a wakeup is pending already */
+	if (wakeup[1] != -1)
+		len = write(wakeup[1], "", 1);
+	(void)len;
+	errno = saved;
+}
+
+static void compact(void)
+{
+	int j = 1;
+
+	for (int i = 1; i < nfds; i++) {
+		if (!handlers[i].cb)
+			continue;
+		pfd[j] = pfd[i];
+		handlers[j] = handlers[i];
+		j++;
+	}
+	nfds = j;
+}
+
+/*
+ * Run until 'running' is cleared, calling wake() after each wakeup, or
+ * signal, but at least every timeout milliseconds.
+ */
+void loop_run(void (*wake)(void), int timeout)
+{
+	while (running) {
+		int num;
+
+		compact();
+		num = poll(pfd, nfds, timeout);
+		if (num == -1 && errno != EINTR) {
+			warn("poll");
+			break;
+		}
+
+		if (num > 0 && pfd[0].revents) {
+			char buf[64];
+
+			while (read(wakeup[0], buf, sizeof(buf)) > 0)
+				;
+			num--;
+		}
+		if (wake)
+			wake();
+
+		for (int i = 1; num > 0 && i < nfds && running; i++) {
+			if (!pfd[i].revents)
+				continue;
+			num--;
+
+			if (pfd[i].fd != -1 && handlers[i].cb)
+				handlers[i].cb(handlers[i].fd, handlers[i].arg);
+		}
+	}
+}
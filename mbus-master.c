@@ -21,85 +21,180 @@
  * THE SOFTWARE.
  */
 
+#define _GNU_SOURCE		/* fopencookie() */
+#include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include <stdio.h>
-#include <mbus/mbus.h>
-
-#define dbg(...) if (debug) warnx(__VA_ARGS__)
-#define log(...)            warnx(__VA_ARGS__)
-
-/* From The Practice of Programming, by Kernighan and Pike */
-#ifndef NELEMS
-#define NELEMS(array) (sizeof(array) / sizeof(array[0]))
-#endif
+#include "mbus-master.h"
 
 static char *arg0 = "mbus-master";
-static char *device;
-static int   running = 1;
+static char *regfile;
+int          running = 1;
 static int   interactive = 1;
+static int   daemonize;
+static int   exit_rc;		/* e.g. failed commands of -f FILE */
 static int   parity = 1;
-static int   debug;
-static int   verbose;
-static int   xml;
-
-#define REG_NUM_MAX 50
-struct reg {
-	int   primary;
-	char *secondary;
-};
-static size_t num = 0;
-static struct reg registry[REG_NUM_MAX];
+int          debug;
+int          verbose;
+static int   format = OUT_TEXT;
+static char *ctrl_path;
+static int   ctrl_sd = -1;
+static volatile sig_atomic_t interrupted;
 
-static int reg_find_secondary(const char *secondary)
-{
-	for (size_t i = 0; i < num; i++) {
-		if (strcmp(registry[i].secondary, secondary))
-			continue;
+#define ALL_BUSES -1
+#define CMD_MAX   8192		/* command line length, but not of -f FILE */
+#define CTRL_BUF_MAX (1024 * 1024)	/* output queued for a client */
 
-		return i;
-	}
+/*
+ * Command input, stdin or -f FILE, and clients of the control socket.
+ * Interactive commands run in the background, the prompt is back at
+ * once and e.g. 'status' and 'abort' can be used while a scan is
+ * running.  From a file, or a client, each command is run to completion
+ * before the next is read, like before.  A client gets the output of its
+ * commands, each followed by a line with OK or ERROR.
+ *
+ * Client output is written from any thread, mostly the decode thread,
+ * so it is queued per client and sent from the event loop when the
+ * socket is writable.  A client that does not read is dropped when
+ * CTRL_BUF_MAX is queued, rather than stalling the decoder and, behind
+ * it, the bus workers.
+ */
+static struct source {
+	struct source *next;
+	int    fd;
+	FILE  *out;		/* NULL: stdout */
+	int    client;		/* of control socket */
+	int    bus;		/* default for commands, see 'bus' */
+	int    prio;		/* of its jobs, JOB_* */
+	char   buf[CMD_MAX + 1];
+	size_t len;
+	int    wait;		/* for each command before the next */
+	int    eof;
+	int    busy;		/* has jobs on the buses */
+	int    pending;		/* jobs not done, src_lock */
+	int    rc;
+
+	int    ofd;		/* client, dup of fd, polled for output */
+	pthread_mutex_t olock;
+	char  *obuf;		/* not sent yet, olock */
+	size_t olen, omax;
+	int    dead;		/* overflow, or send failed, olock */
+} input = { .fd = -1, .ofd = -1, .prio = JOB_NORMAL };
+
+static struct source  *sources = &input;
+static struct source  *curr_src = &input;	/* running a command */
+static pthread_mutex_t src_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* statistics hooks, also dump frames in debug mode */
+static int mbus_hooks(mbus_handle *handle)
+{
+	mbus_register_send_event(handle, stats_send_event);
+	mbus_register_recv_event(handle, stats_recv_event);
 
-	return -1;
+	return 0;
 }
 
-static int reg_add(const char *secondary)
+/* called by the bus worker */
+static void cmd_done(void *arg, int rc)
 {
-	if (num >= REG_NUM_MAX)
-		return -1;
-	if (reg_find_secondary(secondary) >= 0)
-		return 0;	/* already */
+	struct source *src = arg;
 
-	registry[num].secondary = strdup(secondary);
-	num++;
+	pthread_mutex_lock(&src_lock);
+	src->rc |= rc;
+	src->pending--;
+	pthread_mutex_unlock(&src_lock);
 
-	return 0;
+	loop_wake();
 }
 
+static int source_pending(struct source *src)
+{
+	int pending;
+
+	pthread_mutex_lock(&src_lock);
+	pending = src->pending;
+	pthread_mutex_unlock(&src_lock);
+
+	return pending;
+}
 
-static int mbus_debug(mbus_handle *handle, int enable)
+/*
+ * Run command on one or all buses, each bus worker runs its commands in
+ * order.  Returns at once, cmd_done() is called for each bus.
+ */
+static int submit_on(struct source *src, int target, bus_cmd cb, char *args, int flags)
 {
-	if (enable) {
-		mbus_register_send_event(handle, mbus_dump_send_event);
-		mbus_register_recv_event(handle, mbus_dump_recv_event);
-	} else {
-		mbus_register_send_event(handle, NULL);
-		mbus_register_recv_event(handle, NULL);
+	int rc = 0;
+
+	for (int i = 0; i < bus_count(); i++) {
+		if (target != ALL_BUSES && target != i)
+			continue;
+
+		pthread_mutex_lock(&src_lock);
+		src->pending++;
+		pthread_mutex_unlock(&src_lock);
+
+		if (bus_submit(bus_get(i), cb, args, flags, cmd_done, src)) {
+			warn("failed queuing command on bus %d", i);
+			cmd_done(src, 1);
+			rc = 1;
+		}
 	}
+	src->busy = 1;
 
-	return 0;
+	return rc;
+}
+
+#define RESET_AGE 600		/* seconds, slaves are reset at least this often */
+
+/* next FCB of a device addressed by its secondary address */
+struct fcb {
+	char          secondary[17];
+	unsigned char next;
+};
+
+/*
+ * Slave state, per bus, is only used by its worker.  After a reset every
+ * slave expects the FCB set in its next request, which it then toggles
+ * with each one it answers.  So the next FCB is tracked per primary, and
+ * per selected secondary address, and the selected device is not selected
+ * again.  Anything that leaves the slaves in an unknown state, a failed
+ * request, a change of port speed, other commands than request and poll,
+ * or a select by wildcard mask, forgets it, and the next request resets.
+ *
+ * A device addressed both by primary and secondary address has its FCB
+ * tracked twice, if it is wrong the device repeats its last reply, which
+ * lasts until the next reset, at most RESET_AGE seconds.
+ */
+void slaves_unknown(struct bus *bus)
+{
+	bus->reset = 0;
+	bus->selected[0] = 0;
 }
 
 /*
- * init slaves to get really the beginning of the records
+ * Reset slaves, to get really the beginning of the records, and deselect
+ * any selected.  Leaves the slave state unknown, see init_slaves().
  */
-static int init_slaves(mbus_handle *handle)
+static int reset_slaves(mbus_handle *handle)
 {
+	slaves_unknown(bus_find(handle));
+
 	if (mbus_send_ping_frame(handle, MBUS_ADDRESS_NETWORK_LAYER, 1) == -1) {
 	error:
 		warnx("Failed initializing M-Bus slaves: %s", mbus_error_str());
@@ -112,7 +207,59 @@ static int init_slaves(mbus_handle *handle)
 	return 0;
 }
 
-static int ping_address(mbus_handle *handle, mbus_frame *reply, int address)
+/* Reset slaves for requests, unless already in a known state */
+static int init_slaves(mbus_handle *handle)
+{
+	struct bus *bus = bus_find(handle);
+
+	if (bus->reset && time(NULL) - bus->reset < RESET_AGE)
+		return 0;
+
+	if (reset_slaves(handle))
+		return -1;
+
+	bus->reset = time(NULL);
+	memset(bus->fcb, 1, sizeof(bus->fcb));
+	bus->fcbs_num = 0;
+
+	return 0;
+}
+
+/* Next FCB of device at address, NULL if not known */
+static unsigned char *fcb_of(struct bus *bus, int address)
+{
+	struct fcb *list = bus->fcbs;
+
+	if (!bus->reset)
+		return NULL;
+	if (address != MBUS_ADDRESS_NETWORK_LAYER)
+		return &bus->fcb[address];
+	if (!bus->selected[0])
+		return NULL;
+
+	for (size_t i = 0; i < bus->fcbs_num; i++) {
+		if (!strcmp(list[i].secondary, bus->selected))
+			return &list[i].next;
+	}
+
+	if (bus->fcbs_num == bus->fcbs_max) {
+		size_t max = bus->fcbs_max ? bus->fcbs_max * 2 : 16;
+
+		list = realloc(bus->fcbs, max * sizeof(*list));
+		if (!list)
+			return NULL;
+		bus->fcbs = list;
+		bus->fcbs_max = max;
+	}
+
+	list = &list[bus->fcbs_num++];
+	strcpy(list->secondary, bus->selected);
+	list->next = 1;
+
+	return &list->next;
+}
+
+static int ping_address(mbus_handle *handle, mbus_frame *reply, int address, int *tries)
 {
 	int i, rc = MBUS_RECV_RESULT_ERROR;
 
@@ -124,6 +271,7 @@ static int ping_address(mbus_handle *handle, mbus_frame *reply, int address)
 			fflush(stdout);
 		}
 
+		(*tries)++;
 		if (mbus_send_ping_frame(handle, address, 0) == -1) {
 			warnx("Failed sending ping frame: %s", mbus_error_str());
 			return MBUS_RECV_RESULT_ERROR;
@@ -137,35 +285,212 @@ static int ping_address(mbus_handle *handle, mbus_frame *reply, int address)
 	return rc;
 }
 
-static int mbus_scan_1st_address_range(mbus_handle *handle)
+/* monotonic time in milliseconds, for timing bus transactions */
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * EN 13757-2: a slave must start its reply within 330 bit periods + 50
+ * ms.  We add a small margin for USB level converters, which buffer, or
+ * for the network to a TCP converter.
+ */
+static int ack_timeout(mbus_handle *handle)
+{
+	struct bus *bus = bus_find(handle);
+	long baudrate = bus ? bus->speed : 2400;
+
+	return (int)(330 * 1000 / baudrate) + 50 + (bus && bus->tcp ? TCP_LATENCY : 20);
+}
+
+/*
+ * Change port speed, for talking to devices at another speed than the
+ * bus default.  Callers restore bus->baudrate when done.
+ */
+static int set_speed(struct bus *bus, long rate)
+{
+	if (bus->speed == rate)
+		return 0;
+
+	/* the converter talks to the bus at the speed it is set up for */
+	if (bus->tcp) {
+		warnx("bus %d: cannot change line speed of %s to %ld", bus->id, bus->device, rate);
+		return -1;
+	}
+
+	if (mbus_serial_set_baudrate(bus->handle, rate) == -1) {
+		warnx("Failed setting baud rate %ld on serial port %s: %s",
+		      rate, bus->device, mbus_error_str());
+		return -1;
+	}
+	bus->speed = rate;
+	slaves_unknown(bus);
+	dbg("bus %d: port speed now %ld, ACK timeout %d ms", bus->id, rate, ack_timeout(bus->handle));
+
+	return 0;
+}
+
+/* speed of device from registry, or bus default */
+static long device_speed(struct bus *bus, const char *addr)
+{
+	struct reg *r = reg_find(bus->id, addr);
+
+	if (r && r->baudrate)
+		return r->baudrate;
+
+	return bus->baudrate;
+}
+
+/* wait for the first byte of a reply, returns 0 on timeout */
+static int wait_reply(mbus_handle *handle, int timeout)
+{
+	struct pollfd pfd = { .fd = handle->fd, .events = POLLIN };
+	int rc;
+
+	do
+		rc = poll(&pfd, 1, timeout);
+	while (rc == -1 && errno == EINTR && running);
+
+	return rc;
+}
+
+/*
+ * Like ping_address(), but gives up on an address as soon as the first
+ * byte timeout expires.  Silence is never retried, only partial or
+ * garbled replies are, after purging whatever is left on the line.
+ */
+static int ping_address_fast(mbus_handle *handle, mbus_frame *reply, int address, int *tries)
+{
+	int i, rc = MBUS_RECV_RESULT_TIMEOUT;
+
+	memset(reply, 0, sizeof(mbus_frame));
+
+	for (i = 0; i <= handle->max_search_retry; i++) {
+		if (debug) {
+			printf("%d ", address);
+			fflush(stdout);
+		}
+
+		(*tries)++;
+		if (mbus_send_ping_frame(handle, address, 0) == -1) {
+			warnx("Failed sending ping frame: %s", mbus_error_str());
+			return MBUS_RECV_RESULT_ERROR;
+		}
+
+		rc = wait_reply(handle, ack_timeout(handle));
+		if (rc == -1)
+			return MBUS_RECV_RESULT_ERROR;
+		if (rc == 0)
+			return MBUS_RECV_RESULT_TIMEOUT;
+
+		rc = mbus_recv_frame(handle, reply);
+		if (rc == MBUS_RECV_RESULT_OK || rc == MBUS_RECV_RESULT_ERROR)
+			return rc;
+
+		mbus_purge_frames(handle);
+	}
+
+	/* we got something, just not anything we could make sense of */
+	return MBUS_RECV_RESULT_INVALID;
+}
+
+struct scan_result {
+	int       rc;
+	int       tries;
+	long long ms;
+};
+
+static void scan_summary(struct scan_result *res, int last, long long total)
+{
+	FILE *fp = bus_out();
+	int found = 0, collisions = 0, empty = 0;
+	long long empty_ms = 0;
+
+	fprintf(fp, "Addr  Result     Tries  Time (ms)\n");
+	for (int address = 0; address <= last; address++) {
+		struct scan_result *r = &res[address];
+		const char *result;
+
+		switch (r->rc) {
+		case MBUS_RECV_RESULT_OK:
+			result = "found";
+			found++;
+			break;
+		case MBUS_RECV_RESULT_INVALID:
+			result = "collision";
+			collisions++;
+			break;
+		case MBUS_RECV_RESULT_TIMEOUT:
+			result = "empty";
+			empty_ms += r->ms;
+			empty++;
+			break;
+		default:
+			result = "failed";
+			break;
+		}
+
+		if (r->rc == MBUS_RECV_RESULT_TIMEOUT && !verbose)
+			continue;
+
+		fprintf(fp, "%4d  %-9s  %5d  %9lld\n", address, result, r->tries, r->ms);
+	}
+
+	fprintf(fp, "Scanned %d addresses in %lld ms: %d found, %d collisions, %d empty (avg %lld ms)\n",
+		last + 1, total, found, collisions, empty, empty ? empty_ms / empty : 0);
+}
+
+/* Scan all primary addresses, res gets the result of each, up to *last */
+static int mbus_scan_1st_address_range(mbus_handle *handle, int fast, struct scan_result *res, int *last)
 {
+	long long start = now_ms();
 	int address;
 	int rc = 1;
 
 	for (address = 0; address <= MBUS_MAX_PRIMARY_SLAVES; address++) {
+		struct scan_result *r = &res[address];
 		mbus_frame reply;
 
-		if (!running)
+		if (!bus_active())
 			break;
+		bus_progress("address %d", address);
+
+		r->tries = 0;
+		r->ms = now_ms();
+		if (fast)
+			rc = ping_address_fast(handle, &reply, address, &r->tries);
+		else
+			rc = ping_address(handle, &reply, address, &r->tries);
+		r->ms = now_ms() - r->ms;
+		r->rc = rc;
 
-		rc = ping_address(handle, &reply, address);
 		if (rc == MBUS_RECV_RESULT_TIMEOUT)
 			continue;
 
 		if (rc == MBUS_RECV_RESULT_INVALID) {
-			mbus_purge_frames(handle);
+			if (!fast)
+				mbus_purge_frames(handle);
 			warnx("collision at address %d.", address);
+			stats_collision(bus_id(handle), address);
 			continue;
 		}
 
 		if (rc == MBUS_RECV_RESULT_ERROR) {
 			warn("failed scanning primary addresses, %s", mbus_error_str());
+			address++;	/* in the summary, as failed */
 			break;
 		}
 
 		if (mbus_frame_type(&reply) == MBUS_FRAME_TYPE_ACK) {
 			if (mbus_purge_frames(handle)) {
 				warnx("collision at address %d.", address);
+				stats_collision(bus_id(handle), address);
+				r->rc = MBUS_RECV_RESULT_INVALID;
 				continue;
 			}
 
@@ -174,70 +499,134 @@ static int mbus_scan_1st_address_range(mbus_handle *handle)
 		}
 	}
 
+	*last = address - 1;
+	scan_summary(res, *last, now_ms() - start);
+
 	return rc;
 }
 
+static int resolve_collisions(mbus_handle *handle, struct scan_result *res, int last);
+
 static int scan_devices(mbus_handle *handle, char *args)
 {
-	(void)args;
+	struct scan_result res[MBUS_MAX_PRIMARY_SLAVES + 1];
+	int fast = 0, resolve = 0;
+	int last, rc;
+	char *arg;
 
-	if (init_slaves(handle))
+	while ((arg = strsep(&args, " \n\t"))) {
+		if (*arg == 0)
+			continue;
+		if (!strcmp(arg, "fast"))
+			fast = 1;
+		else if (!strcmp(arg, "resolve"))
+			resolve = 1;
+		else {
+			warnx("unknown scan mode '%s'.", arg);
+			return 1;
+		}
+	}
+
+	if (reset_slaves(handle))
 		return -1;
 
-	return mbus_scan_1st_address_range(handle);
+	rc = mbus_scan_1st_address_range(handle, fast, res, &last);
+	if (resolve && bus_active())
+		rc |= resolve_collisions(handle, res, last);
+
+	return rc;
 }
 
 static int found_device(void *arg, const char *addr, const char *mask)
 {
-	if (reg_add(addr))
-		log("Found %s with address mask %s\n", addr, mask);
+	mbus_handle *handle = arg;
+
+	dbg("found %s with address mask %s", addr, mask);
+	if (!reg_add(bus_id(handle), addr))
+		warnx("failed adding %s to registry: %s", addr, strerror(errno));
 
 	return 0;
 }
 
 static int probe_devices(mbus_handle *handle, char *args)
 {
+	FILE *fp = bus_out();
+	struct bus *bus = bus_find(handle);
 	char *mask = "FFFFFFFFFFFFFFFF";
+	int fresh = 0;
+	size_t num;
+	char *arg;
 
-	if (init_slaves(handle))
-		return 1;
-
-	if (args)
-		mask = args;
+	while ((arg = strsep(&args, " \n\t"))) {
+		if (*arg == 0)
+			continue;
+		if (!strcmp(arg, "fresh"))
+			fresh = 1;
+		else
+			mask = arg;
+	}
 
 	if (!mbus_is_secondary_address(mask)) {
 		warnx("malformed secondary address mask, must be 16 char HEX number.");
 		return 1;
 	}
 
-	if (mbus_probe_secondary_range(handle, 0, mask, found_device, NULL)) {
+	if (reset_slaves(handle))
+		return 1;
+
+	if (probe_secondary_range(handle, mask, fresh, found_device, handle) < 0) {
 		warnx("failed probe, %s", mbus_error_str());
 		return 1;
 	}
 
-	for (size_t i = 0; i < num; i++)
-		printf("%3d  %s\n", registry[i].primary, registry[i].secondary);
+	if (reg_list(bus->id, &bus->regs, &bus->regs_max, &num))
+		return 1;
+
+	flockfile(fp);
+	for (size_t i = 0; i < num; i++) {
+		struct reg *r = bus->regs[i];
+
+		fprintf(fp, "%3d  %s", r->primary, r->secondary);
+		if (verbose)
+			fprintf(fp, "  %s  v%-3d  %s", r->manufacturer, r->version,
+				mbus_data_variable_medium_lookup(r->medium));
+		fprintf(fp, "\n");
+	}
+	funlockfile(fp);
 
 	return 0;
 }
 
+/* The master is shared, a control client can only close its connection */
 static int quit_program(mbus_handle *handle, char *args)
 {
 	(void)handle;
 	(void)args;
+
+	if (curr_src->client) {
+		warnx("quit not allowed from control socket, close the connection instead.");
+		return 1;
+	}
+
 	return running = 0;
 }
 
-static int secondary_select(mbus_handle *handle, char *mask)
+/* Select by mask, exact if it is the address of one device, to track it */
+static int select_mask(mbus_handle *handle, const char *mask, int exact, int quiet)
 {
+	struct bus *bus = bus_find(handle);
+
 	dbg("sending secondary select for mask %s", mask);
 
+	/* a select deselects all others, even if none matches */
+	bus->selected[0] = 0;
 	switch (mbus_select_secondary_address(handle, mask)) {
 	case MBUS_PROBE_COLLISION:
 		warnx("address mask [%s] matches more than one device.", mask);
 		return -1;
 	case MBUS_PROBE_NOTHING:
-		warnx("address mask [%s] does not match any device.", mask);
+		if (!quiet)
+			warnx("address mask [%s] does not match any device.", mask);
 		return -1;
 	case MBUS_PROBE_ERROR:
 		warnx("failed selecting secondary address [%s].", mask);
@@ -245,478 +634,2830 @@ static int secondary_select(mbus_handle *handle, char *mask)
 	case MBUS_PROBE_SINGLE:
 		dbg("address mask [%s] matches a single device.", mask);
 		break;
-	}        
+	}
+
+	if (exact) {
+		for (int i = 0; i < 16; i++)
+			bus->selected[i] = toupper((unsigned char)mask[i]);
+		bus->selected[16] = 0;
+	}
 
 	return MBUS_ADDRESS_NETWORK_LAYER;
 }
 
-static int parse_addr(mbus_handle *handle, char *args)
+/*
+ * Select device by secondary address, or mask.  The mask is first matched
+ * against the registry, a mask that matches several known devices is an
+ * error without asking the bus, and one that matches a single device is
+ * sent as the full address of that device, so no unknown device collides.
+ * Only when the registry does not know, or is stale, the bus is asked with
+ * the mask as given, after a reset, since which device answers, and its
+ * FCB, is not known.  A device already selected is not selected again.
+ *
+ * F is a valid digit in the manufacturer, version and medium, so a mask
+ * with F is still the address of one device if it is that of a known
+ * device.  Only an unknown one with F is taken as a wildcard.
+ */
+static int secondary_select(mbus_handle *handle, char *mask)
 {
-	int address;
+	struct bus *bus = bus_find(handle);
+	char addr[17];
+	int num, exact;
 
-	if (!args) {
-		warnx("missing required argument, address, can be primary or secondary.");
-		return 1;
+	num = reg_match(bus->id, mask, addr);
+	if (num > 1) {
+		warnx("address mask [%s] matches %d known devices.", mask, num);
+		return -1;
 	}
 
-	if (init_slaves(handle))
-		return 1;
+	exact = num == 1 ? !strcasecmp(addr, mask) : !strpbrk(mask, "Ff");
+	if (num == 0 && exact)
+		snprintf(addr, sizeof(addr), "%s", mask);
+	else if (num == 0)
+		addr[0] = 0;
 
-	if (mbus_is_secondary_address(args)) {
-		if (secondary_select(handle, args) == -1)
-			return 1;
+	if (addr[0] && bus->selected[0] && !strcasecmp(addr, bus->selected)) {
+		dbg("device %s already selected", addr);
+		return MBUS_ADDRESS_NETWORK_LAYER;
+	}
+
+	if (num == 1 && strcasecmp(addr, mask)) {
+		dbg("address mask [%s] is known device %s", mask, addr);
+		if (select_mask(handle, addr, 1, 1) != -1)
+			return MBUS_ADDRESS_NETWORK_LAYER;
+	}
+
+	if (!exact && bus->reset && reset_slaves(handle))
+		return -1;
+
+	return select_mask(handle, mask, exact, 0);
+}
+
+/*
+ * Resolve a primary or secondary address, the latter is also selected.
+ * Returns the address to use for requests, or -1 on error.
+ */
+static int resolve_addr(mbus_handle *handle, char *arg)
+{
+	int address;
+
+	if (mbus_is_secondary_address(arg)) {
+		if (secondary_select(handle, arg) == -1)
+			return -1;
 		address = MBUS_ADDRESS_NETWORK_LAYER;
 	} else {
-		address = atoi(args);
+		address = atoi(arg);
 		if (address < 1 || address > 255) {
-			warnx("invalid primary address %s.", args);
-			return 1;
+			warnx("invalid primary address %s.", arg);
+			return -1;
 		}
 	}
 
 	return address;
 }
 
-static int query_device(mbus_handle *handle, char *args)
+static int parse_addr(mbus_handle *handle, char *args)
 {
-	mbus_frame_data data;
-	mbus_frame reply;
-	char *addr_arg;
-	int address;
-
-	addr_arg = strsep(&args, " \n\t");
-	address = parse_addr(handle, addr_arg);
-	if (mbus_send_request_frame(handle, address) == -1) {
-		warnx("failed sending M-Bus request to %d.", address);
-		return 1;
+	if (!args) {
+		warnx("missing required argument, address, can be primary or secondary.");
+		return -1;
 	}
 
-	if (mbus_recv_frame(handle, &reply) != MBUS_RECV_RESULT_OK) {
-		warn("failed receiving M-Bus response from %d, %s", address, mbus_error_str());
-		return 1;
-	}
+	if (init_slaves(handle))
+		return -1;
 
-	if (!args && !verbose && !xml) {
-		mbus_hex_dump("RAW:", (const char *)reply.data, reply.data_size);
-		return 0;
-	}
+	return resolve_addr(handle, args);
+}
 
-	if (mbus_frame_data_parse(&reply, &data) == -1) {
-		warnx("M-bus data parse error: %s", mbus_error_str());
-		return 1;
-	}
+#define MAX_TELEGRAMS  64
 
-	if (!args) {
-		/* Dump entire response as XML */
-		if (xml) {
-			char *xml_data;
+static int parse_ids(struct select *sel, char *args)
+{
+	char *arg;
 
-			if (!(xml_data = mbus_frame_data_xml(&data))) {
-				warnx("failed generating XML output of M-BUS response: %s", mbus_error_str());
-				return 1;
-			}
+	memset(sel, 0, sizeof(*sel));
+	while ((arg = strsep(&args, " \n\t"))) {
+		if (*arg == 0)
+			continue;
 
-			printf("%s", xml_data);
-			free(xml_data);
-		} else {
-			mbus_frame_data_print(&data);
+		if (sel->num >= MAX_RECORD_IDS) {
+			warnx("too many record IDs, max %d.", MAX_RECORD_IDS);
+			return 1;
 		}
+		sel->ids[sel->num++] = atoi(arg);
+	}
 
-		if (data.data_var.record)
-			mbus_data_record_free(data.data_var.record);
-	} else {
-		int record_id;
+	return 0;
+}
 
-		/* Query for a single record */
-		record_id = atoi(args);
+/* Show the values found, in the order asked for */
+static void show_values(struct value *vals, int *found, int num)
+{
+	FILE *fp = bus_out();
 
-		if (data.type == MBUS_DATA_TYPE_FIXED) {
-			/* TODO: Implement this -- Not fixed in BCT --Joachim */
-		}
-		if (data.type == MBUS_DATA_TYPE_VARIABLE) {
-			mbus_data_record *entry;
-			mbus_record *record;
-			int i;
+	for (int i = 0; i < num; i++) {
+		struct value *val = &vals[i];
 
-			for (entry = data.data_var.record, i = 0; entry; entry = entry->next, i++) {
-				dbg("record ID %d DIF %02x VID %02x", i,
-				    entry->drh.dib.dif & MBUS_DATA_RECORD_DIF_MASK_DATA,
-				    entry->drh.vib.vif & MBUS_DIB_VIF_WITHOUT_EXTENSION);
-			}
+		if (!found[i])
+			continue;
 
-			for (entry = data.data_var.record, i = 0; entry && i < record_id; entry = entry->next, i++)
-				;
+		if (val->numeric)
+			fprintf(fp, "%lf", val->real);
+		else
+			fprintf(fp, "%s", val->str);
+		if (verbose)
+			fprintf(fp, " %s\n", val->unit);
+		else
+			fprintf(fp, "\n");
+	}
+}
 
-			if (i != record_id) {
-				if (data.data_var.record)
-					mbus_data_record_free(data.data_var.record);
+/*
+ * Show the records asked for in this telegram, in the order given.  The
+ * raw reply is scanned only once, and only those records are decoded.
+ */
+static void show_records(struct rec_iter *it, struct select *sel, struct profile *prof)
+{
+	struct value vals[MAX_RECORD_IDS];
+	int found[MAX_RECORD_IDS] = { 0 };
+	mbus_data_record rec;
+	int id;
+
+	while ((id = rec_next(it, &rec)) >= 0) {
+		dbg("record ID %d DIF %02x VID %02x", id,
+		    rec.drh.dib.dif & MBUS_DATA_RECORD_DIF_MASK_DATA,
+		    rec.drh.vib.vif & MBUS_DIB_VIF_WITHOUT_EXTENSION);
+
+		for (int i = 0; i < sel->num; i++) {
+			if (sel->ids[i] != id || sel->found[i])
+				continue;
 
-				mbus_frame_free(reply.next);
-				return 1;
-			}
+			if (profile_value(prof, it, &rec, id, &vals[i]))
+				warnx("failed decoding record ID %d: %s", id, mbus_error_str());
+			else
+				sel->found[i] = found[i] = 1;
+		}
+	}
+	if (it->error)
+		warnx("M-bus data parse error at record ID %d.", it->id);
 
-			record = mbus_parse_variable_record(entry);
-			if (record) {
-				if (record->is_numeric)
-					printf("%lf", record->value.real_val);
-				else
-					printf("%s", record->value.str_val.value);
-				if (verbose)
-					printf(" %s\n", record->unit);
-				else
-					printf("\n");
-			}
+	show_values(vals, found, sel->num);
+}
+
+/* Like show_records(), for the counters and status of a fixed data response */
+static void show_fixed(mbus_frame *frame, struct select *sel)
+{
+	struct value vals[MAX_RECORD_IDS];
+	int found[MAX_RECORD_IDS] = { 0 };
+
+	for (int i = 0; i < sel->num; i++) {
+		if (sel->found[i] || rec_fixed(frame, sel->ids[i], &vals[i]))
+			continue;
+		sel->found[i] = found[i] = 1;
+	}
+
+	show_values(vals, found, sel->num);
+}
+
+/* Like mbus_hex_dump(), which can only write to stdout */
+static void hex_dump(FILE *fp, const char *label, const unsigned char *data, size_t len)
+{
+	fprintf(fp, "%s", label);
+	for (size_t i = 0; i < len; i++)
+		fprintf(fp, " %02X", data[i]);
+	fprintf(fp, "\n");
+}
 
+/*
+ * Show full reply, raw or decoded, depending on output mode.  The libmbus
+ * text dump can only write to stdout, for a client it is XML instead.
+ */
+static int show_reply(mbus_frame *frame)
+{
+	mbus_frame_data data;
+	mbus_frame reply = *frame;
+	FILE *fp = bus_out();
+
+	if (!verbose && format == OUT_TEXT) {
+		if (fp == stdout)
+			mbus_hex_dump("RAW:", (const char *)reply.data, reply.data_size);
+		else
+			hex_dump(fp, "RAW:", reply.data, reply.data_size);
+		return 0;
+	}
+
+	/* a failed parse may have got some records already */
+	memset(&data, 0, sizeof(data));
+	if (mbus_frame_data_parse(&reply, &data) == -1) {
+		warnx("M-bus data parse error: %s", mbus_error_str());
+		if (data.data_var.record)
+			mbus_data_record_free(data.data_var.record);
+		return 1;
+	}
+
+	/* Dump entire response as XML */
+	if (format == OUT_XML || fp != stdout) {
+		char *xml_data;
+
+		if (!(xml_data = mbus_frame_data_xml(&data))) {
+			warnx("failed generating XML output of M-BUS response: %s", mbus_error_str());
 			if (data.data_var.record)
 				mbus_data_record_free(data.data_var.record);
+			return 1;
 		}
-		mbus_frame_free(reply.next);
+
+		fprintf(fp, "%s", xml_data);
+		free(xml_data);
+	} else {
+		mbus_frame_data_print(&data);
 	}
 
+	if (data.data_var.record)
+		mbus_data_record_free(data.data_var.record);
+
 	return 0;
 }
 
-static int set_address(mbus_handle *handle, char *args)
+/* per bus readout in progress, only used by the decode thread */
+static struct readout {
+	struct select sel;
+	int           has_sel;
+	int           first;		/* record ID */
+	struct meter *meter;		/* delta output */
+	int           keyframe;
+	struct profile *profile;	/* of meter model */
+} readouts[BUS_MAX];
+
+/*
+ * Write records in one of the compact formats, all or the ones asked
+ * for, in the order they appear in the telegram.  With delta output
+ * only changed records are written, except in keyframes.
+ */
+static int out_records(int bus, mbus_frame *frame, struct rec_iter *it, struct readout *r)
 {
-	mbus_frame reply;
-	int curr, next;
-	int id = -1;
-	char *mask;
+	struct select *sel = r->has_sel ? &r->sel : NULL;
+	mbus_data_record rec;
+	int id, rc = 0;
 
-	if (!args) {
-	syntax:
-		warnx("missing argument.\nUsage: set <MASK | ADDR> NEW_ADDR");
-		return 1;
+	while ((id = rec_next(it, &rec)) >= 0) {
+		int want = !sel;
+
+		for (int i = 0; sel && i < sel->num; i++) {
+			if (sel->ids[i] == id && !sel->found[i])
+				want = sel->found[i] = 1;
+		}
+		if (!want)
+			continue;
+
+		if (r->meter && !delta_changed(r->meter, it, &rec, id) && !r->keyframe)
+			continue;
+
+		if (out_record(bus_out(), format, bus, frame, it, &rec, id, r->profile))
+			rc = -1;
+	}
+	if (it->error) {
+		warnx("M-bus data parse error at record ID %d.", it->id);
+		rc = -1;
 	}
 
-	mask = strsep(&args, " \n\t");
-	if (!args || *args == 0)
-		goto syntax;
+	return rc;
+}
 
-	if (!mbus_is_secondary_address(mask)) {
-		id = -1;
-		curr = atoi(mask);
-		if (curr < 0 || curr > 250) {
-			warnx("invalid secondary address [%s], also not a primary address (0-250).", args);
+/* Like out_records(), for the counters and status of a fixed data response */
+static int out_fixed_records(int bus, mbus_frame *frame, struct readout *r)
+{
+	struct select *sel = r->has_sel ? &r->sel : NULL;
+	int rc = 0;
+
+	for (int id = 0; id < REC_FIXED_NUM; id++) {
+		int want = !sel;
+
+		for (int i = 0; sel && i < sel->num; i++) {
+			if (sel->ids[i] == id && !sel->found[i])
+				want = sel->found[i] = 1;
+		}
+		if (!want)
+			continue;
+
+		if (out_fixed(bus_out(), format, bus, frame, id))
+			rc = -1;
+	}
+
+	return rc;
+}
+
+/*
+ * Show one telegram of a readout.  Without record IDs to select, the
+ * full telegram is shown, otherwise only the records asked for.  Record
+ * IDs continue from the previous telegram, r->first is updated for the
+ * next one.  Returns 1 if more records follow in another telegram, 0 if
+ * this was the last one, and -1 on error.
+ */
+static int show_telegram(int bus, mbus_frame *frame, struct readout *r)
+{
+	struct select *sel = r->has_sel ? &r->sel : NULL;
+	struct rec_iter it;
+	int variable;
+
+	variable = !rec_init(&it, frame);
+	it.id = r->first;
+
+	if (format >= OUT_JSON) {
+		if (!variable && format != OUT_BIN && rec_is_fixed(frame))
+			return out_fixed_records(bus, frame, r);
+		if (!variable) {
+			warnx("%s output not supported for this response.", out_name(format));
+			return -1;
+		}
+		if (out_records(bus, frame, &it, r))
+			return -1;
+	} else if (sel) {
+		if (!variable && rec_is_fixed(frame)) {
+			show_fixed(frame, sel);
+			return 0;
+		}
+		if (!variable) {
+			warnx("record access only supported for variable and fixed data responses.");
+			return -1;
+		}
+		show_records(&it, sel, r->profile);
+	} else {
+		if (show_reply(frame))
+			return -1;
+		if (!variable)
+			return 0;
+
+		/* skip to the end, for the more records follow flag */
+		while (rec_next(&it, NULL) >= 0)
+			;
+	}
+	r->first = it.id;
+
+	return it.more;
+}
+
+/*
+ * Show telegram, in the decode thread.  Output is serialized with other
+ * buses, per telegram, when polling it is prefixed with a label which
+ * identifies the device.
+ */
+static int decode_telegram(struct telegram *t)
+{
+	struct readout *r = &readouts[t->bus];
+	int rc = 0;
+
+	if (t->first) {
+		struct rec_iter it;
+
+		r->has_sel = t->has_sel;
+		if (t->has_sel)
+			r->sel = t->sel;
+		r->first = 0;
+
+		r->meter = NULL;
+		r->keyframe = 1;
+		r->profile = NULL;
+		if (!rec_init(&it, &t->frame)) {
+			r->meter = delta_begin(it.hdr, &r->keyframe);
+			r->profile = profile_begin(it.hdr);
+		}
+	}
+
+	/* replays from the reading cache are not new readings */
+	if (!t->replayed) {
+		archive_telegram(&t->frame, r->first, r->profile);
+		metrics_telegram(t->bus, &t->frame, r->first, r->profile);
+	}
+
+	flockfile(t->out);
+	if (t->label[0] && format == OUT_TEXT) {
+		if (bus_count() > 1)
+			fprintf(t->out, "# @%d %s\n", t->bus, t->label);
+		else
+			fprintf(t->out, "# %s\n", t->label);
+	}
+	if (show_telegram(t->bus, &t->frame, r) == -1)
+		rc = 1;
+	sink_end(t->out);
+	funlockfile(t->out);
+
+	if (t->last && r->has_sel) {
+		for (int i = 0; i < r->sel.num; i++) {
+			if (r->sel.found[i])
+				continue;
+
+			warnx("no record ID %d in response.", r->sel.ids[i]);
+			rc = 1;
+		}
+	}
+
+	return rc;
+}
+
+/* Set up received telegram num of a readout, and queue it for decoding */
+static void put_telegram(struct telegram *t, int bus, int num, int last,
+			 struct select *sel, const char *label)
+{
+	t->bus   = bus;
+	t->first = num == 0;
+	t->last  = last;
+	snprintf(t->label, sizeof(t->label), "%s", label ?: "");
+	t->has_sel = sel && t->first;
+	if (t->has_sel)
+		t->sel = *sel;
+	decode_put(t);
+}
+
+/* Room for one more telegram of a readout to cache */
+static mbus_frame *cache_frame(struct bus *bus, int num)
+{
+	if ((size_t)num >= bus->frames_max) {
+		size_t max = bus->frames_max ? bus->frames_max * 2 : 4;
+		mbus_frame *frames = realloc(bus->frames, max * sizeof(mbus_frame));
+
+		if (!frames)
+			return NULL;
+		bus->frames = frames;
+		bus->frames_max = max;
+	}
+
+	return &bus->frames[num];
+}
+
+/*
+ * Request data from an already resolved address.  As long as the device
+ * sets more records follow (DIF 0x1F) the next telegram is requested,
+ * toggling the FCB, which starts from where the last request to the
+ * device left it, see init_slaves().  With sel, the record ID(s) to
+ * show, IDs are counted over all telegrams.
+ *
+ * Replies are queued raw to the decode thread, see decode_telegram(),
+ * so the next request is sent while the previous reply is decoded.  A
+ * complete readout is stored in the reading cache under key, if set.
+ */
+static int request_device(mbus_handle *handle, int address, struct select *sel,
+			  const char *label, const char *key)
+{
+	struct bus *bus = bus_find(handle);
+	unsigned char *fcb = fcb_of(bus, address);
+	mbus_frame *req = &bus->request;
+	int cache = key && cache_ttl();
+	int more = 1;
+	int num, rc = 0;
+
+	/* the bus request frame is reused, only the header is set up here */
+	req->control = MBUS_CONTROL_MASK_REQ_UD2 | MBUS_CONTROL_MASK_DIR_M2S | MBUS_CONTROL_MASK_FCV;
+	if (!fcb || *fcb)
+		req->control |= MBUS_CONTROL_MASK_FCB;
+	req->address = address;
+
+	for (num = 0; more && num < MAX_TELEGRAMS; num++) {
+		struct telegram *t;
+
+		if (mbus_send_frame(handle, req) == -1) {
+			warnx("failed sending M-Bus request to %d.", address);
+			rc = 1;
+			break;
+		}
+
+		t = decode_slot();
+		if (mbus_recv_frame(handle, &t->frame) != MBUS_RECV_RESULT_OK) {
+			warn("failed receiving M-Bus response from %d, %s", address, mbus_error_str());
+			decode_drop(t);
+			rc = 1;
+			break;
+		}
+
+		more = rec_more(&t->frame);
+		if (cache) {
+			mbus_frame *f = cache_frame(bus, num);
+
+			if (f)
+				*f = t->frame;
+			else
+				cache = 0;
+		}
+		put_telegram(t, bus->id, num, !more || num + 1 == MAX_TELEGRAMS, sel, label);
+
+		req->control ^= MBUS_CONTROL_MASK_FCB;
+	}
+
+	if (fcb)
+		*fcb = !!(req->control & MBUS_CONTROL_MASK_FCB);
+
+	/* the device may or may not have seen the request, or is mid readout */
+	if (rc || more)
+		slaves_unknown(bus);
+
+	if (more && num == MAX_TELEGRAMS)
+		warnx("readout from %d stopped after %d telegrams.", address, num);
+	else if (num > 1)
+		dbg("readout from %d complete, %d telegrams.", address, num);
+
+	if (cache && !rc && !more)
+		cache_put(bus->id, key, bus->frames, num);
+
+	return rc;
+}
+
+struct replay {
+	int            bus;
+	struct select *sel;
+};
+
+static void replay_telegram(void *arg, const mbus_frame *frame, size_t i, size_t num)
+{
+	struct replay *r = arg;
+	struct telegram *t;
+
+	t = decode_slot();
+	t->frame = *frame;
+	t->frame.next = NULL;
+	t->replayed = 1;
+	put_telegram(t, r->bus, i, i + 1 == num, r->sel, NULL);
+}
+
+/* update registry after a successful request */
+static int seen(mbus_handle *handle, const char *addr, int rc)
+{
+	struct bus *bus = bus_find(handle);
+	struct reg *r;
+
+	if (!rc && bus && (r = reg_find(bus->id, addr)))
+		reg_seen(r, bus->speed);
+
+	return rc;
+}
+
+/*
+ * Request data from one device, served from the reading cache when it
+ * is enabled and has a recent enough readout, unless -fresh is given.
+ */
+static int query_device(mbus_handle *handle, char *args)
+{
+	struct bus *bus = bus_find(handle);
+	struct select ids, *sel = NULL;
+	struct replay replay;
+	char *addr_arg;
+	int fresh = 0;
+	int address, rc;
+
+	addr_arg = strsep(&args, " \n\t");
+	if (addr_arg && !strcmp(addr_arg, "-fresh")) {
+		fresh = 1;
+		addr_arg = strsep(&args, " \n\t");
+	}
+
+	if (args && *args) {
+		if (parse_ids(&ids, args))
 			return 1;
+		sel = &ids;
+	}
+
+	replay.bus = bus->id;
+	replay.sel = sel;
+	if (!fresh && cache_replay(bus->id, addr_arg, replay_telegram, &replay))
+		return 0;
+
+	if (addr_arg && set_speed(bus, device_speed(bus, addr_arg)))
+		return 1;
+
+	address = parse_addr(handle, addr_arg);
+	if (address == -1)
+		rc = 1;
+	else
+		rc = seen(handle, addr_arg, request_device(handle, address, sel, NULL, addr_arg));
+	set_speed(bus, bus->baudrate);
+
+	return rc;
+}
+
+static int poll_one(mbus_handle *handle, char *addr)
+{
+	int address, rc;
+
+	address = resolve_addr(handle, addr);
+	if (address == -1)
+		return 1;
+
+	rc = request_device(handle, address, NULL, addr, addr);
+
+	return seen(handle, addr, rc);
+}
+
+/* device to poll or verify, at its speed */
+struct target {
+	char        addr[17];
+	long        speed;
+	struct reg *reg;
+	size_t      order;
+};
+
+static int by_speed(const void *a, const void *b)
+{
+	const struct target *ta = a, *tb = b;
+
+	if (ta->speed != tb->speed)
+		return ta->speed < tb->speed ? -1 : 1;
+
+	return ta->order < tb->order ? -1 : ta->order > tb->order;
+}
+
+/* room for num targets in the per bus list, which is only ever grown */
+static struct target *targets_grow(struct bus *bus, size_t num)
+{
+	struct target *list;
+	size_t max;
+
+	if (num <= bus->targets_max)
+		return bus->targets;
+
+	max = bus->targets_max ? bus->targets_max * 2 : 64;
+	while (max < num)
+		max *= 2;
+
+	list = realloc(bus->targets, max * sizeof(*list));
+	if (!list)
+		return NULL;
+	bus->targets = list;
+	bus->targets_max = max;
+
+	return list;
+}
+
+/*
+ * Devices listed in args, or all in the registry, grouped by speed and
+ * otherwise in the order given.  Registry devices are addressed by the
+ * primary address if one has been set, otherwise the secondary.
+ * Returns the per bus list, valid until the next call.
+ */
+static struct target *targets(struct bus *bus, char *args, size_t *num)
+{
+	struct target *list;
+	size_t n = 0;
+
+	if (!args) {
+		size_t len;
+
+		if (reg_list(bus->id, &bus->regs, &bus->regs_max, &len))
+			return NULL;
+
+		list = targets_grow(bus, len + 1);
+		for (size_t i = 0; list && i < len; i++) {
+			struct target *t = &list[n++];
+			struct reg *r = bus->regs[i];
+
+			if (r->primary > 0)
+				snprintf(t->addr, sizeof(t->addr), "%d", r->primary);
+			else
+				snprintf(t->addr, sizeof(t->addr), "%s", r->secondary);
+			t->speed = r->baudrate ?: bus->baudrate;
+			t->reg   = r;
+			t->order = i;
 		}
 	} else {
-		curr = MBUS_ADDRESS_NETWORK_LAYER;
-		id = reg_find_secondary(mask);
+		char *addr;
+
+		list = targets_grow(bus, 1);
+		while (list && (addr = strsep(&args, " \n\t"))) {
+			struct target *t;
+
+			if (*addr == 0)
+				continue;
+
+			list = targets_grow(bus, n + 1);
+			if (!list)
+				break;
+
+			t = &list[n];
+			snprintf(t->addr, sizeof(t->addr), "%s", addr);
+			t->speed = device_speed(bus, addr);
+			t->reg   = reg_find(bus->id, addr);
+			t->order = n++;
+		}
 	}
 
-	next = atoi(args);
-	if (next < 1 || next > 250) {
-		warnx("invalid new primary address [%s], allowed 1-250.", args);
+	if (!list)
+		return NULL;
+
+	qsort(list, n, sizeof(*list), by_speed);
+	*num = n;
+
+	return list;
+}
+
+/*
+ * Switch port speed for next group of devices, with one round of slave
+ * initialization per group.  Returns -1 if the group must be skipped.
+ */
+static int next_group(struct bus *bus, struct target *t, int first)
+{
+	if (!first && t->speed == bus->speed)
+		return 0;
+
+	if (set_speed(bus, t->speed))
+		return -1;
+
+	return init_slaves(bus->handle);
+}
+
+/*
+ * Request data from many devices back to back, with only one round of
+ * slave initialization per port speed.  Devices are grouped by their
+ * speed in the registry, so the port is switched only once per group.
+ * Without args all devices in the registry are polled.
+ */
+static int poll_devices(mbus_handle *handle, char *args)
+{
+	struct bus *bus = bus_find(handle);
+	int from_registry = !args;
+	struct target *list;
+	size_t num;
+	int rc = 0;
+
+	list = targets(bus, args, &num);
+	if (!list)
+		return 1;
+
+	for (size_t i = 0; bus_active() && i < num; i++) {
+		bus_progress("%zu/%zu %s", i + 1, num, list[i].addr);
+		if (next_group(bus, &list[i], i == 0)) {
+			warnx("skipping %s at %ld baud.", list[i].addr, list[i].speed);
+			rc = 1;
+			continue;
+		}
+
+		rc |= poll_one(handle, list[i].addr);
+	}
+	set_speed(bus, bus->baudrate);
+
+	if (!num && from_registry) {
+		warnx("no devices in registry, run probe or list addresses to poll.");
 		return 1;
 	}
 
-	if (init_slaves(handle))
+	return rc;
+}
+
+/*
+ * Poll device periodically, see sched.c.  Without args the schedule of
+ * this bus is listed, an interval of 0 unschedules a device.
+ */
+static int schedule_device(mbus_handle *handle, char *args)
+{
+	char *addr, *arg;
+	long interval, jitter = 0;
+
+	if (!args) {
+		FILE *fp = bus_out();
+
+		flockfile(fp);
+		sched_show(fp, bus_id(handle));
+		funlockfile(fp);
+		return 0;
+	}
+
+	addr = strsep(&args, " \n\t");
+	arg = strsep(&args, " \n\t");
+	if (!arg) {
+		warnx("missing argument.\nUsage: schedule ADDR INTERVAL [JITTER]");
+		return 1;
+	}
+	interval = atol(arg);
+	if (args && *args)
+		jitter = atol(args);
+
+	if (!mbus_is_secondary_address(addr) && (atoi(addr) < 1 || atoi(addr) > 250)) {
+		warnx("invalid address %s.", addr);
+		return 1;
+	}
+	if (interval < 0 || jitter < 0) {
+		warnx("invalid interval or jitter, must be seconds >= 0.");
+		return 1;
+	}
+
+	if (sched_add(bus_id(handle), addr, interval, jitter)) {
+		warnx("failed scheduling %s.", addr);
 		return 1;
+	}
+
+	return 0;
+}
+
+/* Send new primary address to device at curr, e.g. selected, and wait for ACK */
+static int send_address(mbus_handle *handle, int curr, int next, const char *mask)
+{
+	mbus_frame reply;
+
+	for (int retries = 3; retries > 0; retries--) {
+		if (mbus_set_primary_address(handle, curr, next) == -1) {
+			warnx("failed setting device [%s] primary address: %s", mask, mbus_error_str());
+			return 1;
+		}
+
+		if (mbus_recv_frame(handle, &reply) == MBUS_RECV_RESULT_TIMEOUT) {
+			if (retries > 1)
+				continue;
+
+			warnx("No reply from device [%s], %s", mask, mbus_error_str());
+			return 1;
+		}
+		break;
+	}
+
+	if (mbus_frame_type(&reply) != MBUS_FRAME_TYPE_ACK) {
+		warnx("invalid response from device [%s], exected ACK, got:", mask);
+		mbus_frame_print(&reply);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* cached readout at primary address is of another device, or none, now */
+static void forget_primary(int bus, int address)
+{
+	char addr[4];
+
+	if (address < 1 || address > 250)
+		return;
+
+	snprintf(addr, sizeof(addr), "%d", address);
+	cache_forget(bus, addr);
+}
+
+static int set_address(mbus_handle *handle, char *args)
+{
+	struct reg *r;
+	mbus_frame reply;
+	int curr, next;
+	char *mask;
+
+	if (!args) {
+	syntax:
+		warnx("missing argument.\nUsage: set <MASK | ADDR> NEW_ADDR");
+		return 1;
+	}
+
+	mask = strsep(&args, " \n\t");
+	if (!args || *args == 0)
+		goto syntax;
+
+	if (!mbus_is_secondary_address(mask)) {
+		curr = atoi(mask);
+		if (curr < 0 || curr > 250) {
+			warnx("invalid secondary address [%s], also not a primary address (0-250).", args);
+			return 1;
+		}
+		r = reg_find_primary(bus_id(handle), curr);
+	} else {
+		curr = MBUS_ADDRESS_NETWORK_LAYER;
+		r = reg_find_secondary(mask);
+	}
+
+	next = atoi(args);
+	if (next < 1 || next > 250) {
+		warnx("invalid new primary address [%s], allowed 1-250.", args);
+		return 1;
+	}
+
+	if (reset_slaves(handle))
+		return 1;
+
+	if (mbus_send_ping_frame(handle, next, 0) == -1) {
+		warnx("failed sending verification ping: %s", mbus_error_str());
+		return 1;
+	}
+
+	if (mbus_recv_frame(handle, &reply) != MBUS_RECV_RESULT_TIMEOUT) {
+		warn("verification failed, primary address [%d] already in use, %s", next, mbus_error_str());
+		return 1;
+	}
+
+	if (curr == MBUS_ADDRESS_NETWORK_LAYER) {
+		if (secondary_select(handle, mask) == -1)
+			return 1;
+	}
+
+	cache_forget(bus_id(handle), mask);
+	if (r)
+		forget_primary(bus_id(handle), r->primary);
+	forget_primary(bus_id(handle), next);
+	if (send_address(handle, curr, next, mask))
+		return 1;
+
+	dbg("primary address of device %s set to %d", mask, next);
+	if (r)
+		reg_set_primary(r, next);
+
+	return 0;
+}
+
+/* Primary address of a device, the A field of its reply when selected */
+static int primary_of(mbus_handle *handle, char *secondary)
+{
+	mbus_frame reply;
+
+	if (secondary_select(handle, secondary) == -1)
+		return -1;
+
+	if (mbus_send_request_frame(handle, MBUS_ADDRESS_NETWORK_LAYER) == -1) {
+		warnx("failed sending M-Bus request to %s.", secondary);
+		return -1;
+	}
+
+	if (mbus_recv_frame(handle, &reply) != MBUS_RECV_RESULT_OK) {
+		warnx("no reply from %s, %s", secondary, mbus_error_str());
+		return -1;
+	}
+
+	return reply.address;
+}
+
+/*
+ * Resolve the collisions of a primary scan.  A secondary probe, using
+ * the probe cache, finds all devices on the bus.  Each device that is
+ * not known to be at another address is selected, and its reply tells
+ * its primary address.  At each collided address one device is kept,
+ * the others are given free addresses, ones that were empty in the scan,
+ * using set_address().
+ */
+static int resolve_collisions(mbus_handle *handle, struct scan_result *res, int last)
+{
+	char kept[MBUS_MAX_PRIMARY_SLAVES + 1] = { 0 };
+	struct bus *bus = bus_find(handle);
+	int num = 0, moved = 0, next = 1;
+	int rc = 0;
+	size_t len;
+
+	for (int address = 0; address <= last; address++) {
+		if (res[address].rc == MBUS_RECV_RESULT_INVALID)
+			num++;
+	}
+	if (!num)
+		return 0;
+
+	log("bus %d: resolving %d collided addresses.", bus->id, num);
+	if (reset_slaves(handle))
+		return 1;
+
+	if (probe_secondary_range(handle, "FFFFFFFFFFFFFFFF", 0, found_device, handle) < 0) {
+		warnx("failed probe, %s", mbus_error_str());
+		return 1;
+	}
+
+	if (reg_list(bus->id, &bus->regs, &bus->regs_max, &len))
+		return 1;
+
+	for (size_t i = 0; i < len && bus_active(); i++) {
+		struct reg *r = bus->regs[i];
+		char args[32];
+		int address;
+
+		if (r->primary > 0 && r->primary <= last &&
+		    res[r->primary].rc != MBUS_RECV_RESULT_INVALID)
+			continue;	/* known to be elsewhere */
+
+		bus_progress("resolving %s", r->secondary);
+		address = primary_of(handle, r->secondary);
+		if (address < 0) {
+			rc = 1;
+			continue;
+		}
+		reg_set_primary(r, address);
+
+		if (address > last || res[address].rc != MBUS_RECV_RESULT_INVALID)
+			continue;
+		if (!kept[address]) {
+			kept[address] = 1;
+			continue;
+		}
+
+		while (next <= last && (res[next].rc != MBUS_RECV_RESULT_TIMEOUT ||
+					reg_find_primary(bus->id, next)))
+			next++;
+		if (next > last) {
+			warnx("bus %d: no free primary address left for %s.", bus->id, r->secondary);
+			rc = 1;
+			break;
+		}
+
+		snprintf(args, sizeof(args), "%s %d", r->secondary, next);
+		if (set_address(handle, args)) {
+			rc = 1;
+			continue;
+		}
+		log("moved %s from collided address %d to %d.", r->secondary, address, next);
+		res[next++].rc = MBUS_RECV_RESULT_OK;
+		moved++;
+	}
+
+	log("bus %d: moved %d devices to free addresses.", bus->id, moved);
+
+	return rc;
+}
+
+/* planned primary address of a device, see address-all */
+struct assign {
+	char        secondary[17];
+	int         address;
+	struct reg *reg;
+	int         state;
+};
+
+enum { ASSIGN_TODO, ASSIGN_KEEP, ASSIGN_BUSY, ASSIGN_SET, ASSIGN_OK, ASSIGN_FAIL };
+
+/* Add device to plan, one known to be on another bus is skipped */
+static int plan_add(struct bus *bus, struct assign *plan, int num, const char *secondary, int address)
+{
+	struct assign *a;
+	struct reg *r;
+
+	/* a FILE may be shared by all buses, primary addresses are per bus */
+	r = reg_find_secondary(secondary);
+	if (r && r->bus != bus->id) {
+		warnx("%s is on bus %d, not %d, skipping.", secondary, r->bus, bus->id);
+		return num;
+	}
+
+	if (num >= MBUS_MAX_PRIMARY_SLAVES) {
+		warnx("too many devices, max %d.", MBUS_MAX_PRIMARY_SLAVES);
+		return -1;
+	}
+	if (address < 1 || address > MBUS_MAX_PRIMARY_SLAVES) {
+		warnx("invalid primary address %d for %s, allowed 1-250.", address, secondary);
+		return -1;
+	}
+	for (int i = 0; i < num; i++) {
+		if (plan[i].address == address) {
+			warnx("primary address %d planned for both %s and %s.", address,
+			      plan[i].secondary, secondary);
+			return -1;
+		}
+	}
+
+	a = &plan[num];
+	snprintf(a->secondary, sizeof(a->secondary), "%s", secondary);
+	a->address = address;
+	a->reg     = r;
+	a->state   = ASSIGN_TODO;
+
+	return num + 1;
+}
+
+/* Lines of SECONDARY ADDR, # for comments */
+static int plan_file(struct bus *bus, struct assign *plan, const char *file)
+{
+	char line[80];
+	int num = 0, lineno = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		warn("failed opening %s", file);
+		return -1;
+	}
+
+	while (num >= 0 && fgets(line, sizeof(line), fp)) {
+		char secondary[17];
+		int address;
+
+		lineno++;
+		if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0)
+			continue;
+
+		if (sscanf(line, "%16s %d", secondary, &address) != 2 ||
+		    !mbus_is_secondary_address(secondary)) {
+			warnx("%s:%d: invalid line, expected: SECONDARY ADDR", file, lineno);
+			num = -1;
+			break;
+		}
+
+		num = plan_add(bus, plan, num, secondary, address);
+	}
+	fclose(fp);
+
+	return num;
+}
+
+/* Registry devices of bus, in order of discovery, from address start */
+static int plan_registry(struct bus *bus, struct assign *plan, int start)
+{
+	size_t len;
+	int num = 0;
+
+	if (reg_list(bus->id, &bus->regs, &bus->regs_max, &len))
+		return -1;
+
+	for (size_t i = 0; i < len && num >= 0; i++)
+		num = plan_add(bus, plan, num, bus->regs[i]->secondary, start + num);
+
+	return num;
+}
+
+/* Ping address once, with short timeout, 1 if a device answers, 0 if not */
+static int answers(mbus_handle *handle, int address)
+{
+	mbus_frame reply;
+	int tries = 0;
+
+	switch (ping_address_fast(handle, &reply, address, &tries)) {
+	case MBUS_RECV_RESULT_TIMEOUT:
+		return 0;
+	case MBUS_RECV_RESULT_OK:
+		return mbus_frame_type(&reply) == MBUS_FRAME_TYPE_ACK;
+	default:
+		return 1;	/* collision, or garbage, is not free either */
+	}
+}
+
+/*
+ * Bulk primary address assignment, from a plan: the devices in the
+ * registry numbered from START, default 1, or a FILE of SECONDARY ADDR
+ * lines.  Done in three passes with only one round of initialization:
+ * check that each planned address is free with one fast ping each, set
+ * all addresses using secondary selects, then verify all at once.  A
+ * device already at its planned address, according to the registry, is
+ * left as it is.
+ */
+static int assign_addresses(mbus_handle *handle, char *args)
+{
+	struct assign plan[MBUS_MAX_PRIMARY_SLAVES];
+	struct bus *bus = bus_find(handle);
+	int cnt[ASSIGN_FAIL + 1] = { 0 };
+	int num, i;
+
+	if (args && strspn(args, "0123456789") == strlen(args))
+		num = plan_registry(bus, plan, atoi(args));
+	else if (args)
+		num = plan_file(bus, plan, args);
+	else
+		num = plan_registry(bus, plan, 1);
+	if (num < 0)
+		return 1;
+	if (!num) {
+		warnx("nothing to assign, run probe first, or give a FILE of SECONDARY ADDR lines.");
+		return 1;
+	}
+
+	if (reset_slaves(handle))
+		return 1;
+
+	for (i = 0; i < num && bus_active(); i++) {
+		struct assign *a = &plan[i];
+
+		bus_progress("check %d/%d, address %d", i + 1, num, a->address);
+		if (!answers(handle, a->address))
+			continue;
+
+		if (a->reg && a->reg->primary == a->address)
+			a->state = ASSIGN_KEEP;
+		else {
+			warnx("primary address %d is in use, skipping %s.", a->address, a->secondary);
+			a->state = ASSIGN_BUSY;
+		}
+	}
+
+	for (i = 0; i < num && bus_active(); i++) {
+		struct assign *a = &plan[i];
+
+		if (a->state != ASSIGN_TODO)
+			continue;
+
+		bus_progress("set %d/%d, %s", i + 1, num, a->secondary);
+		cache_forget(bus->id, a->secondary);
+		if (a->reg)
+			forget_primary(bus->id, a->reg->primary);
+		forget_primary(bus->id, a->address);
+		if (secondary_select(handle, a->secondary) == -1 ||
+		    send_address(handle, MBUS_ADDRESS_NETWORK_LAYER, a->address, a->secondary))
+			a->state = ASSIGN_FAIL;
+		else
+			a->state = ASSIGN_SET;
+	}
+
+	for (i = 0; i < num && bus_active(); i++) {
+		struct assign *a = &plan[i];
+
+		if (a->state != ASSIGN_SET)
+			continue;
+
+		bus_progress("verify %d/%d, address %d", i + 1, num, a->address);
+		if (answers(handle, a->address) != 1) {
+			warnx("%s does not answer at new primary address %d.", a->secondary, a->address);
+			a->state = ASSIGN_FAIL;
+			continue;
+		}
+
+		a->state = ASSIGN_OK;
+		if (a->reg)
+			reg_set_primary(a->reg, a->address);
+	}
+
+	for (i = 0; i < num; i++)
+		cnt[plan[i].state]++;
+
+	log("bus %d: %d addresses set, %d already set, %d in use, %d failed, %d not done.",
+	    bus->id, cnt[ASSIGN_OK], cnt[ASSIGN_KEEP], cnt[ASSIGN_BUSY], cnt[ASSIGN_FAIL],
+	    cnt[ASSIGN_TODO] + cnt[ASSIGN_SET]);
+
+	return cnt[ASSIGN_OK] + cnt[ASSIGN_KEEP] == num ? 0 : 1;
+}
+
+/*
+ * Switch device to another baud rate.  The device ACKs at its current
+ * speed and then switches, so the switch is confirmed with a ping at
+ * the new speed.  The new speed is remembered in the registry, for
+ * requests and polls of the device.
+ */
+static int switch_baudrate(mbus_handle *handle, char *addr, long rate)
+{
+	struct bus *bus = bus_find(handle);
+	mbus_frame reply;
+	int address, rc = 1;
+	struct reg *r;
+
+	switch (rate) {
+	case 300:
+	case 600:
+	case 1200:
+	case 2400:
+	case 4800:
+	case 9600:
+	case 19200:
+	case 38400:
+		break;
+	default:
+		warnx("invalid device baud rate %ld.", rate);
+		return 1;
+	}
+
+	/* the converter cannot follow, the device would be lost */
+	if (bus->tcp && rate != bus->speed) {
+		warnx("bus %d: cannot switch devices on %s to %ld baud, the converter sets the line speed.",
+		      bus->id, bus->device, rate);
+		return 1;
+	}
+
+	if (set_speed(bus, device_speed(bus, addr)))
+		return 1;
+
+	address = parse_addr(handle, addr);
+	if (address == -1)
+		goto done;
+
+	slaves_unknown(bus);
+	if (mbus_send_switch_baudrate_frame(handle, address, rate) == -1) {
+		warnx("failed sending baud rate switch to %s: %s", addr, mbus_error_str());
+		goto done;
+	}
+
+	memset(&reply, 0, sizeof(reply));
+	if (mbus_recv_frame(handle, &reply) != MBUS_RECV_RESULT_OK ||
+	    mbus_frame_type(&reply) != MBUS_FRAME_TYPE_ACK) {
+		warnx("device %s did not ACK switch to %ld baud.", addr, rate);
+		goto done;
+	}
+	cache_forget(bus->id, addr);
+
+	if (set_speed(bus, rate))
+		goto done;
+
+	memset(&reply, 0, sizeof(reply));
+	if (mbus_send_ping_frame(handle, address, 0) == -1 ||
+	    mbus_recv_frame(handle, &reply) != MBUS_RECV_RESULT_OK ||
+	    mbus_frame_type(&reply) != MBUS_FRAME_TYPE_ACK) {
+		warnx("device %s does not respond at %ld baud.", addr, rate);
+		goto done;
+	}
+
+	log("device %s now at %ld baud.", addr, rate);
+	r = reg_find(bus->id, addr);
+	if (r)
+		reg_seen(r, rate);
+	else
+		warnx("device %s not in registry, its speed will not be remembered.", addr);
+	rc = 0;
+done:
+	set_speed(bus, bus->baudrate);
+
+	return rc;
+}
+
+static int set_baudrate(mbus_handle *handle, char *args)
+{
+	struct bus *bus = bus_find(handle);
+	long rate;
+	char *arg;
+
+	if (!args) {
+		warnx("missing argument.\nUsage: set [ADDR] BAUDRATE");
+		return 1;
+	}
+
+	arg = strsep(&args, " \n\t");
+	if (!args || *args == 0)
+		rate = atol(arg);
+	else
+		return switch_baudrate(handle, arg, atol(args));
+
+	if (rate < 300) {
+		warnx("Too low baudrate, recommeded: 300, 2400, 9600.");
+		return 1;
+	}
+	switch (rate) {
+	case 300:
+	case 2400:
+	case 9600:
+		break;
+	default:
+		warnx("Not recommended by M-Bus standard.");
+		break;
+	}
+
+	/* tell us what the converter is set to, for our timeouts */
+	if (bus->tcp) {
+		bus->baudrate = bus->speed = rate;
+		return bus_tcp_timeout(bus) ? 1 : 0;
+	}
+
+	if (set_speed(bus, rate))
+		return 1;
+	bus->baudrate = rate;
+
+	return 0;
+}
+
+/*
+ * Check that a device is still there, select it and wait for the ACK.
+ * Returns 1 only if it is silent twice, one lost ACK on a noisy bus must
+ * not drop it from the registry, and -1 on error, e.g. when stopping.
+ */
+static int verify_device(mbus_handle *handle, struct reg *r)
+{
+	mbus_frame reply;
+	int rc;
+
+	/* deselects all others, and is not tracked */
+	slaves_unknown(bus_find(handle));
+
+	for (int i = 0; i < 2; i++) {
+		if (mbus_send_select_frame(handle, r->secondary) == -1) {
+			warnx("failed sending select frame: %s", mbus_error_str());
+			return -1;
+		}
+
+		rc = wait_reply(handle, ack_timeout(handle));
+		if (rc < 0)
+			return -1;
+		if (rc > 0)
+			break;
+	}
+	if (rc == 0)
+		return 1;
+
+	/* anything but silence is a reply, garbled or cut short */
+	memset(&reply, 0, sizeof(reply));
+	switch (mbus_recv_frame(handle, &reply)) {
+	case MBUS_RECV_RESULT_OK:
+		if (mbus_frame_type(&reply) != MBUS_FRAME_TYPE_ACK)
+			dbg("%s replied to select with a non-ACK frame", r->secondary);
+		return 0;
+	case MBUS_RECV_RESULT_INVALID:
+	case MBUS_RECV_RESULT_TIMEOUT:
+		mbus_purge_frames(handle);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static int verify_devices(mbus_handle *handle, char *args)
+{
+	struct bus *bus = bus_find(handle);
+	size_t i, num, ok = 0;
+	struct target *list;
+	int stale = 0;
+
+	(void)args;
+
+	list = targets(bus, NULL, &num);
+	if (!list)
+		return 1;
+
+	for (i = 0; bus_active() && i < num; i++) {
+		struct reg *r = list[i].reg;
+
+		bus_progress("%zu/%zu %s", i + 1, num, r->secondary);
+		if (next_group(bus, &list[i], i == 0)) {
+			set_speed(bus, bus->baudrate);
+			return 1;
+		}
+
+		switch (verify_device(handle, r)) {
+		case 0:
+			reg_seen(r, bus->speed);
+			ok++;
+			break;
+		case 1:
+			log("%s no longer responds, removing from registry.", r->secondary);
+			reg_del(r);
+			stale++;
+			break;
+		default:
+			set_speed(bus, bus->baudrate);
+			return 1;
+		}
+	}
+	set_speed(bus, bus->baudrate);
+
+	log("bus %d: verified %zu devices, removed %d stale.", bus->id, ok, stale);
+
+	return 0;
+}
+
+/* Loading is quick, verifying is left to the bus workers, in the background */
+static int load_registry(mbus_handle *handle, char *args)
+{
+	char *file = args ?: regfile;
+	int rc = 0;
+	int num;
+
+	(void)handle;
+
+	if (!file) {
+		warnx("missing argument, file to load registry from.");
+		return 1;
+	}
+
+	num = reg_load(file);
+	if (num < 0) {
+		warn("failed loading registry from %s", file);
+		return 1;
+	}
+	log("loaded %d devices from %s", num, file);
+
+	for (int i = 0; i < bus_count(); i++) {
+		if (bus_submit(bus_get(i), verify_devices, NULL, JOB_LOW, NULL, NULL)) {
+			warn("failed queuing verify on bus %d", i);
+			rc = 1;
+		}
+	}
+
+	return rc;
+}
+
+static int save_registry(mbus_handle *handle, char *args)
+{
+	char *file = args ?: regfile;
+
+	(void)handle;
+
+	if (!file) {
+		warnx("missing argument, file to save registry to.");
+		return 1;
+	}
+
+	if (reg_save(file)) {
+		warn("failed saving registry to %s", file);
+		return 1;
+	}
+	dbg("saved %zu devices to %s", reg_count(), file);
+
+	return 0;
+}
+
+static int toggle_parity(mbus_handle *handle, char *args)
+{
+	struct bus *bus = bus_find(handle);
+
+	(void)args;
+	if (bus->tcp) {
+		warnx("bus %d: parity of %s is set in the converter", bus->id, bus->device);
+		return 1;
+	}
+	bus->parity ^= 1;
+	log("bus %d: parity %s", bus->id, bus->parity ? "even" : "disabled");
+
+	return mbus_serial_set_parity(handle, !bus->parity ? 0 : 2);
+}
+
+
+#define ENABLED(v) v ? "enabled" : "disabled"
+
+static int toggle_debug(mbus_handle *handle, char *args)
+{
+	(void)handle;
+	(void)args;
+	debug ^= 1;
+	log("debug mode %s", ENABLED(debug));
+
+	return 0;
+}
+
+static int toggle_verbose(mbus_handle *handle, char *args)
+{
+	(void)args;
+	verbose ^= 1;
+	log("verbose output %s", ENABLED(verbose));
+
+	return 0;
+}
+
+static int toggle_xml(mbus_handle *handle, char *args)
+{
+	(void)args;
+	format = format == OUT_XML ? OUT_TEXT : OUT_XML;
+	log("XML output %s", ENABLED(format == OUT_XML));
+
+	return 0;
+}
+
+static int set_format(mbus_handle *handle, char *args)
+{
+	FILE *fp = bus_out();
+	int fmt;
+
+	(void)handle;
+
+	if (!args) {
+		fprintf(fp, "%s\n", out_name(format));
+		return 0;
+	}
+
+	fmt = out_parse(args);
+	if (fmt == -1) {
+		warnx("unknown output format '%s', use: text, xml, json, csv, bin.", args);
+		return 1;
+	}
+
+	/* a new CSV stream, with a header to each output */
+	if (fmt == OUT_CSV && format != OUT_CSV)
+		out_forget(NULL);
+	format = fmt;
+
+	return 0;
+}
+
+static int set_delta(mbus_handle *handle, char *args)
+{
+	FILE *fp = bus_out();
+
+	(void)handle;
+
+	if (!args) {
+		if (delta_get())
+			fprintf(fp, "delta output, keyframe every %u readouts, %zu meters cached\n",
+				delta_get(), delta_meters());
+		else
+			fprintf(fp, "delta output disabled\n");
+		return 0;
+	}
+
+	if (!strcmp(args, "off")) {
+		delta_set(0);
+		return 0;
+	}
+
+	if (atoi(args) < 1) {
+		warnx("invalid keyframe interval '%s', use: off, or 1 and up.", args);
+		return 1;
+	}
+	if (format < OUT_JSON)
+		warnx("note, delta output only applies to json, csv and bin formats.");
+	delta_set(atoi(args));
+
+	return 0;
+}
+
+static int set_cache(mbus_handle *handle, char *args)
+{
+	FILE *fp = bus_out();
+
+	(void)handle;
+
+	if (!args) {
+		if (cache_ttl())
+			fprintf(fp, "reading cache, TTL %u s, %zu devices cached\n",
+				cache_ttl(), cache_entries());
+		else
+			fprintf(fp, "reading cache disabled\n");
+		return 0;
+	}
+
+	if (!strcmp(args, "off")) {
+		cache_set(0);
+		return 0;
+	}
+
+	if (atoi(args) < 1) {
+		warnx("invalid time to live '%s', use: off, or 1 and up seconds.", args);
+		return 1;
+	}
+	cache_set(atoi(args));
+
+	return 0;
+}
+
+static int set_probe_age(mbus_handle *handle, char *args)
+{
+	FILE *fp = bus_out();
+
+	(void)handle;
+
+	if (!args) {
+		if (probe_age())
+			fprintf(fp, "empty probe branches trusted for %u s\n", probe_age());
+		else
+			fprintf(fp, "empty probe branches trusted forever\n");
+		return 0;
+	}
+
+	if (!strcmp(args, "off")) {
+		probe_set_age(0);
+		return 0;
+	}
+
+	if (atoi(args) < 1) {
+		warnx("invalid max age '%s', use: off, or 1 and up seconds.", args);
+		return 1;
+	}
+	probe_set_age(atoi(args));
+
+	return 0;
+}
+
+/* Absolute time, or seconds back from now when negative */
+static time_t parse_time(const char *arg, time_t now)
+{
+	long long t = atoll(arg);
+
+	return t < 0 ? now + t : (time_t)t;
+}
+
+static int export_archive(mbus_handle *handle, char *args)
+{
+	time_t now = time(NULL), from = 0, to = now;
+	char *sec, *arg;
+	uint64_t id;
+
+	(void)handle;
+
+	sec = strsep(&args, " \t");
+	if (!sec || reg_parse_secondary(sec, &id)) {
+		warnx("missing or invalid secondary address.");
+		return 1;
+	}
+	for (char *p = sec; *p; p++)
+		*p = toupper((unsigned char)*p);
+
+	if ((arg = strsep(&args, " \t")))
+		from = parse_time(arg, now);
+	if ((arg = strsep(&args, " \t")))
+		to = parse_time(arg, now);
+
+	if (archive_export(bus_out(), sec, from, to, format == OUT_JSON)) {
+		warn("failed exporting archive of %s", sec);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int set_profile(mbus_handle *handle, char *args)
+{
+	(void)handle;
+
+	if (!args) {
+		profile_show(bus_out());
+		return 0;
+	}
+
+	if (!strcmp(args, "on"))
+		profile_set(1);
+	else if (!strcmp(args, "off"))
+		profile_set(0);
+	else {
+		warnx("invalid argument '%s', use: on, off.", args);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int select_bus(mbus_handle *handle, char *args)
+{
+	FILE *fp = bus_out();
+
+	(void)handle;
+
+	if (!args) {
+		for (int i = 0; i < bus_count(); i++) {
+			struct bus *bus = bus_get(i);
+
+			fprintf(fp, "%c%2d  %-20s  %ld %s\n", i == curr_src->bus ? '*' : ' ', i,
+				bus->device, bus->baudrate, bus->tcp ? "tcp" : bus->parity ? "8E1" : "8N1");
+		}
+		return 0;
+	}
+
+	if (!bus_get(atoi(args))) {
+		warnx("no such bus %s.", args);
+		return 1;
+	}
+	curr_src->bus = atoi(args);
+
+	return 0;
+}
+
+#define STATS_INTERVAL 60	/* seconds between saves to -s FILE */
+
+static char *statsfile;
+
+static void save_stats(void)
+{
+	if (stats_save(statsfile))
+		warn("failed saving statistics to %s", statsfile);
+}
+
+static int show_stats(mbus_handle *handle, char *args)
+{
+	char *arg;
+
+	(void)handle;
+
+	if (!args) {
+		FILE *fp = bus_out();
+
+		flockfile(fp);
+		stats_show(fp, ALL_BUSES);
+		funlockfile(fp);
+		return 0;
+	}
+
+	arg = strsep(&args, " \n\t");
+	if (!strcmp(arg, "reset")) {
+		stats_reset(ALL_BUSES);
+		return 0;
+	}
+
+	if (!strcmp(arg, "save")) {
+		char *file = args && *args ? args : statsfile;
+
+		if (!file) {
+			warnx("missing argument, file to save statistics to.");
+			return 1;
+		}
+		if (stats_save(file)) {
+			warn("failed saving statistics to %s", file);
+			return 1;
+		}
+		return 0;
+	}
+
+	warnx("unknown argument '%s'.\nUsage: stats [reset | save [FILE]]", arg);
+
+	return 1;
+}
+
+static const char *cmd_name(bus_cmd cb);
+
+static int show_status(mbus_handle *handle, char *args)
+{
+	FILE *fp = bus_out();
+	time_t now = time(NULL);
+
+	(void)handle;
+	(void)args;
+
+	for (int i = 0; i < bus_count(); i++) {
+		struct bus *bus = bus_get(i);
+		struct bus_status st;
+
+		bus_status(bus, &st);
+		fprintf(fp, "%2d  %-20s  ", i, bus->device);
+		if (!st.cb) {
+			fprintf(fp, "idle\n");
+			continue;
+		}
+
+		fprintf(fp, "%s%s%s, %lld s", cmd_name(st.cb), st.args[0] ? " " : "", st.args,
+			(long long)(now - st.started));
+		if (st.progress[0])
+			fprintf(fp, ", at %s", st.progress);
+		if (st.queued)
+			fprintf(fp, ", %d queued", st.queued);
+		fprintf(fp, "\n");
+	}
+	sink_show(fp);
+
+	return 0;
+}
+
+static int abort_bus(int id)
+{
+	int num = bus_abort(bus_get(id));
+
+	if (num)
+		log("bus %d: aborting %d command%s.", id, num, num > 1 ? "s" : "");
+
+	return num;
+}
+
+/* Stop the running command, and drop those queued, on one or all buses */
+static int abort_command(mbus_handle *handle, char *args)
+{
+	(void)handle;
+
+	if (args) {
+		if (*args == '@')
+			args++;
+		if (strcmp(args, "*") && strcmp(args, "all")) {
+			if (!bus_get(atoi(args))) {
+				warnx("no such bus %s.", args);
+				return 1;
+			}
+			abort_bus(atoi(args));
+			return 0;
+		}
+	}
+
+	for (int i = 0; i < bus_count(); i++)
+		abort_bus(i);
+
+	return 0;
+}
+
+static int set_priority(mbus_handle *handle, char *args)
+{
+	static const char *names[] = { "low", "normal", "high" };
+
+	(void)handle;
+
+	if (!args) {
+		fprintf(bus_out(), "%s\n", names[curr_src->prio]);
+		return 0;
+	}
+
+	for (size_t i = 0; i < NELEMS(names); i++) {
+		if (strcmp(args, names[i]))
+			continue;
+
+		curr_src->prio = i;
+		return 0;
+	}
+
+	warnx("unknown priority '%s', use: low, normal, high.", args);
+
+	return 1;
+}
+
+static int show_help(mbus_handle *handle, char *args);
+
+/* Run in main thread, not on a bus worker */
+#define CMD_LOCAL 1
+/* Identical queued commands are run once, e.g. from two clients */
+#define CMD_MERGE 2
+
+struct cmd {
+	char *c_cmd;
+	char *c_arg;
+	char *c_desc;
+	int (*c_cb)(mbus_handle *, char *);
+	int   c_flags;
+};
+
+struct cmd cmds[] = {
+	{ "address", "MASK ADDR",      "Set primary address",                     set_address,    0 },
+	{ "address-all", "[START | FILE]", "Set many, registry from START or FILE of SEC ADDR", assign_addresses, 0 },
+	{ "baud",    "[ADDR] RATE",    "Set (device) baud rate [300,2400,9600]",  set_baudrate,   0 },
+	{ "rate",    NULL,             NULL,                                      set_baudrate,   0 },
+	{ "parity",  NULL,             "Toggle serial line parity bit",           toggle_parity,  0 },
+	{ "request", "[-fresh] ADDR [ID ...]", "Request data, full XML or some records", query_device, CMD_MERGE },
+	{ "poll",    "[ADDR ...]",     "Request data from many, default registry", poll_devices,  CMD_MERGE },
+	{ "schedule", "[ADDR SEC [J]]", "Poll every SEC + 0-J seconds, SEC 0: stop", schedule_device, 0 },
+	{ NULL,      NULL,             NULL,                                      NULL,           0 },
+	{ "probe",   "[fresh] [MASK]", "Secondary address scan, fresh: no cache", probe_devices,  0 },
+	{ "probe-age", "[off | SEC]",  "Re-probe cached empty branches > SEC old", set_probe_age, CMD_LOCAL },
+	{ "scan",    "[fast] [resolve]", "Primary scan, fast: short timeout, resolve: collisions", scan_devices, 0 },
+	{ NULL,      NULL,             NULL,                                      NULL,           0 },
+	{ "bus",     "[ID]",           "Show buses, or set default bus for cmds", select_bus,     CMD_LOCAL },
+	{ "stats",   "[reset|save]",   "Show bus statistics, or reset/save them", show_stats,     CMD_LOCAL },
+	{ "status",  NULL,             "Show running and queued commands",        show_status,    CMD_LOCAL },
+	{ "abort",   "[ID]",           "Abort commands on bus ID, default all",   abort_command,  CMD_LOCAL },
+	{ "priority", "[low|normal|high]", "Priority of commands on the bus queue", set_priority, CMD_LOCAL },
+	{ "debug",   NULL,             "Toggle debug mode",                       toggle_debug,   CMD_LOCAL },
+	{ "verbose", NULL,             "Toggle verbose output",                   toggle_verbose, CMD_LOCAL },
+	{ "xml",     NULL,             "Toggle XML output",                       toggle_xml,     CMD_LOCAL },
+	{ "format",  "[FORMAT]",       "Output format: text, xml, json, csv, bin", set_format,    CMD_LOCAL },
+	{ "delta",   "[off | N]",      "Only changed records, full every N polls", set_delta,     CMD_LOCAL },
+	{ "cache",   "[off | SEC]",    "Answer requests from readouts < SEC old", set_cache,      CMD_LOCAL },
+	{ "export",  "SEC [FROM [TO]]", "Archived readings, times UNIX or -SEC ago", export_archive, CMD_LOCAL },
+	{ "profile", "[on | off]",     "Show decode profile hit rate, or toggle", set_profile,    CMD_LOCAL },
+	{ "help",    "[CMD]",          "Display (this) menu",                     show_help,      CMD_LOCAL },
+	{ "quit",    NULL,             "Quit",                                    quit_program,   CMD_LOCAL },
+	{ NULL,      NULL,             NULL,                                      NULL,           0 },
+	{ "load",    "[FILE]",         "Load registry snapshot, verify devices",  load_registry,  CMD_LOCAL },
+	{ "save",    "[FILE]",         "Save registry snapshot",                  save_registry,  CMD_LOCAL },
+	{ "verify",  NULL,             "Verify registry, drop stale devices",     verify_devices, 0 },
+};
+
+static const char *cmd_name(bus_cmd cb)
+{
+	for (size_t i = 0; i < NELEMS(cmds); i++) {
+		if (cmds[i].c_cmd && cmds[i].c_cb == cb)
+			return cmds[i].c_cmd;
+	}
+
+	return "?";
+}
+
+static int show_help(mbus_handle *handle, char *args)
+{
+	FILE *fp = bus_out();
+	int w = 0;
+
+	(void)handle;
+
+	if (args) {
+		size_t len = strlen(args);
+
+		dbg("Looking for help to command '%s'", args);
+		for (size_t i = 0; i < NELEMS(cmds); i++) {
+			struct cmd *c = &cmds[i];
+
+			if (!c->c_cmd)
+				continue;
+
+			if (strncmp(c->c_cmd, args, len))
+				continue;
+
+			fprintf(fp, "Usage:\n"
+				"\t%s %s\n\n", c->c_cmd, c->c_arg ?: "");
+			fprintf(fp, "Description:\n"
+				"\t%s\n", c->c_desc);
+			return 0;
+		}
+
+		warnx("no such command.");
+		return -1;
+	}
+
+	for (size_t i = 0; i < NELEMS(cmds); i++) {
+		int len;
+
+		if (!cmds[i].c_cmd)
+			continue;
+
+		len = (int)strlen(cmds[i].c_cmd);
+		if (len > w)
+			w = len;
+	}
+
+	for (size_t i = 0; i < NELEMS(cmds); i++) {
+		struct cmd *c = &cmds[i];
+
+		if (!c->c_cmd) { /* separator */
+			fputs("\n", fp);
+			continue;
+		}
+		if (!c->c_desc)  /* alias */
+			continue;
+
+		fprintf(fp, "%-*s %-14s  %s\n", w, c->c_cmd, c->c_arg ?: "", c->c_desc);
+	}
+
+	return 0;
+}
+
+/* drop leading whitespace and any/all newlines */
+static char *chompy(char *str)
+{
+	char *p;
+
+	if (!str || strlen(str) < 1)
+		return NULL;
+
+	while (*str == ' ' || *str == '\t')
+		str++;
+
+	/* also CRLF, from e.g. socat or nc */
+	p = str + strlen(str) - 1;
+	while (p >= str && (*p == '\n' || *p == '\r'))
+		*p-- = 0;
+
+	return str;
+}
+
+static void prompt(void)
+{
+	if (!interactive)
+		return;
+
+	printf("\033[2K\r> ");
+	fflush(stdout);
+}
+
+/* Command by name, or the first one it is a prefix of */
+static struct cmd *cmd_find(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (len < 1)
+		return NULL;
+
+	for (size_t i = 0; i < NELEMS(cmds); i++) {
+		struct cmd *c = &cmds[i];
+
+		if (c->c_cmd && !strncmp(c->c_cmd, name, len))
+			return c;
+	}
+
+	return NULL;
+}
+
+/* Bus of an '@N' prefix, '@*' or '@all' for all, returns -1 on error */
+static int parse_target(const char *arg, int *target)
+{
+	char *end;
+	long id;
+
+	if (!strcmp(arg, "*") || !strcmp(arg, "all")) {
+		*target = ALL_BUSES;
+		return 0;
+	}
+
+	/* all of it, so a typo is not bus 0 */
+	errno = 0;
+	id = strtol(arg, &end, 10);
+	if (!*arg || *end || errno || id < 0 || id >= bus_count() || !bus_get(id))
+		return -1;
+	*target = id;
+
+	return 0;
+}
+
+static int runcmd(struct source *src, char *line)
+{
+	int target = src->bus;
+	char *cmd, *args;
+	struct cmd *c;
+
+	args = chompy(line);
+	if (!args)
+		return -1;
+
+	cmd = strsep(&args, " \n\t");
+	if (cmd[0] == '@') {
+		if (parse_target(&cmd[1], &target)) {
+			warnx("no such bus %s.", &cmd[1]);
+			return 1;
+		}
+
+		cmd = strsep(&args, " \n\t");
+		if (!cmd)
+			return 1;
+	}
+	if (args && *args == 0)
+		args = NULL;
+
+	dbg("CMD: %s ARGS: %s", cmd, args ?: "");
+	c = cmd_find(cmd);
+	if (!c) {
+		warnx("no such command. Use 'help' to list commands.");
+		return 1;
+	}
+
+	if (c->c_flags & CMD_LOCAL)
+		return c->c_cb(bus_get(src->bus)->handle, args);
+
+	return submit_on(src, target, c->c_cb, args,
+			 src->prio | (c->c_flags & CMD_MERGE ? JOB_MERGE : 0));
+}
+
+/* Command done, and its output written: prompt, or tell client */
+static void source_done(struct source *src, int rc)
+{
+	if (!src->client) {
+		sink_end(bus_out());
+		prompt();
+		return;
+	}
+
+	fprintf(src->out, "%s\n", rc ? "ERROR" : "OK");
+	fflush(src->out);
+}
+
+static void source_free(struct source *src)
+{
+	struct source **pp;
+
+	for (pp = &sources; *pp; pp = &(*pp)->next) {
+		if (*pp == src) {
+			*pp = src->next;
+			break;
+		}
+	}
+
+	if (src->fd != -1) {
+		loop_del(src->fd);
+		close(src->fd);
+	}
+	if (src->out) {
+		out_forget(src->out);
+		fclose(src->out);
+	}
+	if (src->ofd != -1) {
+		loop_del(src->ofd);
+		close(src->ofd);
+	}
+	pthread_mutex_destroy(&src->olock);
+	free(src->obuf);
+	free(src);
+}
+
+/* Queue output for a client, any thread */
+static ssize_t client_write(void *cookie, const char *buf, size_t len)
+{
+	struct source *src = cookie;
+
+	pthread_mutex_lock(&src->olock);
+	if (!src->dead && src->olen + len > src->omax) {
+		size_t max = src->omax ?: 4096;
+		char *ptr = NULL;
+
+		while (max < src->olen + len)
+			max *= 2;
+		if (max <= CTRL_BUF_MAX)
+			ptr = realloc(src->obuf, max);
+		if (ptr) {
+			src->obuf = ptr;
+			src->omax = max;
+		} else {
+			warnx("control client %d not reading its output, dropping it.", src->fd);
+			src->dead = 1;
+		}
+	}
+	if (!src->dead) {
+		memcpy(&src->obuf[src->olen], buf, len);
+		src->olen += len;
+	}
+	pthread_mutex_unlock(&src->olock);
+
+	/* the event loop starts sending */
+	loop_wake();
+
+	return len;
+}
+
+/*
+ * From the event loop: poll for output while there is any, and free the
+ * client when it is done and all is sent, or it is dead.  Returns 1 if
+ * the client was freed.
+ */
+static int client_poll(struct source *src)
+{
+	int dead, idle;
+
+	pthread_mutex_lock(&src->olock);
+	dead = src->dead;
+	idle = !src->olen;
+	pthread_mutex_unlock(&src->olock);
+
+	if (dead && !src->eof) {
+		src->eof = 1;
+		src->len = 0;
+		loop_pause(src->fd, 1);
+	}
+	loop_pause(src->ofd, dead || idle);
+
+	if (src->eof && !src->len && !src->busy && !source_pending(src) && (dead || idle)) {
+		dbg("control client %d done", src->fd);
+		source_free(src);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void client_send(int fd, void *arg)
+{
+	struct source *src = arg;
+	ssize_t len;
+
+	pthread_mutex_lock(&src->olock);
+	len = send(fd, src->obuf, src->olen, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (len > 0) {
+		src->olen -= len;
+		memmove(src->obuf, &src->obuf[len], src->olen);
+	} else if (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		src->dead = 1;
+	pthread_mutex_unlock(&src->olock);
+
+	client_poll(src);
+}
+
+/* Run complete lines in buffer, when waiting only one at a time */
+static void source_run(struct source *src)
+{
+	while (running) {
+		int blank, rc = 0;
+		char *nl;
+
+		if (src->wait && source_pending(src))
+			break;
+
+		nl = memchr(src->buf, '\n', src->len);
+		if (!nl) {
+			if (src->len == CMD_MAX) {
+				warnx("command too long, max %d chars.", CMD_MAX);
+				src->len = 0;
+			}
+			if (!src->eof || !src->len)
+				break;
+			nl = &src->buf[src->len];	/* last line, no newline */
+		}
+
+		*nl = 0;
+		blank = !src->buf[strspn(src->buf, " \t\r")];
+		if (!blank) {
+			curr_src = src;
+			bus_set_out(src->out);
+			rc = runcmd(src, src->buf);
+			bus_set_out(NULL);
+			curr_src = &input;
+		}
 
-	if (mbus_send_ping_frame(handle, next, 0) == -1) {
-		warnx("failed sending verification ping: %s", mbus_error_str());
-		return 1;
-	}
+		if (nl < &src->buf[src->len])
+			nl++;
+		src->len -= nl - src->buf;
+		memmove(src->buf, nl, src->len);
 
-	if (mbus_recv_frame(handle, &reply) != MBUS_RECV_RESULT_TIMEOUT) {
-		warn("verification failed, primary address [%d] already in use, %s", next, mbus_error_str());
-		return 1;
+		if (blank && !src->client)
+			prompt();
+		else if (!blank && !src->busy)
+			source_done(src, rc);
 	}
 
-	if (curr == MBUS_ADDRESS_NETWORK_LAYER) {
-		if (secondary_select(handle, mask) == -1)
-			return 1;
-	}
+	/* no more input until the command is done */
+	loop_pause(src->fd, src->eof || (src->wait && source_pending(src)));
 
-	for (int retries = 3; retries > 0; retries--) {
-		if (mbus_set_primary_address(handle, curr, next) == -1) {
-			warnx("failed setting device [%s] primary address: %s", mask, mbus_error_str());
-			return 1;
+	if (src->eof && !src->len && !source_pending(src)) {
+		/* freed when its output is sent */
+		if (src->client) {
+			client_poll(src);
+			return;
 		}
 
-		if (mbus_recv_frame(handle, &reply) == MBUS_RECV_RESULT_TIMEOUT) {
-			if (retries > 1)
-				continue;
-
-			warnx("No reply from device [%s], %s", mask, mbus_error_str());
-			return 1;
-		}
-		break;
-	}
+		loop_del(src->fd);
+		src->fd = -1;
 
-	if (mbus_frame_type(&reply) != MBUS_FRAME_TYPE_ACK) {
-		warnx("invalid response from device [%s], exected ACK, got:", mask);
-		mbus_frame_print(&reply);
-		return 1;
+		/* stdin/file is done, now we only run the schedule */
+		if (!daemonize)
+			running = 0;
 	}
+}
 
-	dbg("primary address of device %s set to %d", mask, next);
-	if (id > -1 && id < REG_NUM_MAX)
-		registry[id].primary = next;
-
-	return 0;
+static void source_read(int fd, void *arg)
+{
+	struct source *src = arg;
+	ssize_t len;
+
+	len = read(fd, &src->buf[src->len], CMD_MAX - src->len);
+	if (len == -1 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (len <= 0)
+		src->eof = 1;
+	else
+		src->len += len;
+
+	source_run(src);
 }
 
-static int set_baudrate(mbus_handle *handle, char *args)
+static void ctrl_accept(int sd, void *arg)
 {
-	long baudrate;
-	char *arg;
+	static const cookie_io_functions_t io = { .write = client_write };
+	struct source *src;
+	int fd;
 
-	if (!args) {
-		warnx("missing argument.\nUsage: set [ADDR] BAUDRATE");
-		return 1;
-	}
+	(void)arg;
 
-	arg = strsep(&args, " \n\t");
-	if (!args || *args == 0) {
-		baudrate = atol(arg);
-	} else {
-		warnx("Setting device baudrate not supported yet.");
-		return 1;
+	fd = accept(sd, NULL, NULL);
+	if (fd == -1) {
+		warn("failed accepting control client");
+		return;
 	}
-
-	if (baudrate < 300) {
-		warnx("Too low baudrate, recommeded: 300, 2400, 9600.");
-		return 1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	src = calloc(1, sizeof(*src));
+	if (!src)
+		goto fail;
+
+	src->fd     = fd;
+	src->client = 1;
+	src->wait   = 1;
+	src->bus    = input.bus;
+	src->prio   = JOB_NORMAL;
+	src->ofd    = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	pthread_mutex_init(&src->olock, NULL);
+	src->out    = fopencookie(src, "w", io);
+	if (src->ofd == -1 || !src->out || loop_add(fd, source_read, src) ||
+	    loop_add_out(src->ofd, client_send, src)) {
+		warn("failed setting up control client");
+		loop_del(fd);
+		if (src->out)
+			fclose(src->out);
+		if (src->ofd != -1)
+			close(src->ofd);
+		pthread_mutex_destroy(&src->olock);
+		free(src->obuf);
+		free(src);
+		goto fail;
 	}
-	switch (baudrate) {
-	case 300:
-	case 2400:
-	case 9600:
-		break;
-	default:
-		warnx("Not recommended by M-Bus standard.");
-		break;
+	loop_pause(src->ofd, 1);
+
+	src->next = input.next;
+	input.next = src;
+	dbg("control client %d connected", fd);
+
+	return;
+fail:
+	close(fd);
+}
+
+/* Unix socket speaking the command set, one command per line */
+static int ctrl_open(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	mode_t mask;
+	int rc;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
 	}
+	strcpy(addr.sun_path, path);
 
-	if (mbus_serial_set_baudrate(handle, baudrate) == -1) {
-		warnx("Failed setting baud rate %ld on serial port %s: %s",
-		      baudrate, device, mbus_error_str());
-		return 1;
+	ctrl_sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ctrl_sd == -1)
+		return -1;
+	fcntl(ctrl_sd, F_SETFD, FD_CLOEXEC);
+
+	/* stale socket from an earlier run */
+	remove(path);
+
+	/* access is by file permissions: owner and group only */
+	mask = umask(0117);
+	rc = bind(ctrl_sd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (rc || listen(ctrl_sd, 8) || loop_add(ctrl_sd, ctrl_accept, NULL)) {
+		close(ctrl_sd);
+		ctrl_sd = -1;
+		return -1;
 	}
 
 	return 0;
 }
 
-static int toggle_parity(mbus_handle *handle, char *args)
+static void ctrl_close(void)
 {
-	(void)args;
-	parity ^= 1;
-	log("parity %s", parity ? "even" : "disabled");
+	if (ctrl_sd == -1)
+		return;
 
-	return mbus_serial_set_parity(handle, !parity ? 0 : 2);
+	loop_del(ctrl_sd);
+	close(ctrl_sd);
+	remove(ctrl_path);
+	ctrl_sd = -1;
 }
 
+/*
+ * Commands from -f FILE are read and compiled to a list of steps before
+ * any bus traffic: lines of any length, blank lines and # comments are
+ * skipped, and the bus and command of each line are resolved, and its
+ * addresses and record IDs checked.  Errors are reported with the line
+ * number, and if there are any nothing is run, rather than finding a
+ * typo an hour into a run.
+ *
+ * Steps for the same bus are queued back to back, up to BATCH_DEPTH at
+ * a time, so the bus goes from one request to the next without waiting
+ * for the event loop.  With the slave state kept between requests, see
+ * init_slaves(), consecutive requests cost the same as one poll of them
+ * all, while the output, cache and record selection stay those of each
+ * request.  Local commands, and a change of bus, wait for all steps
+ * before them, so output is in the order of the file.  A failed step is
+ * reported with its line number, and the batch goes on.
+ */
+#define BATCH_DEPTH 16
+#define DEFAULT_BUS -2
+
+struct step {
+	size_t      line;
+	int         target;		/* bus, ALL_BUSES or DEFAULT_BUS */
+	struct cmd *cmd;
+	char       *args;		/* NULL, or own copy */
+	int         pending;		/* bus jobs not done, src_lock */
+	int         rc;
+};
 
-#define ENABLED(v) v ? "enabled" : "disabled"
-
-static int toggle_debug(mbus_handle *handle, char *args)
+static struct batch {
+	const char  *file;
+	struct step *steps;
+	size_t       num;
+	size_t       max;
+	size_t       next;		/* to run */
+	size_t       done;		/* reported */
+	int          target;		/* of steps in flight */
+	size_t       failed;
+	int          active;
+} batch;
+
+static int check_addr(const char *addr)
 {
-	(void)args;
-	debug ^= 1;
-	log("debug mode %s", ENABLED(debug));
+	if (mbus_is_secondary_address(addr))
+		return 0;
+	if (addr[strspn(addr, "0123456789")] || atoi(addr) < 1 || atoi(addr) > 255)
+		return -1;
 
-	return mbus_debug(handle, debug);
+	return 0;
 }
 
-static int toggle_verbose(mbus_handle *handle, char *args)
+static int check_num(const char *arg)
 {
-	(void)args;
-	verbose ^= 1;
-	log("verbose output %s", ENABLED(verbose));
+	return !*arg || arg[strspn(arg, "0123456789")] ? -1 : 0;
+}
 
-	return 0;
+/*
+ * Check the arguments of the commands that talk to devices, the ones a
+ * generated file is made of, returns what is wrong or NULL.
+ */
+static const char *check_args(struct cmd *c, const char *args)
+{
+	char buf[args ? strlen(args) + 1 : 1], *p = buf, *arg;
+	const char *err = NULL;
+	int n = 0;
+
+	strcpy(buf, args ?: "");
+	if (c->c_cb == query_device) {
+		while (!err && (arg = strsep(&p, " \t"))) {
+			if (!*arg || (n == 0 && !strcmp(arg, "-fresh")))
+				continue;
+			if (n++ == 0)
+				err = check_addr(arg) ? "invalid address" : NULL;
+			else
+				err = check_num(arg) ? "invalid record ID" : NULL;
+		}
+		if (!err && !n)
+			err = "missing address";
+	} else if (c->c_cb == poll_devices) {
+		while (!err && (arg = strsep(&p, " \t"))) {
+			if (*arg)
+				err = check_addr(arg) ? "invalid address" : NULL;
+		}
+	} else if (c->c_cb == schedule_device && args) {
+		while (!err && (arg = strsep(&p, " \t"))) {
+			if (!*arg)
+				continue;
+			if (n++ == 0)
+				err = check_addr(arg) ? "invalid address" : NULL;
+			else
+				err = check_num(arg) ? "invalid interval" : NULL;
+		}
+		if (!err && n < 2)
+			err = "missing interval";
+	}
+
+	return err;
 }
 
-static int toggle_xml(mbus_handle *handle, char *args)
+/* Compile one line to a step, returns -1 on error */
+static int batch_line(char *line, size_t num)
 {
-	(void)args;
-	xml ^= 1;
-	log("XML output %s", ENABLED(xml));
+	struct step *s;
+	char *cmd, *args = line;
+	int target = DEFAULT_BUS;
+	const char *err;
+	struct cmd *c;
+
+	args += strspn(args, " \t");
+	if (!*args || *args == '#')
+		return 0;
+
+	cmd = strsep(&args, " \t");
+	if (cmd[0] == '@') {
+		if (parse_target(&cmd[1], &target)) {
+			warnx("%s:%zu: no such bus %s.", batch.file, num, &cmd[1]);
+			return -1;
+		}
+		args += args ? strspn(args, " \t") : 0;
+		cmd = strsep(&args, " \t");
+		if (!cmd || !*cmd) {
+			warnx("%s:%zu: missing command.", batch.file, num);
+			return -1;
+		}
+	}
+	if (args && *args == 0)
+		args = NULL;
+
+	c = cmd_find(cmd);
+	if (!c) {
+		warnx("%s:%zu: no such command '%s'.", batch.file, num, cmd);
+		return -1;
+	}
+	err = check_args(c, args);
+	if (err) {
+		warnx("%s:%zu: %s %s: %s.", batch.file, num, c->c_cmd, args ?: "", err);
+		return -1;
+	}
+
+	if (batch.num == batch.max) {
+		size_t max = batch.max ? batch.max * 2 : 256;
+
+		s = realloc(batch.steps, max * sizeof(*s));
+		if (!s) {
+			warn("%s:%zu", batch.file, num);
+			return -1;
+		}
+		batch.steps = s;
+		batch.max = max;
+	}
+
+	s = &batch.steps[batch.num];
+	memset(s, 0, sizeof(*s));
+	s->line   = num;
+	s->target = target;
+	s->cmd    = c;
+	if (args && !(s->args = strdup(args))) {
+		warn("%s:%zu", batch.file, num);
+		return -1;
+	}
+	batch.num++;
 
 	return 0;
 }
 
-static int show_help(mbus_handle *handle, char *args);
+/* Read and compile all of file, returns -1 on any error */
+static int batch_load(const char *file)
+{
+	size_t len = 0, num = 0;
+	char *line = NULL;
+	ssize_t n;
+	int rc = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		warn("failed opening %s for reading", file);
+		return -1;
+	}
 
-struct cmd {
-	char *c_cmd;
-	char *c_arg;
-	char *c_desc;
-	int (*c_cb)(mbus_handle *, char *);
-};
+	batch.file   = file;
+	batch.active = 1;
+	while ((n = getline(&line, &len, fp)) != -1) {
+		num++;
+		while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+			line[--n] = 0;
+		if (batch_line(line, num))
+			rc = -1;
+	}
+	if (ferror(fp)) {
+		warn("failed reading %s", file);
+		rc = -1;
+	}
+	free(line);
+	fclose(fp);
 
-struct cmd cmds[] = {
-	{ "address", "MASK ADDR",   "Set primary address",                    set_address    },
-	{ "baud",    "[ADDR] RATE", "Set (device) baud rate [300,2400,9600]", set_baudrate   },
-	{ "rate",    NULL,          NULL,                                     set_baudrate   },
-	{ "parity",  NULL,          "Toggle serial line parity bit",          toggle_parity  },
-	{ "request", "ADDR [ID]",   "Request data, full XML or one record",   query_device   },
-	{ NULL,      NULL,          NULL,                                     NULL           },
-	{ "probe",   "[MASK]",      "Secondary address scan",                 probe_devices  },
-	{ "scan",    NULL,          "Primary address scan",                   scan_devices   },
-	{ NULL,      NULL,          NULL,                                     NULL           },
-	{ "debug",   NULL,          "Toggle debug mode",                      toggle_debug   },
-	{ "verbose", NULL,          "Toggle verbose output",                  toggle_verbose },
-	{ "xml",     NULL,          "Toggle XML output",                      toggle_xml     },
-	{ "help",    "[CMD]",       "Display (this) menu",                    show_help      },
-	{ "quit",    NULL,          "Quit",                                   quit_program   },
-};
+	if (!rc)
+		dbg("%s: %zu lines, %zu commands", file, num, batch.num);
 
-static int show_help(mbus_handle *handle, char *args)
-{
-	int w = 0;
+	return rc;
+}
 
-	(void)handle;
+static void batch_free(void)
+{
+	for (size_t i = 0; i < batch.num; i++)
+		free(batch.steps[i].args);
+	free(batch.steps);
+	memset(&batch, 0, sizeof(batch));
+}
 
-	if (args) {
-		size_t len = strlen(args);
+/* called by the bus worker, rc includes decoding the step's telegrams */
+static void step_done(void *arg, int rc)
+{
+	struct step *s = arg;
 
-		dbg("Looking for help to command '%s'", args);
-		for (size_t i = 0; i < NELEMS(cmds); i++) {
-			struct cmd *c = &cmds[i];
+	pthread_mutex_lock(&src_lock);
+	s->rc |= rc;
+	s->pending--;
+	pthread_mutex_unlock(&src_lock);
 
-			if (!c->c_cmd)
-				continue;
+	loop_wake();
+}
 
-			if (strncmp(c->c_cmd, args, len))
-				continue;
+static int step_pending(struct step *s)
+{
+	int pending;
 
-			printf("Usage:\n"
-			       "\t%s %s\n\n", c->c_cmd, c->c_arg ?: "");
-			printf("Description:\n"
-			       "\t%s\n", c->c_desc);
-			return 0;
-		}
+	pthread_mutex_lock(&src_lock);
+	pending = s->pending;
+	pthread_mutex_unlock(&src_lock);
 
-		warnx("no such command.");
-		return -1;
-	}
+	return pending;
+}
 
-	for (size_t i = 0; i < NELEMS(cmds); i++) {
-		int len;
+static void step_submit(struct step *s, int target)
+{
+	int flags = input.prio | (s->cmd->c_flags & CMD_MERGE ? JOB_MERGE : 0);
 
-		if (!cmds[i].c_cmd)
+	for (int i = 0; i < bus_count(); i++) {
+		if (target != ALL_BUSES && target != i)
 			continue;
 
-		len = (int)strlen(cmds[i].c_cmd);
-		if (len > w)
-			w = len;
+		pthread_mutex_lock(&src_lock);
+		s->pending++;
+		pthread_mutex_unlock(&src_lock);
+
+		if (bus_submit(bus_get(i), s->cmd->c_cb, s->args, flags, step_done, s)) {
+			warn("failed queuing command on bus %d", i);
+			step_done(s, 1);
+		}
 	}
+}
 
-	for (size_t i = 0; i < NELEMS(cmds); i++) {
-		struct cmd *c = &cmds[i];
+/* Report steps done, in order */
+static void batch_reap(void)
+{
+	while (batch.done < batch.next) {
+		struct step *s = &batch.steps[batch.done];
 
-		if (!c->c_cmd) { /* separator */
-			puts("");
-			continue;
-		}
-		if (!c->c_desc)  /* alias */
-			continue;
+		if (step_pending(s))
+			break;
 
-		printf("%-*s %-12s  %s\n", w, c->c_cmd, c->c_arg ?: "", c->c_desc);
+		if (s->rc) {
+			warnx("%s:%zu: %s failed.", batch.file, s->line, s->cmd->c_cmd);
+			batch.failed++;
+		}
+		batch.done++;
 	}
-
-	return 0;
 }
 
-/* drop leading whitespace and any/all newlines */
-static char *chompy(char *str)
+/* Run next steps of batch, from the event loop */
+static void batch_run(void)
 {
-	char *p;
+	batch_reap();
 
-	if (!str || strlen(str) < 1)
-		return NULL;
-
-	while (*str == ' ' || *str == '\t')
-		str++;
+	while (running && batch.next < batch.num) {
+		struct step *s = &batch.steps[batch.next];
+		size_t inflight = batch.next - batch.done;
+		int target = s->target == DEFAULT_BUS ? input.bus : s->target;
+		int local = s->cmd->c_flags & CMD_LOCAL;
 
-	p = str + strlen(str) - 1;
-        while (p >= str && *p == '\n')
-		*p-- = 0;
+		if (inflight && (local || target != batch.target || inflight >= BATCH_DEPTH))
+			break;
 
-	return str;
-}
+		if (local) {
+			/*
+			 * All output written before a 'format', etc.  Decode errors
+			 * of earlier steps are in their rc already, see bus_rc(),
+			 * what is left is from scheduled polls, not from this file.
+			 */
+			decode_wait();
+			s->rc = s->cmd->c_cb(bus_get(input.bus)->handle, s->args);
+		} else {
+			batch.target = target;
+			step_submit(s, target);
+		}
+		batch.next++;
+		batch_reap();
+	}
 
-static int readcmd(FILE *fp, mbus_handle *handle)
-{
-	char *cmd, *args;
-	char line[42];
-	size_t len;
+	if (batch.done < batch.num)
+		return;
 
-	if (interactive) {
-		fflush(fp);
-		printf("\033[2K\r> ");
-		fflush(stdout);
+	decode_wait();
+	if (batch.failed) {
+		warnx("%s: %zu of %zu commands failed.", batch.file, batch.failed, batch.num);
+		exit_rc = 1;
 	}
+	batch_free();
 
-	if (!(args = fgets(line, sizeof(line), fp)))
-		return -1;
+	/* the file is done, now we only run the schedule */
+	if (!daemonize)
+		running = 0;
+}
 
-	args = chompy(args);
-	if (!args)
-		return -1;
+/* After a wakeup from a bus worker, or a signal */
+static void wakeup(void)
+{
+	struct source *src, *next;
 
-	cmd = strsep(&args, " \n\t");
-	if (args && *args == 0)
-		args = NULL;
+	if (batch.active)
+		batch_run();
+	metrics_expire();
 
-	len = strlen(cmd);
-	if (len < 1)
-		return 1;
+	if (interrupted) {
+		int num = 0;
 
-	dbg("CMD: %s ARGS: %s", cmd, args ?: "");
-	for (size_t i = 0; i < NELEMS(cmds); i++) {
-		struct cmd *c = &cmds[i];
+		interrupted = 0;
+		if (interactive) {
+			for (int i = 0; i < bus_count(); i++)
+				num += abort_bus(i);
+		}
+		if (!num)
+			running = 0;
+	}
 
-		if (!c->c_cmd)
-			continue;
+	for (src = sources; src; src = next) {
+		int rc;
 
-		dbg("CMP: %s vs CMD: %s", cmd, c->c_cmd);
-		if (strncmp(c->c_cmd, cmd, len))
+		next = src->next;
+		if (src->client && client_poll(src))
+			continue;	/* gone */
+		if (!src->busy || source_pending(src))
 			continue;
 
-		return c->c_cb(handle, args);
-	}
+		/* all output written before the prompt, or next command */
+		decode_wait();
 
-	warnx("no such command. Use 'help' to list commands.");
+		pthread_mutex_lock(&src_lock);
+		rc = src->rc;
+		src->rc = 0;
+		pthread_mutex_unlock(&src_lock);
 
-	return 1;
+		src->busy = 0;
+		source_done(src, rc);
+
+		if (src->fd != -1)
+			source_run(src);
+	}
 }
 
 #ifndef __ZEPHYR__
 static void sigcb(int signo)
 {
-	running = 0;
+	if (signo == SIGINT)
+		interrupted = 1;
+	else
+		running = 0;
+	loop_wake();
 }
 
 static int usage(int rc)
 {
 	fprintf(stderr,
-		"Usage: %s [-d] [-b RATE] DEVICE\n"
+		"Usage: %s [-dDpvx] [-A DIR] [-b RATE] [-c FILE] [-f FILE] [-M PORT] [-o FORMAT]\n"
+		"       %*s [-O POLICY] [-r FILE] [-s FILE] [-S PATH] DEVICE [DEVICE ...]\n"
 		"\n"
 		"Options:\n"
+		" -A DIR     Archive all numeric readings in DIR, see 'export'\n"
 		" -b RATE    Set baudrate: 300, 2400, 9600, default: 2400\n"
+		"            of TCP buses: the speed the converter is set up for\n"
+		" -c FILE    Probe cache, resume and speed up secondary scans\n"
 		" -d         Enable debug messages\n"
-		" -f FILE    Execute commands from file and then exit\n"
+		" -D         Daemon mode, keep running scheduled polls after all\n"
+		"            commands have been read, e.g. from -f FILE\n"
+		" -f FILE    Execute commands from file, in order, and then exit.  All\n"
+		"            lines are checked first, nothing is run on errors\n"
+		" -M PORT    Serve latest readings and bus statistics over HTTP, on\n"
+		"            GET /metrics, in OpenMetrics format.  Also ADDR:PORT\n"
+		" -o FORMAT  Output format: text, xml, json, csv, bin, default: text\n"
+		" -O POLICY  Queue output to stdout in a ring, so a slow reader does not\n"
+		"            stall the buses.  When full: block, drop (oldest), or\n"
+		"            spill:FILE (new records appended to FILE)\n"
 		" -p         Disable parity bit => 8N1, default: 8E1\n"
+		" -r FILE    Registry snapshot, loaded at start, saved at exit\n"
+		" -s FILE    Save bus statistics to file every minute, and at exit\n"
+		" -S PATH    Control socket, clients send commands one per line and get\n"
+		"            the output of each, followed by a line with OK or ERROR\n"
 		" -v         Verbose output (where applicable)\n"
 		" -x         XML output (where applicable)\n"
+		"\n"
+		"Interactive commands run in the background, see 'status', and\n"
+		"are stopped with 'abort', or Ctrl-C.  With nothing running Ctrl-C\n"
+		"quits.\n"
+		"\n"
 		"Arguments:\n"
-		" DEVICE     Serial port/pty to use\n"
+		" DEVICE     Serial port/pty to use, one per bus, or tcp://HOST:PORT\n"
+		"            of an M-Bus to TCP converter.  Commands run on the\n"
+		"            default bus, see 'bus', or on bus N when given as\n"
+		"            '@N cmd', or on all buses in parallel with '@* cmd'\n"
 		"\n"
-		"Copyright (c) 2022  Addiva Elektronik AB\n", arg0);
+		"Copyright (c) 2022  Addiva Elektronik AB\n", arg0, (int)strlen(arg0), "");
 	return rc;
 }
 #endif
 
 int main(int argc, char **argv)
 {
-	mbus_handle *handle;
+	char *archive = NULL;
+	char *cache = NULL;
+	char *metrics = NULL;
 	char *file = NULL;
 	char *rate = NULL;
-	FILE *fp = stdin;
+	const char *spill = NULL;
+	int policy = -1;
+	int rc = 0;
+	FILE *sink;
 #ifndef __ZEPHYR__
 	int c;
 
@@ -724,26 +3465,58 @@ int main(int argc, char **argv)
 	signal(SIGINT, sigcb);
 	signal(SIGHUP, sigcb);
 	signal(SIGTERM, sigcb);
+	signal(SIGPIPE, SIG_IGN);	/* control client gone */
 
-	while ((c = getopt(argc, argv, "b:df:pvx")) != EOF) {
+	while ((c = getopt(argc, argv, "A:b:c:dDf:M:o:O:pr:s:S:vx")) != EOF) {
 		switch (c) {
+		case 'A':
+			archive = optarg;
+			break;
 		case 'b':
 			rate = optarg;
 			break;
+		case 'c':
+			cache = optarg;
+			break;
 		case 'd':
 			debug = 1;
 			break;
+		case 'D':
+			daemonize = 1;
+			break;
 		case 'f':
 			file = optarg;
 			break;
+		case 'M':
+			metrics = optarg;
+			break;
+		case 'o':
+			format = out_parse(optarg);
+			if (format == -1)
+				errx(1, "unknown output format '%s'.", optarg);
+			break;
+		case 'O':
+			policy = sink_parse(optarg, &spill);
+			if (policy == -1)
+				errx(1, "unknown output policy '%s'.", optarg);
+			break;
 		case 'p':
 			parity = 0;
 			break;
+		case 'r':
+			regfile = optarg;
+			break;
+		case 's':
+			statsfile = optarg;
+			break;
+		case 'S':
+			ctrl_path = optarg;
+			break;
 		case 'v':
 			verbose = 1;
 			break;
 		case 'x':
-			xml = 1;
+			format = OUT_XML;
 			break;
 		default:
 			return usage(0);
@@ -752,45 +3525,111 @@ int main(int argc, char **argv)
 
 	if (optind >= argc)
 		return usage(1);
-	device = argv[optind++];
-#else
-	device = uart0;
 #endif
-	if (file) {
-		fp = fopen(file, "r");
-		if (!fp)
-			err(1, "failed opening %s for reading", file);
-	}
-	interactive = isatty(fileno(fp));
+	input.fd = file ? -1 : STDIN_FILENO;
+	interactive = !file && isatty(input.fd);
+	input.wait  = !interactive;
 
-	handle = mbus_context_serial(device);
-	if (!handle) {
-		warnx("Failed initializing M-Bus context: %s", mbus_error_str());
-		return 1;
+	if (loop_init())
+		err(1, "failed setting up event loop");
+
+	if (cache && probe_cache_load(cache))
+		err(1, "failed loading probe cache %s", cache);
+
+	if (policy != -1) {
+		fflush(stdout);
+		sink = sink_open(STDOUT_FILENO, policy, spill);
+		if (!sink)
+			err(1, "failed setting up output ring");
+		bus_default_out(sink);
 	}
 
-	if (mbus_connect(handle) == -1)
-		errx(1, "%s", mbus_error_str());
+	if (archive && archive_open(archive))
+		err(1, "failed opening archive %s", archive);
+
+	if (metrics && metrics_open(metrics))
+		err(1, "failed serving metrics on %s", metrics);
+
+	if (decode_start(decode_telegram))
+		err(1, "failed starting decoder");
 
-	if (rate && set_baudrate(handle, rate))
+#ifndef __ZEPHYR__
+	for (c = optind; c < argc; c++) {
+		if (!bus_open(argv[c]))
+			goto error;
+	}
+#else
+	if (!bus_open(uart0))
 		goto error;
+#endif
 
-	if (!parity)
-		mbus_serial_set_parity(handle, 0);
+	for (int i = 0; i < bus_count(); i++) {
+		mbus_handle *handle = bus_get(i)->handle;
 
-	mbus_debug(handle, debug);
-	while (running) {
-		if (readcmd(fp, handle)) {
-			if (!interactive && feof(fp))
-				break;
+		if (rate && set_baudrate(handle, rate))
+			goto error;
+
+		if (!parity && !bus_get(i)->tcp) {
+			bus_get(i)->parity = 0;
+			mbus_serial_set_parity(handle, 0);
 		}
+
+		mbus_hooks(handle);
+	}
+
+	if (regfile && !access(regfile, F_OK))
+		load_registry(NULL, NULL);
+
+	if (statsfile)
+		sched_timer(STATS_INTERVAL, save_stats);
+	if (sched_start(poll_devices)) {
+		warn("failed starting scheduler");
+		goto error;
 	}
 
+	if (file && batch_load(file)) {
+		rc = 1;
+		goto error;
+	}
+	if (!file && loop_add(input.fd, source_read, &input)) {
+		warn("failed reading commands");
+		goto error;
+	}
+	if (ctrl_path && ctrl_open(ctrl_path)) {
+		warn("failed opening control socket %s", ctrl_path);
+		goto error;
+	}
+	prompt();
+	if (batch.active)
+		batch_run();
+	loop_run(wakeup, 1000);
+	rc |= exit_rc;
+
+	/* skip what is left in the bus queues */
+	for (int i = 0; i < bus_count(); i++)
+		bus_abort(bus_get(i));
+
+	sched_stop();
+	if (statsfile)
+		save_stats();
+
+	if (regfile)
+		save_registry(NULL, NULL);
 error:
-	if (file)
-		fclose(fp);
-	mbus_disconnect(handle);
-	mbus_context_free(handle);
+	ctrl_close();
+	for (int i = bus_count() - 1; i >= 0; i--)
+		bus_close(bus_get(i));
+	batch_free();
+	while (input.next)
+		source_free(input.next);
+	decode_stop();
+	metrics_close();
+	archive_close();
+	bus_default_out(NULL);
+	sink_close();
+	delta_free();
+	cache_free();
+	loop_exit();
 
-	return 0;
+	return rc;
 }
@@ -0,0 +1,355 @@
+/* Shared declarations for the M-Bus master
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef MBUS_MASTER_H_
+#define MBUS_MASTER_H_
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <mbus/mbus.h>
+
+#define dbg(...) if (debug) warnx(__VA_ARGS__)
+#define log(...)            warnx(__VA_ARGS__)
+
+/* From The Practice of Programming, by Kernighan and Pike */
+#ifndef NELEMS
+#define NELEMS(array) (sizeof(array) / sizeof(array[0]))
+#endif
+
+#define BUS_MAX 16
+
+#define TCP_LATENCY 200			/* ms, network margin on TCP buses */
+
+/* bus_submit() flags, the low bits are the priority */
+#define JOB_PRIO_MASK 0x03
+#define JOB_LOW       0		/* scheduled polls */
+#define JOB_NORMAL    1
+#define JOB_HIGH      2
+#define JOB_MERGE     0x10	/* may share an identical queued job */
+#define JOB_WAITERS   8		/* of a merged job */
+
+typedef int (*bus_cmd)(mbus_handle *handle, char *args);
+typedef void (*bus_done)(void *arg, int rc);
+
+struct bus {
+	int              id;
+	char            *device;
+	mbus_handle     *handle;
+	long             baudrate;
+	long             speed;		/* of port now, may differ while polling */
+	int              parity;
+	int              tcp;		/* tcp://HOST:PORT, not a serial port */
+
+	pthread_t        thread;
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+	struct job      *head, *tail;
+	struct job      *free;		/* done, for reuse */
+	int              busy;
+	int              stop;
+	int              rc;
+	struct job      *current;	/* running, for 'status' */
+	FILE            *tee;		/* output of current, if merged */
+	time_t           started;
+	char             progress[48];
+	unsigned long    seq;		/* of next job */
+	unsigned long    aborted;	/* jobs before this are skipped */
+
+	/* reused by the worker, so steady state polling does not malloc */
+	mbus_frame       request;
+	struct reg     **regs;		/* reg_list() */
+	size_t           regs_max;
+	void            *targets;	/* see mbus-master.c */
+	size_t           targets_max;
+	mbus_frame      *frames;	/* of readout, for the cache */
+	size_t           frames_max;
+
+	/* slave state, so they are only reset when needed, see init_slaves() */
+	time_t           reset;		/* 0: unknown */
+	char             selected[17];	/* secondary address, or none */
+	unsigned char    fcb[256];	/* next FCB, per primary address */
+	void            *fcbs;		/* per secondary, see mbus-master.c */
+	size_t           fcbs_num;
+	size_t           fcbs_max;
+};
+
+/* snapshot of a bus worker, for 'status' */
+struct bus_status {
+	bus_cmd cb;			/* running, NULL when idle */
+	char    args[48];
+	char    progress[48];
+	time_t  started;
+	int     queued;
+};
+
+struct reg {
+	uint64_t id;			/* binary secondary address */
+	char     secondary[17];
+	int      bus;
+	int      primary;		/* 0: not known */
+	long     baudrate;		/* last seen at, 0: not known */
+	time_t   last_seen;
+	char     manufacturer[4];
+	uint8_t  version;
+	uint8_t  medium;
+	int      gone;			/* removed by reg_del() */
+	struct reg *next;		/* removed devices */
+};
+
+/* iterator over records in a variable data response */
+struct rec_iter {
+	const unsigned char *hdr;	/* fixed header */
+	const unsigned char *data;	/* records */
+	size_t               len;
+	size_t               pos;
+	size_t               start;	/* of last record, in data */
+	int                  id;	/* of next record */
+	int                  more;	/* more records follow in next telegram */
+	int                  error;
+};
+
+/* decoded record */
+struct value {
+	int           id;
+	int           numeric;
+	double        real;
+	char          str[240];
+	char          unit[32];
+	char          quantity[48];
+	char          function[24];
+	long          storage;
+	long          tariff;
+	int           device;
+	unsigned char dif;
+	unsigned char vif;
+};
+
+#define MAX_RECORD_IDS 64
+
+/* record IDs asked for, and which have been found, over all telegrams */
+struct select {
+	int ids[MAX_RECORD_IDS];
+	int found[MAX_RECORD_IDS];
+	int num;
+};
+
+#define DECODE_SLOTS 16
+
+/* raw reply, queued from a bus worker to the decode thread */
+struct telegram {
+	struct telegram *next;
+	mbus_frame       frame;
+	int              bus;
+	int              first;		/* of a readout */
+	int              last;
+	char             label[24];	/* when polling */
+	int              has_sel;
+	struct select    sel;		/* with first */
+	FILE            *out;		/* of the command, see bus_out() */
+	int             *rc;		/* of the command, see bus_rc() */
+	int              replayed;	/* from the reading cache */
+};
+
+typedef int (*decode_cb)(struct telegram *t);
+
+/* output formats, see output.c */
+enum {
+	OUT_TEXT,
+	OUT_XML,
+	OUT_JSON,
+	OUT_CSV,
+	OUT_BIN,
+};
+
+struct profile;
+
+typedef void (*loop_cb)(int fd, void *arg);
+typedef void (*cache_cb)(void *arg, const mbus_frame *frame, size_t i, size_t num);
+
+/* output ring policy when full, see sink.c */
+enum {
+	SINK_BLOCK,
+	SINK_DROP,			/* oldest records */
+	SINK_SPILL,			/* new records to file */
+};
+
+typedef int (*probe_cb)(void *arg, const char *addr, const char *mask);
+
+extern int running;
+extern int debug;
+extern int verbose;
+
+/* mbus-master.c */
+void slaves_unknown(struct bus *bus);
+
+/* bus.c */
+struct bus *bus_open(const char *device);
+void        bus_close(struct bus *bus);
+int         bus_tcp_timeout(struct bus *bus);
+int         bus_submit(struct bus *bus, bus_cmd cb, const char *args, int flags, bus_done done, void *arg);
+int         bus_wait(struct bus *bus);
+int         bus_abort(struct bus *bus);
+int         bus_active(void);
+void        bus_progress(const char *fmt, ...);
+void        bus_status(struct bus *bus, struct bus_status *st);
+int         bus_count(void);
+struct bus *bus_get(int id);
+struct bus *bus_find(mbus_handle *handle);
+int         bus_id(mbus_handle *handle);
+struct bus *bus_self(void);
+FILE       *bus_out(void);
+int         bus_tee_outs(FILE *fp, FILE **outs, int max);
+int        *bus_rc(void);
+void        bus_set_out(FILE *fp);
+void        bus_default_out(FILE *fp);
+
+/* loop.c */
+int  loop_init(void);
+void loop_exit(void);
+int  loop_add(int fd, loop_cb cb, void *arg);
+int  loop_add_out(int fd, loop_cb cb, void *arg);
+void loop_del(int fd);
+void loop_pause(int fd, int pause);
+void loop_wake(void);
+void loop_run(void (*wake)(void), int timeout);
+
+/* record.c */
+#define REC_FIXED_NUM 3			/* counter 1, counter 2, status */
+
+int rec_init(struct rec_iter *it, mbus_frame *frame);
+int rec_next(struct rec_iter *it, mbus_data_record *rec);
+int rec_value(mbus_data_record *rec, int id, struct value *val);
+int rec_more(mbus_frame *frame);
+int rec_is_fixed(mbus_frame *frame);
+int rec_fixed(mbus_frame *frame, int id, struct value *val);
+
+/* registry.c */
+int         reg_parse_secondary(const char *secondary, uint64_t *id);
+struct reg *reg_add(int bus, const char *secondary);
+struct reg *reg_find(int bus, const char *addr);
+struct reg *reg_find_secondary(const char *secondary);
+struct reg *reg_find_primary(int bus, int address);
+int         reg_match(int bus, const char *mask, char *secondary);
+void        reg_set_primary(struct reg *r, int address);
+void        reg_seen(struct reg *r, long baudrate);
+size_t      reg_count(void);
+struct reg *reg_get(size_t i);
+int         reg_list(int bus, struct reg ***list, size_t *max, size_t *num);
+void        reg_del(struct reg *r);
+int         reg_save(const char *file);
+int         reg_load(const char *file);
+
+/* archive.c */
+int    archive_open(const char *dir);
+void   archive_telegram(mbus_frame *frame, int first, struct profile *prof);
+int    archive_export(FILE *fp, const char *sec, time_t from, time_t to, int json);
+size_t archive_meters(void);
+void   archive_close(void);
+
+/* cache.c */
+void     cache_set(unsigned sec);
+unsigned cache_ttl(void);
+size_t   cache_entries(void);
+int      cache_put(int bus, const char *addr, const mbus_frame *frames, size_t num);
+size_t   cache_replay(int bus, const char *addr, cache_cb cb, void *arg);
+void     cache_forget(int bus, const char *addr);
+void     cache_free(void);
+
+/* decode.c */
+int              decode_start(decode_cb cb);
+void             decode_stop(void);
+struct telegram *decode_slot(void);
+void             decode_put(struct telegram *t);
+void             decode_drop(struct telegram *t);
+int              decode_wait(void);
+void             decode_flush(void);
+
+/* delta.c */
+struct meter;
+
+void          delta_set(unsigned interval);
+unsigned      delta_get(void);
+struct meter *delta_begin(const unsigned char *hdr, int *key);
+int           delta_changed(struct meter *m, struct rec_iter *it, mbus_data_record *rec, int id);
+size_t        delta_meters(void);
+void          delta_free(void);
+
+/* metrics.c */
+int  metrics_open(const char *arg);
+void metrics_telegram(int bus, mbus_frame *frame, int first, struct profile *prof);
+void metrics_expire(void);
+void metrics_close(void);
+
+/* output.c */
+int         out_parse(const char *name);
+const char *out_name(int fmt);
+int         out_record(FILE *fp, int fmt, int bus, mbus_frame *frame, struct rec_iter *it,
+		       mbus_data_record *rec, int id, struct profile *prof);
+int         out_fixed(FILE *fp, int fmt, int bus, mbus_frame *frame, int id);
+void        out_forget(FILE *fp);
+
+/* profile.c */
+void            profile_set(int on);
+int             profile_get(void);
+struct profile *profile_begin(const unsigned char *hdr);
+int             profile_value(struct profile *p, struct rec_iter *it, mbus_data_record *rec, int id,
+			      struct value *val);
+void            profile_show(FILE *fp);
+
+/* sink.c */
+FILE *sink_open(int fd, int policy, const char *spill);
+int   sink_parse(const char *arg, const char **spill);
+void  sink_end(FILE *fp);
+int   sink_ending(void);
+void  sink_show(FILE *fp);
+void  sink_close(void);
+
+/* sched.c */
+int  sched_start(bus_cmd cb);
+void sched_stop(void);
+int  sched_add(int bus, const char *addr, unsigned interval, unsigned jitter);
+void sched_show(FILE *fp, int bus);
+int  sched_timer(unsigned interval, void (*cb)(void));
+
+/* stats.c */
+#define STATS_BUCKETS 7
+
+void stats_send_event(unsigned char src_type, const char *buff, size_t len);
+void stats_recv_event(unsigned char src_type, const char *buff, size_t len);
+void stats_collision(int bus, int addr);
+void stats_reset(int bus);
+void stats_show(FILE *fp, int bus);
+void stats_metrics(FILE *fp);
+int  stats_save(const char *file);
+
+/* probe.c */
+int      probe_secondary_range(mbus_handle *handle, const char *mask, int fresh, probe_cb cb, void *arg);
+int      probe_cache_load(const char *file);
+int      probe_cache_save(void);
+void     probe_set_age(unsigned sec);
+unsigned probe_age(void);
+
+#endif /* MBUS_MASTER_H_ */
@@ -0,0 +1,485 @@
+/* OpenMetrics endpoint, latest values of all meter records
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * With -M [ADDR:]PORT, the latest value of every record of every meter,
+ * as decoded from polls and requests, is kept here and served over HTTP
+ * as gauges, GET /metrics, with the bus statistics from stats.c.  Values
+ * are fed by the decode thread, see metrics_telegram(), replays from the
+ * reading cache are not new readings, so a scrape never touches a bus.
+ *
+ * Clients are served by the event loop in the main thread.  A request is
+ * read as it arrives, the whole response is built in memory, under the
+ * lock, and sent non-blocking as the socket takes it.  A client is closed
+ * METRICS_TIMEOUT seconds after it connected, done or not, see
+ * metrics_expire(), so a stalled scraper never holds up the loop, and
+ * only holds its slot for a while.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "mbus-master.h"
+
+#define METRICS_TIMEOUT 5		/* seconds, to send a request and get the response */
+#define METRICS_CLIENTS 8
+#define REQUEST_MAX     1024
+
+struct metric {
+	int    valid;
+	double value;
+	char   unit[32];
+	char   quantity[48];
+	char   function[24];
+	long   storage;
+	long   tariff;
+	int    device;
+};
+
+/* latest readout of a meter */
+struct reading {
+	char           secondary[17];
+	int            bus;
+	int            address;
+	time_t         when;
+	struct metric *recs;		/* by record ID */
+	size_t         num;
+};
+
+struct client {
+	int    fd;
+	time_t deadline;
+	char   buf[REQUEST_MAX + 1];
+	size_t len;
+	char  *out;			/* response, being sent */
+	size_t out_len;
+	size_t out_pos;
+};
+
+static struct reading *readings;
+static size_t          readings_num;
+static size_t          readings_max;
+
+static struct client   clients[METRICS_CLIENTS];
+static int             sd = -1;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* called locked, meters are few enough for a linear search per readout */
+static struct reading *reading_get(int bus, const char *secondary)
+{
+	struct reading *r;
+
+	for (size_t i = 0; i < readings_num; i++) {
+		if (readings[i].bus == bus && !strcmp(readings[i].secondary, secondary))
+			return &readings[i];
+	}
+
+	if (readings_num == readings_max) {
+		size_t max = readings_max ? readings_max * 2 : 64;
+
+		r = realloc(readings, max * sizeof(*r));
+		if (!r)
+			return NULL;
+		readings = r;
+		readings_max = max;
+	}
+
+	r = &readings[readings_num++];
+	memset(r, 0, sizeof(*r));
+	r->bus = bus;
+	strcpy(r->secondary, secondary);
+
+	return r;
+}
+
+/* called locked */
+static void record(struct reading *r, struct value *val)
+{
+	struct metric *m;
+
+	if (val->id < 0 || !val->numeric)
+		return;
+
+	if ((size_t)val->id >= r->num) {
+		size_t num = val->id + 1;
+
+		m = realloc(r->recs, num * sizeof(*m));
+		if (!m)
+			return;
+		memset(&m[r->num], 0, (num - r->num) * sizeof(*m));
+		r->recs = m;
+		r->num = num;
+	}
+
+	m = &r->recs[val->id];
+	m->valid   = 1;
+	m->value   = val->real;
+	m->storage = val->storage;
+	m->tariff  = val->tariff;
+	m->device  = val->device;
+	strcpy(m->unit, val->unit);
+	strcpy(m->quantity, val->quantity);
+	strcpy(m->function, val->function);
+}
+
+/*
+ * Keep the numeric records of telegram of bus, record IDs from first,
+ * decoded with the profile, if any.  Only called by the decoder.
+ */
+void metrics_telegram(int bus, mbus_frame *frame, int first, struct profile *prof)
+{
+	const unsigned char *hdr;
+	struct rec_iter it;
+	struct reading *r;
+	struct value val;
+	char sec[17];
+	int id;
+
+	if (sd == -1)
+		return;
+
+	if (!rec_init(&it, frame))
+		hdr = it.hdr;
+	else if (first == 0 && rec_is_fixed(frame))
+		hdr = frame->data;
+	else
+		return;
+
+	/* fixed data responses only have the ID */
+	snprintf(sec, sizeof(sec), "%02X%02X%02X%02X%02X%02X%02X%02X", hdr[3], hdr[2], hdr[1], hdr[0],
+		 it.hdr ? hdr[4] : 0, it.hdr ? hdr[5] : 0, it.hdr ? hdr[6] : 0, it.hdr ? hdr[7] : 0);
+
+	pthread_mutex_lock(&lock);
+	r = reading_get(bus, sec);
+	if (!r)
+		goto done;
+
+	r->address = frame->address;
+	r->when    = time(NULL);
+	if (it.hdr) {
+		mbus_data_record rec;
+
+		it.id = first;
+		while ((id = rec_next(&it, &rec)) >= 0) {
+			if (!profile_value(prof, &it, &rec, id, &val))
+				record(r, &val);
+		}
+	} else {
+		for (id = 0; id < REC_FIXED_NUM; id++) {
+			if (!rec_fixed(frame, id, &val))
+				record(r, &val);
+		}
+	}
+done:
+	pthread_mutex_unlock(&lock);
+}
+
+static void label(FILE *fp, const char *name, const char *str)
+{
+	fprintf(fp, ",%s=\"", name);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			putc('\\', fp);
+		if (*str == '\n')
+			fputs("\\n", fp);
+		else
+			putc(*str, fp);
+	}
+	putc('"', fp);
+}
+
+static void show(FILE *fp)
+{
+	fprintf(fp, "# TYPE mbus_record_value gauge\n"
+		"# HELP mbus_record_value Latest value of a meter record.\n");
+
+	pthread_mutex_lock(&lock);
+	for (size_t i = 0; i < readings_num; i++) {
+		struct reading *r = &readings[i];
+
+		for (size_t id = 0; id < r->num; id++) {
+			struct metric *m = &r->recs[id];
+
+			if (!m->valid)
+				continue;
+
+			fprintf(fp, "mbus_record_value{bus=\"%d\",secondary=\"%s\",id=\"%zu\"",
+				r->bus, r->secondary, id);
+			label(fp, "unit", m->unit);
+			label(fp, "quantity", m->quantity);
+			label(fp, "function", m->function);
+			fprintf(fp, ",storage=\"%ld\",tariff=\"%ld\",device=\"%d\"} %.15g\n",
+				m->storage, m->tariff, m->device, m->value);
+		}
+	}
+
+	fprintf(fp, "# TYPE mbus_readout_time_seconds gauge\n"
+		"# HELP mbus_readout_time_seconds When the meter was last read, UNIX time.\n");
+	for (size_t i = 0; i < readings_num; i++) {
+		struct reading *r = &readings[i];
+
+		fprintf(fp, "mbus_readout_time_seconds{bus=\"%d\",secondary=\"%s\",address=\"%d\"} %lld\n",
+			r->bus, r->secondary, r->address, (long long)r->when);
+	}
+	pthread_mutex_unlock(&lock);
+
+	stats_metrics(fp);
+	fprintf(fp, "# EOF\n");
+}
+
+static void client_close(struct client *c)
+{
+	loop_del(c->fd);
+	close(c->fd);
+	c->fd = -1;
+	free(c->out);
+	c->out = NULL;
+}
+
+/* Send what the socket takes of the response, close when all is sent */
+static void client_write(int fd, void *arg)
+{
+	struct client *c = arg;
+	ssize_t n;
+
+	n = send(fd, &c->out[c->out_pos], c->out_len - c->out_pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if (n <= 0) {
+		dbg("metrics client %d: %s", fd, strerror(errno));
+		client_close(c);
+		return;
+	}
+
+	c->out_pos += n;
+	if (c->out_pos == c->out_len)
+		client_close(c);
+}
+
+/* Queue response, sent from the event loop when the client is writable */
+static void reply(struct client *c, const char *status, const char *type, const char *body, size_t len)
+{
+	FILE *fp;
+
+	fp = open_memstream(&c->out, &c->out_len);
+	if (!fp) {
+		client_close(c);
+		return;
+	}
+	fprintf(fp, "HTTP/1.0 %s\r\nContent-Type: %s\r\n"
+		"Content-Length: %zu\r\nConnection: close\r\n\r\n", status, type, len);
+	fwrite(body, 1, len, fp);
+	if (fclose(fp)) {
+		client_close(c);
+		return;
+	}
+
+	/* from reading the request to sending the response */
+	c->out_pos = 0;
+	loop_del(c->fd);
+	if (loop_add_out(c->fd, client_write, c))
+		client_close(c);
+}
+
+static void respond(struct client *c)
+{
+	char *body = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	if (strncmp(c->buf, "GET /metrics ", 13) && strncmp(c->buf, "GET /metrics?", 13)) {
+		reply(c, "404 Not Found", "text/plain", "not found\n", 10);
+		return;
+	}
+
+	fp = open_memstream(&body, &len);
+	if (!fp) {
+		reply(c, "500 Internal Server Error", "text/plain", NULL, 0);
+		return;
+	}
+	show(fp);
+	if (fclose(fp)) {
+		reply(c, "500 Internal Server Error", "text/plain", NULL, 0);
+		free(body);
+		return;
+	}
+
+	reply(c, "200 OK", "application/openmetrics-text; version=1.0.0; charset=utf-8", body, len);
+	free(body);
+}
+
+static void client_read(int fd, void *arg)
+{
+	struct client *c = arg;
+	ssize_t n;
+
+	n = read(fd, &c->buf[c->len], REQUEST_MAX - c->len);
+	if (n == -1 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (n <= 0) {
+		client_close(c);
+		return;
+	}
+
+	c->len += n;
+	c->buf[c->len] = 0;
+	if (!strstr(c->buf, "\r\n\r\n") && !strstr(c->buf, "\n\n")) {
+		if (c->len < REQUEST_MAX)
+			return;
+		reply(c, "431 Request Header Fields Too Large", "text/plain", NULL, 0);
+	} else
+		respond(c);
+}
+
+static void accept_client(int fd, void *arg)
+{
+	struct client *c = NULL;
+	int cd;
+
+	(void)arg;
+
+	cd = accept(fd, NULL, NULL);
+	if (cd == -1)
+		return;
+	fcntl(cd, F_SETFD, FD_CLOEXEC);
+	fcntl(cd, F_SETFL, fcntl(cd, F_GETFL) | O_NONBLOCK);
+
+	for (int i = 0; i < METRICS_CLIENTS; i++) {
+		if (clients[i].fd == -1) {
+			c = &clients[i];
+			break;
+		}
+	}
+	if (!c || loop_add(cd, client_read, c)) {
+		dbg("metrics: too many clients");
+		close(cd);
+		return;
+	}
+
+	c->fd       = cd;
+	c->len      = 0;
+	c->deadline = time(NULL) + METRICS_TIMEOUT;
+}
+
+/* Close clients past their deadline, from the event loop */
+void metrics_expire(void)
+{
+	time_t now;
+
+	if (sd == -1)
+		return;
+
+	now = time(NULL);
+	for (int i = 0; i < METRICS_CLIENTS; i++) {
+		struct client *c = &clients[i];
+
+		if (c->fd == -1 || now < c->deadline)
+			continue;
+
+		dbg("metrics client %d: timed out", c->fd);
+		client_close(c);
+	}
+}
+
+/* Listen on [ADDR:]PORT, all addresses if not given, returns -1 on error */
+int metrics_open(const char *arg)
+{
+	struct addrinfo hints = {
+		.ai_family   = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags    = AI_PASSIVE,
+	};
+	struct addrinfo *res, *ai;
+	char host[strlen(arg) + 1];
+	const char *port;
+	char *p;
+	int on = 1;
+
+	strcpy(host, arg);
+	p = strrchr(host, ':');
+	if (p) {
+		*p = 0;
+		port = p + 1;
+	} else
+		port = arg;
+
+	if (getaddrinfo(p && host[0] ? host : NULL, port, &hints, &res)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sd == -1)
+			continue;
+		fcntl(sd, F_SETFD, FD_CLOEXEC);
+
+		setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (!bind(sd, ai->ai_addr, ai->ai_addrlen) && !listen(sd, METRICS_CLIENTS))
+			break;
+
+		close(sd);
+		sd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (sd == -1)
+		return -1;
+
+	for (int i = 0; i < METRICS_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	if (loop_add(sd, accept_client, NULL)) {
+		close(sd);
+		sd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void metrics_close(void)
+{
+	if (sd == -1)
+		return;
+
+	for (int i = 0; i < METRICS_CLIENTS; i++) {
+		if (clients[i].fd != -1)
+			client_close(&clients[i]);
+	}
+	loop_del(sd);
+	close(sd);
+	sd = -1;
+
+	for (size_t i = 0; i < readings_num; i++)
+		free(readings[i].recs);
+	free(readings);
+	readings = NULL;
+	readings_num = readings_max = 0;
+}
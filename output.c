@@ -0,0 +1,299 @@
+/* Compact machine readable output of records
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Records are written one at a time, as they are read from the reply,
+ * straight from the raw data or the single decoded record.  There is
+ * no intermediate document, unlike mbus_frame_data_xml().
+ *
+ * json  One object per line and record:
+ *       {"bus":0,"address":5,"secondary":"...","id":0,"time":...,
+ *        "value":...,"unit":"...","quantity":"...","function":"...",
+ *        "storage":0,"tariff":0,"device":0}
+ *       A value that is not a finite number is null.
+ *
+ * csv   One line per record, columns in the order of CSV_HEADER, which
+ *       is written before the first record to each output, e.g. each
+ *       control client, and again after 'format csv'.  A value that is
+ *       not a finite number is empty.
+ *
+ * bin   Length prefixed records, all integers little endian:
+ *       u16 length of what follows, u8 bus, u8 address, 8 byte fixed
+ *       header (i.e., the secondary address), u16 record ID, u32 time,
+ *       and the raw record: DIF, DIFE, VIF, VIFE and data.  Nothing is
+ *       decoded, that is left to the receiver.  Only for variable
+ *       data responses.
+ *
+ * Of fixed data responses, with json and csv, the two counters and the
+ * status are written as records 0-2, see rec_fixed().
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "mbus-master.h"
+
+#define CSV_HEADER "bus,address,secondary,id,time,value,unit,quantity,function,storage,tariff,device"
+#define CSV_OUTPUTS 16
+
+/* outputs given the CSV header, oldest replaced when full */
+static FILE           *csv_outs[CSV_OUTPUTS];
+static size_t          csv_next;
+static pthread_mutex_t csv_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *names[] = {
+	[OUT_TEXT] = "text",
+	[OUT_XML]  = "xml",
+	[OUT_JSON] = "json",
+	[OUT_CSV]  = "csv",
+	[OUT_BIN]  = "bin",
+};
+
+int out_parse(const char *name)
+{
+	for (size_t i = 0; i < NELEMS(names); i++) {
+		if (!strcmp(name, names[i]))
+			return (int)i;
+	}
+
+	return -1;
+}
+
+const char *out_name(int fmt)
+{
+	if (fmt < 0 || fmt >= (int)NELEMS(names))
+		return "unknown";
+
+	return names[fmt];
+}
+
+/* id, manufacturer, version, medium, as printed by libmbus */
+static void secondary(const unsigned char *hdr, char *buf, size_t len)
+{
+	snprintf(buf, len, "%02X%02X%02X%02X%02X%02X%02X%02X",
+		 hdr[3], hdr[2], hdr[1], hdr[0], hdr[4], hdr[5], hdr[6], hdr[7]);
+}
+
+static void json_str(FILE *fp, const char *key, const char *str)
+{
+	fprintf(fp, ",\"%s\":\"", key);
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			putc(c, fp);
+	}
+	putc('"', fp);
+}
+
+static void csv_str(FILE *fp, const char *str)
+{
+	putc(',', fp);
+	putc('"', fp);
+	for (; *str; str++) {
+		if (*str == '"')
+			putc('"', fp);
+		putc(*str, fp);
+	}
+	putc('"', fp);
+}
+
+static int json(FILE *fp, int bus, mbus_frame *frame, const unsigned char *hdr, struct value *val)
+{
+	char sec[17];
+
+	secondary(hdr, sec, sizeof(sec));
+	fprintf(fp, "{\"bus\":%d,\"address\":%d,\"secondary\":\"%s\",\"id\":%d,\"time\":%lld",
+		bus, frame->address, sec, val->id, (long long)time(NULL));
+	if (val->numeric && isfinite(val->real))
+		fprintf(fp, ",\"value\":%.15g", val->real);
+	else if (val->numeric)
+		fprintf(fp, ",\"value\":null");
+	else
+		json_str(fp, "value", val->str);
+	json_str(fp, "unit", val->unit);
+	json_str(fp, "quantity", val->quantity);
+	json_str(fp, "function", val->function);
+	fprintf(fp, ",\"storage\":%ld,\"tariff\":%ld,\"device\":%d}\n",
+		val->storage, val->tariff, val->device);
+
+	return 0;
+}
+
+/* Returns 1 the first time for fp, until out_forget() */
+static int csv_first(FILE *fp)
+{
+	int first = 1;
+
+	pthread_mutex_lock(&csv_lock);
+	for (size_t i = 0; i < CSV_OUTPUTS; i++) {
+		if (csv_outs[i] == fp)
+			first = 0;
+	}
+	if (first) {
+		csv_outs[csv_next] = fp;
+		csv_next = (csv_next + 1) % CSV_OUTPUTS;
+	}
+	pthread_mutex_unlock(&csv_lock);
+
+	return first;
+}
+
+/* Header to each output not given one, also behind the tee of a merged job */
+static void csv_header(FILE *fp)
+{
+	FILE *outs[JOB_WAITERS];
+	int num;
+
+	num = bus_tee_outs(fp, outs, NELEMS(outs));
+	if (!num) {
+		if (csv_first(fp))
+			fprintf(fp, "%s\n", CSV_HEADER);
+		return;
+	}
+
+	/* the tee is flushed per telegram, so this is before the record */
+	for (int i = 0; i < num; i++) {
+		if (csv_first(outs[i]))
+			fprintf(outs[i], "%s\n", CSV_HEADER);
+	}
+}
+
+/* Output fp is closed, or with NULL all, the next CSV gets a header */
+void out_forget(FILE *fp)
+{
+	pthread_mutex_lock(&csv_lock);
+	for (size_t i = 0; i < CSV_OUTPUTS; i++) {
+		if (!fp || csv_outs[i] == fp)
+			csv_outs[i] = NULL;
+	}
+	pthread_mutex_unlock(&csv_lock);
+}
+
+static int csv(FILE *fp, int bus, mbus_frame *frame, const unsigned char *hdr, struct value *val)
+{
+	char sec[17];
+
+	csv_header(fp);
+
+	secondary(hdr, sec, sizeof(sec));
+	fprintf(fp, "%d,%d,%s,%d,%lld", bus, frame->address, sec, val->id, (long long)time(NULL));
+	if (val->numeric && isfinite(val->real))
+		fprintf(fp, ",%.15g", val->real);
+	else if (val->numeric)
+		putc(',', fp);
+	else
+		csv_str(fp, val->str);
+	csv_str(fp, val->unit);
+	csv_str(fp, val->quantity);
+	csv_str(fp, val->function);
+	fprintf(fp, ",%ld,%ld,%d\n", val->storage, val->tariff, val->device);
+
+	return 0;
+}
+
+static void put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+
+static int bin(FILE *fp, int bus, mbus_frame *frame, struct rec_iter *it, int id)
+{
+	size_t len = it->pos - it->start;
+	unsigned char buf[18 + len];
+	uint32_t now = (uint32_t)time(NULL);
+
+	put16(&buf[0], sizeof(buf) - 2);
+	buf[2] = bus;
+	buf[3] = frame->address;
+	memcpy(&buf[4], it->hdr, 8);
+	put16(&buf[12], id);
+	put16(&buf[14], now & 0xffff);
+	put16(&buf[16], now >> 16);
+	memcpy(&buf[18], &it->data[it->start], len);
+
+	if (fwrite(buf, sizeof(buf), 1, fp) != 1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Write the record last returned by rec_next(), in the given format,
+ * decoded with the meter's profile, if any.  Returns -1 on error.
+ */
+int out_record(FILE *fp, int fmt, int bus, mbus_frame *frame, struct rec_iter *it,
+	       mbus_data_record *rec, int id, struct profile *prof)
+{
+	struct value val;
+
+	if (fmt == OUT_BIN)
+		return bin(fp, bus, frame, it, id);
+
+	if (profile_value(prof, it, rec, id, &val)) {
+		warnx("failed decoding record ID %d: %s", id, mbus_error_str());
+		return -1;
+	}
+
+	switch (fmt) {
+	case OUT_JSON:
+		return json(fp, bus, frame, it->hdr, &val);
+	case OUT_CSV:
+		return csv(fp, bus, frame, it->hdr, &val);
+	default:
+		break;
+	}
+
+	return -1;
+}
+
+/*
+ * Write record id of a fixed data response, see rec_fixed(), returns -1
+ * on error.  These have no secondary address, only the identification
+ * number, so manufacturer, version and medium are written as zero.
+ */
+int out_fixed(FILE *fp, int fmt, int bus, mbus_frame *frame, int id)
+{
+	unsigned char hdr[8] = { 0 };
+	struct value val;
+
+	if (rec_fixed(frame, id, &val))
+		return -1;
+	memcpy(hdr, frame->data, 4);
+
+	switch (fmt) {
+	case OUT_JSON:
+		return json(fp, bus, frame, hdr, &val);
+	case OUT_CSV:
+		return csv(fp, bus, frame, hdr, &val);
+	default:
+		break;
+	}
+
+	return -1;
+}
@@ -0,0 +1,415 @@
+/* Secondary address probe with a persistent cache of known sub-trees
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The secondary search walks the address mask one position at a time,
+ * replacing the wildcard F with each digit.  A mask that matches no one
+ * is a dead branch, a mask that matches exactly one device yields its
+ * address, and a collision means we have to descend one position more.
+ *
+ * Every probed mask is recorded in a cache, which can be saved to disk.
+ * On a re-probe empty branches younger than the max age are trusted, see
+ * probe_set_age(), while occupied ones, single or colliding, are verified
+ * with one probe each.  An empty branch that is too old is probed again,
+ * so a meter installed later under it is found.  Those reply at once,
+ * unlike empty branches which cost a full timeout each, so a re-probe
+ * of a known bus takes seconds.  An interrupted, or aborted, probe
+ * resumes from what is in the cache.  Use 'fresh' to re-prove empty
+ * branches as well.
+ *
+ * The cache is shared by all buses, so each entry is keyed on the bus
+ * and the mask, and the table is protected by a mutex.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mbus-master.h"
+
+#define MASK_LEN  16
+#define EMPTY_AGE (7 * 24 * 3600)	/* seconds, default max age of empty branches */
+
+struct node {
+	int    bus;
+	char   mask[MASK_LEN + 1];
+	char   addr[MASK_LEN + 1];	/* MBUS_PROBE_SINGLE */
+	int    state;			/* MBUS_PROBE_* */
+	time_t when;
+};
+
+static struct node *nodes;
+static size_t       nodes_max;	/* always power of two */
+static size_t       nodes_num;
+static char        *cache_file;
+static int          dirty;
+static unsigned     empty_age = EMPTY_AGE;	/* 0: forever */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* per-probe state */
+struct probe {
+	mbus_handle *handle;
+	int          bus;
+	time_t       started;
+	int          fresh;
+	unsigned     hits, misses;
+	probe_cb     cb;
+	void        *arg;
+};
+
+/* FNV-1a */
+static uint32_t hash(int bus, const char *mask)
+{
+	uint32_t h = 2166136261u;
+
+	h = (h ^ (unsigned char)bus) * 16777619u;
+	while (*mask)
+		h = (h ^ (unsigned char)*mask++) * 16777619u;
+
+	return h;
+}
+
+static struct node *node_slot(struct node *tbl, size_t max, int bus, const char *mask)
+{
+	size_t i = hash(bus, mask) & (max - 1);
+
+	while (tbl[i].mask[0] && (tbl[i].bus != bus || strcmp(tbl[i].mask, mask)))
+		i = (i + 1) & (max - 1);
+
+	return &tbl[i];
+}
+
+static struct node *node_find(int bus, const char *mask)
+{
+	struct node *n;
+
+	if (!nodes)
+		return NULL;
+
+	n = node_slot(nodes, nodes_max, bus, mask);
+	if (!n->mask[0])
+		return NULL;
+
+	return n;
+}
+
+static int node_grow(void)
+{
+	size_t max = nodes_max ? nodes_max * 2 : 1024;
+	struct node *tbl;
+
+	tbl = calloc(max, sizeof(struct node));
+	if (!tbl)
+		return -1;
+
+	for (size_t i = 0; i < nodes_max; i++) {
+		if (!nodes[i].mask[0])
+			continue;
+		*node_slot(tbl, max, nodes[i].bus, nodes[i].mask) = nodes[i];
+	}
+
+	free(nodes);
+	nodes = tbl;
+	nodes_max = max;
+
+	return 0;
+}
+
+static int node_set(int bus, const char *mask, int state, const char *addr, time_t when)
+{
+	struct node *n;
+
+	/* keep load factor below 3/4 */
+	if ((nodes_num + 1) * 4 > nodes_max * 3 && node_grow())
+		return -1;
+
+	n = node_slot(nodes, nodes_max, bus, mask);
+	if (!n->mask[0]) {
+		n->bus = bus;
+		strcpy(n->mask, mask);
+		nodes_num++;
+	}
+
+	n->state = state;
+	n->when  = when;
+	if (state == MBUS_PROBE_SINGLE)
+		strncpy(n->addr, addr, MASK_LEN);
+	else
+		n->addr[0] = 0;
+	dirty = 1;
+
+	return 0;
+}
+
+static int cached(struct probe *p, struct node *n)
+{
+	if (!n)
+		return 0;
+
+	/* probed earlier in this run, no need to ask again */
+	if (n->when >= p->started)
+		return 1;
+
+	if (p->fresh)
+		return 0;
+
+	/* dead branches are trusted for a while, occupied ones verified */
+	if (n->state != MBUS_PROBE_NOTHING)
+		return 0;
+
+	return !empty_age || p->started - n->when < (time_t)empty_age;
+}
+
+static int probe_mask(struct probe *p, char *mask, char *addr)
+{
+	struct node *n;
+	int rc, prev;
+
+	pthread_mutex_lock(&lock);
+	n = node_find(p->bus, mask);
+	if (cached(p, n)) {
+		rc = n->state;
+		if (rc == MBUS_PROBE_SINGLE)
+			strcpy(addr, n->addr);
+		pthread_mutex_unlock(&lock);
+
+		p->hits++;
+		return rc;
+	}
+	prev = n ? n->state : -2;
+	pthread_mutex_unlock(&lock);
+
+	p->misses++;
+	rc = mbus_probe_secondary_address(p->handle, mask, addr);
+	if (rc == MBUS_PROBE_ERROR)
+		return rc;
+
+	if (prev != -2 && prev != rc)
+		dbg("mask %s changed state %d -> %d", mask, prev, rc);
+
+	pthread_mutex_lock(&lock);
+	if (node_set(p->bus, mask, rc, addr, time(NULL)))
+		warnx("out of memory, cannot cache probe of %s", mask);
+	pthread_mutex_unlock(&lock);
+
+	return rc;
+}
+
+/*
+ * Positions 0-7 are the BCD coded identification number, the rest are
+ * hex coded manufacturer, version and medium.  For the latter the digit
+ * F cannot be told apart from the wildcard, so it is not probed.
+ */
+static int probe_range(struct probe *p, int pos, char *mask)
+{
+	static const char digits[] = "0123456789ABCDE";
+	char addr[MASK_LEN + 1];
+	int max;
+
+	if (pos >= MASK_LEN)
+		return 0;
+
+	if (mask[pos] != 'F' && mask[pos] != 'f')
+		return probe_range(p, pos + 1, mask);
+
+	max = pos < 8 ? 10 : 15;
+	for (int i = 0; i < max; i++) {
+		if (!bus_active())
+			return 1;
+
+		mask[pos] = digits[i];
+		bus_progress("mask %s", mask);
+		switch (probe_mask(p, mask, addr)) {
+		case MBUS_PROBE_SINGLE:
+			if (p->cb)
+				p->cb(p->arg, addr, mask);
+			break;
+
+		case MBUS_PROBE_COLLISION:
+			if (pos == MASK_LEN - 1) {
+				warnx("unresolvable collision at address mask %s", mask);
+				break;
+			}
+			if (probe_range(p, pos + 1, mask))
+				return 1;
+			break;
+
+		case MBUS_PROBE_NOTHING:
+			break;
+
+		default:
+			mask[pos] = 'F';
+			return -1;
+		}
+	}
+	mask[pos] = 'F';
+
+	return 0;
+}
+
+/*
+ * Probe for all devices matching mask, calling cb for all found.
+ * Returns 0 when done, 1 if interrupted and -1 on error.
+ */
+int probe_secondary_range(mbus_handle *handle, const char *mask, int fresh, probe_cb cb, void *arg)
+{
+	struct probe p = {
+		.handle  = handle,
+		.bus     = bus_id(handle),
+		.started = time(NULL),
+		.fresh   = fresh,
+		.cb      = cb,
+		.arg     = arg,
+	};
+	char buf[MASK_LEN + 1];
+	int rc;
+
+	for (int i = 0; i < MASK_LEN; i++)
+		buf[i] = toupper((unsigned char)mask[i]);
+	buf[MASK_LEN] = 0;
+
+	rc = probe_range(&p, 0, buf);
+	log("probe %s: %u bus probes, %u from cache.",
+	    rc > 0 ? "interrupted" : "done", p.misses, p.hits);
+
+	if (probe_cache_save())
+		warn("failed saving probe cache %s", cache_file);
+
+	return rc;
+}
+
+/* Max age in seconds of empty branches in the cache, 0: trust forever */
+void probe_set_age(unsigned sec)
+{
+	pthread_mutex_lock(&lock);
+	empty_age = sec;
+	pthread_mutex_unlock(&lock);
+}
+
+unsigned probe_age(void)
+{
+	unsigned sec;
+
+	pthread_mutex_lock(&lock);
+	sec = empty_age;
+	pthread_mutex_unlock(&lock);
+
+	return sec;
+}
+
+int probe_cache_load(const char *file)
+{
+	char line[80];
+	FILE *fp;
+
+	free(cache_file);
+	cache_file = strdup(file);
+	if (!cache_file)
+		return -1;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		return errno == ENOENT ? 0 : -1;
+
+	pthread_mutex_lock(&lock);
+	while (fgets(line, sizeof(line), fp)) {
+		char mask[MASK_LEN + 1], addr[MASK_LEN + 1] = { 0 };
+		long long when;
+		char state;
+		int bus, rc;
+
+		if (line[0] == '#')
+			continue;
+
+		if (sscanf(line, "%d %16s %c %lld %16s", &bus, mask, &state, &when, addr) < 4)
+			continue;
+
+		switch (state) {
+		case 'E': rc = MBUS_PROBE_NOTHING;   break;
+		case 'S': rc = MBUS_PROBE_SINGLE;    break;
+		case 'C': rc = MBUS_PROBE_COLLISION; break;
+		default:
+			continue;
+		}
+
+		if (node_set(bus, mask, rc, addr, (time_t)when))
+			break;
+	}
+	dirty = 0;
+	pthread_mutex_unlock(&lock);
+	fclose(fp);
+
+	dbg("loaded %zu probe cache entries from %s", nodes_num, file);
+
+	return 0;
+}
+
+/* Write to a temporary file first, an interrupted save keeps the old */
+int probe_cache_save(void)
+{
+	char tmp[strlen(cache_file ?: "") + 5];
+	int rc = 0;
+	FILE *fp;
+
+	pthread_mutex_lock(&lock);
+	if (!cache_file || !dirty)
+		goto done;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache_file);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		rc = -1;
+		goto done;
+	}
+
+	fprintf(fp, "# mbus-master probe cache: BUS MASK E|S|C TIME [ADDR]\n");
+	for (size_t i = 0; i < nodes_max; i++) {
+		struct node *n = &nodes[i];
+		char state;
+
+		if (!n->mask[0])
+			continue;
+
+		switch (n->state) {
+		case MBUS_PROBE_SINGLE:    state = 'S'; break;
+		case MBUS_PROBE_COLLISION: state = 'C'; break;
+		default:                   state = 'E'; break;
+		}
+
+		fprintf(fp, "%d %s %c %lld %s\n", n->bus, n->mask, state, (long long)n->when, n->addr);
+	}
+
+	if (fclose(fp) || rename(tmp, cache_file)) {
+		remove(tmp);
+		rc = -1;
+	} else
+		dirty = 0;
+done:
+	pthread_mutex_unlock(&lock);
+
+	return rc;
+}
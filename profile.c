@@ -0,0 +1,288 @@
+/* Record decoding profiles, per meter model
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Most meters on a bus are a few models, each with a fixed record layout.
+ * For each model, keyed by manufacturer, version and medium of the fixed
+ * header, we keep a profile: for each record ID the raw DIF/DIFE/VIF/VIFE
+ * bytes, the data coding and scale, and the decoded unit, quantity, etc.
+ * A record whose header bytes match its field is decoded straight from
+ * the data bytes, skipping the table driven VIF interpretation, string
+ * formatting and allocation of mbus_parse_variable_record().
+ *
+ * Fields are learned from the first generic decode of each record ID, and
+ * kept only if the learned scale reproduces the generic value.  Strings,
+ * dates, LVAR, manufacturer specific data and anything else not plain
+ * integer or BCD always take the generic path.  So does any record that
+ * does not match its field, e.g., a firmware with another layout, which
+ * is then relearned.
+ *
+ * Only the decode thread changes profiles.  They are allocated as models
+ * are seen, some 28 kB each, and never moved or freed.  The 'profile'
+ * command runs on another thread, so counters, field states and the
+ * number of profiles are written and read with atomic builtins, like the
+ * archive index, and a profile is counted only once it is set up.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbus-master.h"
+
+#define PROFILE_MAX    32
+#define PROFILE_FIELDS 64
+#define FIELD_HDR      16		/* DIF, DIFE, VIF, VIFE */
+
+enum {
+	FIELD_NEW,			/* learn on next generic decode */
+	FIELD_FAST,
+	FIELD_GENERIC,			/* cannot be specialised */
+};
+
+struct field {
+	int           state;
+	unsigned char hdr[FIELD_HDR];
+	size_t        hdr_len;
+	unsigned char coding;		/* DIF data field */
+	size_t        len;
+	double        scale;
+	struct value  val;		/* all but id and value */
+};
+
+struct profile {
+	unsigned char key[4];		/* manufacturer, version, medium */
+	unsigned long hits, misses;
+	struct field  fields[PROFILE_FIELDS];
+};
+
+static struct profile *profiles[PROFILE_MAX];
+static size_t          profiles_num;
+
+static volatile int enabled = 1;
+static unsigned long nomatch;		/* records of meters without profile */
+
+/* only the decode thread writes, relaxed is enough for profile_show() */
+static void bump(unsigned long *cnt)
+{
+	__atomic_store_n(cnt, __atomic_load_n(cnt, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+static void set_state(struct field *f, int state)
+{
+	__atomic_store_n(&f->state, state, __ATOMIC_RELAXED);
+}
+
+void profile_set(int on)
+{
+	enabled = on;
+}
+
+int profile_get(void)
+{
+	return enabled;
+}
+
+/*
+ * Start of readout from meter with fixed header hdr.  Returns its model's
+ * profile, which is created if needed, or NULL if off, or the table is full.
+ */
+struct profile *profile_begin(const unsigned char *hdr)
+{
+	const unsigned char *key = &hdr[4];
+	struct profile *p;
+
+	if (!enabled)
+		return NULL;
+
+	for (size_t i = 0; i < profiles_num; i++) {
+		if (!memcmp(profiles[i]->key, key, sizeof(profiles[i]->key)))
+			return profiles[i];
+	}
+
+	if (profiles_num >= PROFILE_MAX)
+		return NULL;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+	memcpy(p->key, key, sizeof(p->key));
+	profiles[profiles_num] = p;
+	__atomic_store_n(&profiles_num, profiles_num + 1, __ATOMIC_RELEASE);
+
+	dbg("new decode profile %s version %u medium %02X",
+	    mbus_decode_manufacturer(key[0], key[1]), key[2], key[3]);
+
+	return p;
+}
+
+static int raw(unsigned char coding, unsigned char *data, size_t len, long long *v)
+{
+	int i;
+
+	switch (coding) {
+	case 0x01:
+	case 0x02:
+	case 0x03:
+	case 0x04:
+		if (mbus_data_int_decode(data, len, &i))
+			return -1;
+		*v = i;
+		return 0;
+
+	case 0x06:
+	case 0x07:
+		return mbus_data_long_long_decode(data, len, v);
+
+	case 0x09:
+	case 0x0A:
+	case 0x0B:
+	case 0x0C:
+	case 0x0E:
+		*v = mbus_data_bcd_decode(data, len);
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Power of ten which turns raw into real, as the generic decode did */
+static int scale(long long v, double real, double *factor)
+{
+	static const double pow10[] = {
+		1e-9, 1e-8, 1e-7, 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1,
+		1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+	};
+
+	if (v == 0)
+		return 1;		/* try again with next readout */
+
+	for (size_t i = 0; i < NELEMS(pow10); i++) {
+		double d = v * pow10[i] - real;
+
+		if (d * d <= 1e-18 * real * real) {
+			*factor = pow10[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static void learn(struct field *f, struct rec_iter *it, mbus_data_record *rec, struct value *val)
+{
+	size_t hdr_len = it->pos - it->start - rec->data_len;
+	unsigned char coding = rec->drh.dib.dif & MBUS_DATA_RECORD_DIF_MASK_DATA;
+	long long v;
+	int rc;
+
+	set_state(f, FIELD_GENERIC);
+	if (hdr_len > sizeof(f->hdr)) {
+		f->hdr_len = 0;
+		return;
+	}
+	memcpy(f->hdr, &it->data[it->start], hdr_len);
+	f->hdr_len = hdr_len;
+
+	if (!val->numeric || raw(coding, rec->data, rec->data_len, &v))
+		return;
+
+	rc = scale(v, val->real, &f->scale);
+	if (rc) {
+		if (rc > 0)
+			set_state(f, FIELD_NEW);
+		return;
+	}
+
+	f->coding = coding;
+	f->len    = rec->data_len;
+	f->val    = *val;
+	set_state(f, FIELD_FAST);
+}
+
+static int same(struct field *f, struct rec_iter *it, mbus_data_record *rec)
+{
+	return f->hdr_len == it->pos - it->start - rec->data_len &&
+		!memcmp(f->hdr, &it->data[it->start], f->hdr_len);
+}
+
+/*
+ * Decode record last returned by rec_next(), like rec_value(), using the
+ * profile p when possible.  Returns -1 on error.
+ */
+int profile_value(struct profile *p, struct rec_iter *it, mbus_data_record *rec, int id,
+		  struct value *val)
+{
+	struct field *f;
+	long long v;
+
+	if (!p || id < 0 || id >= PROFILE_FIELDS) {
+		bump(&nomatch);
+		return rec_value(rec, id, val);
+	}
+
+	f = &p->fields[id];
+	if (f->state == FIELD_FAST && f->len == rec->data_len && same(f, it, rec) &&
+	    !raw(f->coding, rec->data, rec->data_len, &v)) {
+		*val      = f->val;
+		val->id   = id;
+		val->real = v * f->scale;
+		bump(&p->hits);
+		return 0;
+	}
+
+	bump(&p->misses);
+	if (rec_value(rec, id, val))
+		return -1;
+
+	/* new field, or layout changed, relearn */
+	if (f->state != FIELD_GENERIC || !same(f, it, rec))
+		learn(f, it, rec, val);
+
+	return 0;
+}
+
+void profile_show(FILE *fp)
+{
+	size_t num_profiles = __atomic_load_n(&profiles_num, __ATOMIC_ACQUIRE);
+	unsigned long hits = 0, total = __atomic_load_n(&nomatch, __ATOMIC_RELAXED);
+
+	for (size_t i = 0; i < num_profiles; i++) {
+		struct profile *p = profiles[i];
+		unsigned long ok  = __atomic_load_n(&p->hits, __ATOMIC_RELAXED);
+		unsigned long num = ok + __atomic_load_n(&p->misses, __ATOMIC_RELAXED);
+		int fast = 0;
+
+		for (int j = 0; j < PROFILE_FIELDS; j++)
+			fast += __atomic_load_n(&p->fields[j].state, __ATOMIC_RELAXED) == FIELD_FAST;
+
+		fprintf(fp, "%s  version %3u  medium %02X  %2d fields  %lu/%lu records fast (%.1f%%)\n",
+			mbus_decode_manufacturer(p->key[0], p->key[1]), p->key[2], p->key[3],
+			fast, ok, num, num ? 100.0 * ok / num : 0.0);
+		hits  += ok;
+		total += num;
+	}
+
+	fprintf(fp, "decode profiles %s, %zu models, %lu/%lu records fast (%.1f%%)\n",
+		enabled ? "enabled" : "disabled", num_profiles, hits, total,
+		total ? 100.0 * hits / total : 0.0);
+}
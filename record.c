@@ -0,0 +1,287 @@
+/* Record access straight from the raw reply
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Walks the DIF/VIF chain of a variable data response in place, instead
+ * of building the linked list of mbus_frame_data_parse().  Records are
+ * numbered the same way as in mbus_data_variable_parse(), i.e., idle
+ * fillers are skipped and manufacturer specific data is one record, so
+ * record IDs are the same as in the XML output.
+ *
+ * Fixed data responses have no records, but the same three values as in
+ * the XML output of mbus_data_fixed_xml() are given record IDs: counter 1,
+ * counter 2 and the status byte, see rec_fixed().
+ */
+
+#include <string.h>
+
+#include "mbus-master.h"
+
+/* Set up iterator for frame, returns -1 if not a variable data response */
+int rec_init(struct rec_iter *it, mbus_frame *frame)
+{
+	memset(it, 0, sizeof(*it));
+
+	switch (frame->control_information) {
+	case MBUS_CONTROL_INFO_RESP_VARIABLE:
+	case MBUS_CONTROL_INFO_RESP_VARIABLE_MSB:
+		break;
+	default:
+		return -1;
+	}
+
+	if (frame->data_size < MBUS_DATA_VARIABLE_HEADER_LENGTH)
+		return -1;
+
+	it->hdr  = frame->data;
+	it->data = frame->data + MBUS_DATA_VARIABLE_HEADER_LENGTH;
+	it->len  = frame->data_size - MBUS_DATA_VARIABLE_HEADER_LENGTH;
+
+	return 0;
+}
+
+/*
+ * Next record, filled in to rec if non-NULL, otherwise just skipped.
+ * Returns record ID, or -1 at end of data, or on error when it->error
+ * is set.
+ */
+int rec_next(struct rec_iter *it, mbus_data_record *rec)
+{
+	const unsigned char *data = it->data;
+	size_t i = it->pos, len;
+	unsigned char dif, vif;
+	size_t ndife = 0, nvife = 0;
+	size_t vif_pos = 0, vif_len = 0;
+	size_t dife_pos, vife_pos = 0;
+
+	while (i < it->len && data[i] == MBUS_DIB_DIF_IDLE_FILLER)
+		i++;
+	if (i >= it->len)
+		return -1;
+
+	it->start = i;
+	dif = data[i++];
+	if (dif == MBUS_DIB_DIF_MANUFACTURER_SPECIFIC || dif == MBUS_DIB_DIF_MORE_RECORDS_FOLLOW) {
+		if (dif == MBUS_DIB_DIF_MORE_RECORDS_FOLLOW)
+			it->more = 1;
+
+		len = it->len - i;
+		if (len > sizeof(rec->data))
+			len = sizeof(rec->data);
+		if (rec) {
+			memset(&rec->drh, 0, sizeof(rec->drh));
+			rec->drh.dib.dif = dif;
+			memcpy(rec->data, &data[i], len);
+			rec->data_len = len;
+			rec->timestamp = time(NULL);
+		}
+		it->pos = it->len;
+
+		return it->id++;
+	}
+
+	len = mbus_dif_datalength_lookup(dif);
+
+	dife_pos = i;
+	if (dif & MBUS_DIB_DIF_EXTENSION_BIT) {
+		do {
+			if (i >= it->len || ndife >= NELEMS(rec->drh.dib.dife))
+				goto error;
+			ndife++;
+		} while (data[i++] & MBUS_DIB_DIF_EXTENSION_BIT);
+	}
+
+	if (i >= it->len)
+		goto error;
+	vif = data[i++];
+	if ((vif & MBUS_DIB_VIF_WITHOUT_EXTENSION) == 0x7C) {
+		if (i >= it->len)
+			goto error;
+		vif_len = data[i++];
+		if (vif_len > MBUS_VALUE_INFO_BLOCK_CUSTOM_VIF_SIZE || i + vif_len > it->len)
+			goto error;
+		vif_pos = i;
+		i += vif_len;
+	}
+
+	if (vif & MBUS_DIB_VIF_EXTENSION_BIT) {
+		vife_pos = i;
+		do {
+			if (i >= it->len || nvife >= NELEMS(rec->drh.vib.vife))
+				goto error;
+			nvife++;
+		} while (data[i++] & MBUS_DIB_VIF_EXTENSION_BIT);
+	}
+
+	/* variable length data, LVAR */
+	if ((dif & MBUS_DATA_RECORD_DIF_MASK_DATA) == 0x0D) {
+		unsigned char lvar;
+
+		if (i >= it->len)
+			goto error;
+
+		lvar = data[i++];
+		if (lvar <= 0xBF)
+			len = lvar;
+		else if (lvar <= 0xCF)
+			len = (lvar - 0xC0) * 2;
+		else if (lvar <= 0xDF)
+			len = (lvar - 0xD0) * 2;
+		else if (lvar <= 0xEF)
+			len = lvar - 0xE0;
+		else if (lvar <= 0xFA)
+			len = lvar - 0xF0;
+		else
+			goto error;	/* reserved */
+	}
+
+	if (i + len > it->len)
+		goto error;
+
+	if (rec) {
+		memset(&rec->drh, 0, sizeof(rec->drh));
+		rec->drh.dib.dif   = dif;
+		rec->drh.dib.ndife = ndife;
+		memcpy(rec->drh.dib.dife, &data[dife_pos], ndife);
+		rec->drh.vib.vif   = vif;
+		rec->drh.vib.nvife = nvife;
+		memcpy(rec->drh.vib.vife, &data[vife_pos], nvife);
+		if (vif_len)
+			mbus_data_str_decode(rec->drh.vib.custom_vif, &data[vif_pos], vif_len);
+		memcpy(rec->data, &data[i], len);
+		rec->data_len  = len;
+		rec->timestamp = time(NULL);
+	}
+	it->pos = i + len;
+
+	return it->id++;
+error:
+	it->error = 1;
+	return -1;
+}
+
+/* More records follow in next telegram, without decoding any */
+int rec_more(mbus_frame *frame)
+{
+	struct rec_iter it;
+
+	if (rec_init(&it, frame))
+		return 0;
+
+	while (rec_next(&it, NULL) >= 0)
+		;
+
+	return it.more;
+}
+
+/* Decode record value, unit, etc., returns -1 on error */
+int rec_value(mbus_data_record *rec, int id, struct value *val)
+{
+	mbus_record *r;
+
+	r = mbus_parse_variable_record(rec);
+	if (!r)
+		return -1;
+
+	memset(val, 0, sizeof(*val));
+	val->id      = id;
+	val->numeric = r->is_numeric;
+	if (r->is_numeric)
+		val->real = r->value.real_val;
+	else
+		snprintf(val->str, sizeof(val->str), "%s", r->value.str_val.value ?: "");
+	snprintf(val->unit, sizeof(val->unit), "%s", r->unit ?: "");
+	snprintf(val->quantity, sizeof(val->quantity), "%s", r->quantity ?: "");
+	snprintf(val->function, sizeof(val->function), "%s", r->function_medium ?: "");
+	val->storage = r->storage_number;
+	val->tariff  = r->tariff;
+	val->device  = r->device;
+	val->dif     = rec->drh.dib.dif;
+	val->vif     = rec->drh.vib.vif;
+	mbus_record_free(r);
+
+	return 0;
+}
+
+/* Returns 1 if frame is a fixed data response */
+int rec_is_fixed(mbus_frame *frame)
+{
+	switch (frame->control_information) {
+	case MBUS_CONTROL_INFO_RESP_FIXED:
+	case MBUS_CONTROL_INFO_RESP_FIXED_MSB:
+		break;
+	default:
+		return 0;
+	}
+
+	return frame->data_size >= MBUS_DATA_FIXED_LENGTH;
+}
+
+/*
+ * Decode record id of a fixed data response, straight from the raw data,
+ * returns -1 if not a fixed data response, or no such record.
+ */
+int rec_fixed(mbus_frame *frame, int id, struct value *val)
+{
+	const unsigned char *data = frame->data;
+	mbus_data_fixed fix;
+
+	if (!rec_is_fixed(frame) || id < 0 || id >= REC_FIXED_NUM)
+		return -1;
+
+	memcpy(fix.id_bcd, &data[0], sizeof(fix.id_bcd));
+	fix.tx_cnt    = data[4];
+	fix.status    = data[5];
+	fix.cnt1_type = data[6];
+	fix.cnt2_type = data[7];
+	memcpy(fix.cnt1_val, &data[8], sizeof(fix.cnt1_val));
+	memcpy(fix.cnt2_val, &data[12], sizeof(fix.cnt2_val));
+
+	memset(val, 0, sizeof(*val));
+	val->id      = id;
+	val->numeric = 1;
+	if (id == 2) {
+		val->real = fix.status;
+		snprintf(val->quantity, sizeof(val->quantity), "Status");
+		return 0;
+	}
+
+	if ((fix.status & MBUS_DATA_FIXED_STATUS_FORMAT_MASK) == MBUS_DATA_FIXED_STATUS_FORMAT_INT) {
+		int v;
+
+		mbus_data_int_decode(id ? fix.cnt2_val : fix.cnt1_val, 4, &v);
+		val->real = v;
+	} else
+		val->real = mbus_data_bcd_decode(id ? fix.cnt2_val : fix.cnt1_val, 4);
+
+	snprintf(val->unit, sizeof(val->unit), "%s",
+		 mbus_data_fixed_unit(id ? fix.cnt2_type : fix.cnt1_type) ?: "");
+	snprintf(val->quantity, sizeof(val->quantity), "%s", mbus_data_fixed_medium(&fix) ?: "");
+	if ((fix.status & MBUS_DATA_FIXED_STATUS_DATE_MASK) == MBUS_DATA_FIXED_STATUS_DATE_STORED) {
+		snprintf(val->function, sizeof(val->function), "Stored value");
+		val->storage = 1;
+	} else
+		snprintf(val->function, sizeof(val->function), "Actual value");
+
+	return 0;
+}
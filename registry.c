@@ -0,0 +1,549 @@
+/* Registry of known devices, indexed by secondary and primary address
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Devices are kept in an array, in order of discovery, and looked up by
+ * the binary form of their secondary address in an open addressing hash
+ * table of indexes into that array.  Both grow as needed.  There is also
+ * a direct index by primary address, per bus.  Secondary addresses are
+ * unique across all buses.  Bus workers share the registry, so all of it
+ * is protected by a mutex.  Entries are never freed, other workers may
+ * still hold a device that reg_del() removes.  Removed devices are kept
+ * aside and reused if the same device is added again.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbus-master.h"
+
+static struct reg **regs;	/* in order of discovery */
+static size_t       regs_num;
+static size_t       regs_max;
+
+static size_t      *hashtbl;	/* regs[] index + 1, 0 is a free slot */
+static size_t       hashtbl_max;	/* always power of two */
+
+static struct reg  *primary[BUS_MAX][256];
+static struct reg  *removed;	/* by reg_del() */
+
+static pthread_mutex_t reg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+
+	return -1;
+}
+
+/* 16 char hex secondary address to its 8 byte binary form */
+int reg_parse_secondary(const char *secondary, uint64_t *id)
+{
+	uint64_t val = 0;
+
+	for (int i = 0; i < 16; i++) {
+		int v = hexval(secondary[i]);
+
+		if (v < 0)
+			return -1;
+		val = (val << 4) | v;
+	}
+	if (secondary[16])
+		return -1;
+
+	*id = val;
+
+	return 0;
+}
+
+/* murmur3 finalizer, the low bits of an ID are the medium, not random */
+static size_t hash(uint64_t id)
+{
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+	id *= 0xc4ceb9fe1a85ec53ULL;
+	id ^= id >> 33;
+
+	return (size_t)id;
+}
+
+static size_t *slot(size_t *tbl, size_t max, uint64_t id)
+{
+	size_t i = hash(id) & (max - 1);
+
+	while (tbl[i] && regs[tbl[i] - 1]->id != id)
+		i = (i + 1) & (max - 1);
+
+	return &tbl[i];
+}
+
+static int reindex(size_t max)
+{
+	size_t *tbl;
+
+	tbl = calloc(max, sizeof(size_t));
+	if (!tbl)
+		return -1;
+
+	for (size_t i = 0; i < regs_num; i++)
+		*slot(tbl, max, regs[i]->id) = i + 1;
+
+	free(hashtbl);
+	hashtbl = tbl;
+	hashtbl_max = max;
+
+	return 0;
+}
+
+/* rebuild at same size, cannot fail */
+static void rehash(void)
+{
+	memset(hashtbl, 0, hashtbl_max * sizeof(size_t));
+	for (size_t i = 0; i < regs_num; i++)
+		*slot(hashtbl, hashtbl_max, regs[i]->id) = i + 1;
+}
+
+static struct reg *lookup(uint64_t id)
+{
+	size_t *s;
+
+	if (!hashtbl)
+		return NULL;
+
+	s = slot(hashtbl, hashtbl_max, id);
+	if (!*s)
+		return NULL;
+
+	return regs[*s - 1];
+}
+
+struct reg *reg_find_secondary(const char *secondary)
+{
+	struct reg *r;
+	uint64_t id;
+
+	if (reg_parse_secondary(secondary, &id))
+		return NULL;
+
+	pthread_mutex_lock(&reg_lock);
+	r = lookup(id);
+	pthread_mutex_unlock(&reg_lock);
+
+	return r;
+}
+
+struct reg *reg_find_primary(int bus, int address)
+{
+	struct reg *r;
+
+	if (bus < 0 || bus >= BUS_MAX || address < 0 || address >= (int)NELEMS(primary[0]))
+		return NULL;
+
+	pthread_mutex_lock(&reg_lock);
+	r = primary[bus][address];
+	pthread_mutex_unlock(&reg_lock);
+
+	return r;
+}
+
+/* Find device by primary or secondary address string */
+struct reg *reg_find(int bus, const char *addr)
+{
+	if (mbus_is_secondary_address(addr))
+		return reg_find_secondary(addr);
+
+	return reg_find_primary(bus, atoi(addr));
+}
+
+/*
+ * Match secondary address mask, where F is a wildcard, against devices
+ * on bus.  Returns number of matches, the address of the first is copied
+ * to secondary, which must have room for 17 chars.
+ */
+int reg_match(int bus, const char *mask, char *secondary)
+{
+	uint64_t val = 0, care = 0;
+	int num = 0;
+
+	for (int i = 0; i < 16; i++) {
+		int v = hexval(mask[i]);
+
+		if (v < 0)
+			return 0;
+		val  <<= 4;
+		care <<= 4;
+		if (v != 0xF) {
+			val  |= v;
+			care |= 0xF;
+		}
+	}
+
+	pthread_mutex_lock(&reg_lock);
+	if (care == ~0ULL) {
+		struct reg *r = lookup(val);
+
+		if (r && r->bus == bus) {
+			strcpy(secondary, r->secondary);
+			num = 1;
+		}
+	} else {
+		for (size_t i = 0; i < regs_num; i++) {
+			if (regs[i]->bus != bus || (regs[i]->id & care) != val)
+				continue;
+			if (!num++)
+				strcpy(secondary, regs[i]->secondary);
+		}
+	}
+	pthread_mutex_unlock(&reg_lock);
+
+	return num;
+}
+
+/* Decode manufacturer, version and medium from the secondary address */
+static void decode(struct reg *r)
+{
+	unsigned int m = (r->id >> 16) & 0xffff;
+
+	/* stored little endian on the wire, as two bytes in the string */
+	m = ((m & 0xff) << 8) | (m >> 8);
+	r->manufacturer[0] = ((m >> 10) & 0x1f) + 64;
+	r->manufacturer[1] = ((m >> 5)  & 0x1f) + 64;
+	r->manufacturer[2] = (m & 0x1f) + 64;
+	r->manufacturer[3] = 0;
+
+	r->version = (r->id >> 8) & 0xff;
+	r->medium  = r->id & 0xff;
+}
+
+static void set_primary(struct reg *r, int address)
+{
+	struct reg **tbl = primary[r->bus];
+
+	if (r->gone)
+		return;
+
+	if (r->primary > 0 && tbl[r->primary] == r)
+		tbl[r->primary] = NULL;
+
+	/* address reassigned, whoever had it before no longer has it */
+	if (address > 0 && tbl[address] && tbl[address] != r)
+		tbl[address]->primary = 0;
+
+	r->primary = address;
+	if (address > 0)
+		tbl[address] = r;
+}
+
+/* unlink device removed earlier, NULL if none */
+static struct reg *revive(uint64_t id)
+{
+	for (struct reg **p = &removed; *p; p = &(*p)->next) {
+		struct reg *r = *p;
+
+		if (r->id != id)
+			continue;
+
+		*p = r->next;
+		r->next = NULL;
+		r->gone = 0;
+		r->primary  = 0;
+		r->baudrate = 0;
+
+		return r;
+	}
+
+	return NULL;
+}
+
+static struct reg *add(int bus, const char *secondary)
+{
+	struct reg *r;
+	uint64_t id;
+
+	if (bus < 0 || bus >= BUS_MAX || reg_parse_secondary(secondary, &id)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	r = lookup(id);
+	if (r) {
+		/* moved to another bus, primary address is per bus */
+		if (r->bus != bus) {
+			int address = r->primary;
+
+			set_primary(r, 0);
+			r->bus = bus;
+			set_primary(r, address);
+		}
+		return r;
+	}
+
+	if (regs_num == regs_max) {
+		size_t max = regs_max ? regs_max * 2 : 64;
+		struct reg **arr;
+
+		arr = realloc(regs, max * sizeof(struct reg *));
+		if (!arr)
+			return NULL;
+		regs = arr;
+		regs_max = max;
+	}
+
+	/* keep load factor at or below 1/2 */
+	if ((regs_num + 1) * 2 > hashtbl_max && reindex(hashtbl_max ? hashtbl_max * 2 : 128))
+		return NULL;
+
+	r = revive(id);
+	if (!r)
+		r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	r->id  = id;
+	r->bus = bus;
+	memcpy(r->secondary, secondary, 16);
+	for (int i = 0; i < 16; i++) {
+		if (r->secondary[i] >= 'a')
+			r->secondary[i] -= 'a' - 'A';
+	}
+	decode(r);
+	r->last_seen = time(NULL);
+
+	regs[regs_num++] = r;
+	*slot(hashtbl, hashtbl_max, id) = regs_num;
+
+	return r;
+}
+
+/* Add device, or return already registered one, NULL with errno set on error */
+struct reg *reg_add(int bus, const char *secondary)
+{
+	struct reg *r;
+
+	pthread_mutex_lock(&reg_lock);
+	r = add(bus, secondary);
+	pthread_mutex_unlock(&reg_lock);
+
+	return r;
+}
+
+/* Record new primary address of device, 0 to forget it */
+void reg_set_primary(struct reg *r, int address)
+{
+	if (address < 0 || address >= (int)NELEMS(primary[0]))
+		return;
+
+	pthread_mutex_lock(&reg_lock);
+	set_primary(r, address);
+	pthread_mutex_unlock(&reg_lock);
+}
+
+void reg_seen(struct reg *r, long baudrate)
+{
+	pthread_mutex_lock(&reg_lock);
+	if (!r->gone) {
+		r->last_seen = time(NULL);
+		r->baudrate  = baudrate;
+	}
+	pthread_mutex_unlock(&reg_lock);
+}
+
+size_t reg_count(void)
+{
+	size_t num;
+
+	pthread_mutex_lock(&reg_lock);
+	num = regs_num;
+	pthread_mutex_unlock(&reg_lock);
+
+	return num;
+}
+
+/* Iterate devices in order of discovery */
+struct reg *reg_get(size_t i)
+{
+	struct reg *r = NULL;
+
+	pthread_mutex_lock(&reg_lock);
+	if (i < regs_num)
+		r = regs[i];
+	pthread_mutex_unlock(&reg_lock);
+
+	return r;
+}
+
+/*
+ * Snapshot of all devices on a bus, for iterating while other buses
+ * add and remove theirs.  The snapshot is stored in *list, which is
+ * grown as needed, *max is its size.  It is meant to be reused by the
+ * caller, steady state it is never reallocated.  Returns -1 on error.
+ */
+int reg_list(int bus, struct reg ***list, size_t *max, size_t *num)
+{
+	size_t n = 0;
+
+	pthread_mutex_lock(&reg_lock);
+	if (*max < regs_num + 1) {
+		struct reg **arr;
+
+		arr = realloc(*list, (regs_num + 1) * sizeof(struct reg *));
+		if (!arr) {
+			pthread_mutex_unlock(&reg_lock);
+			return -1;
+		}
+		*list = arr;
+		*max  = regs_num + 1;
+	}
+
+	for (size_t i = 0; i < regs_num; i++) {
+		if (regs[i]->bus == bus)
+			(*list)[n++] = regs[i];
+	}
+	pthread_mutex_unlock(&reg_lock);
+
+	*num = n;
+
+	return 0;
+}
+
+/*
+ * Forget device, e.g. when it no longer responds.  It is not freed, set
+ * aside for reuse, so a worker still holding it can not crash.
+ */
+void reg_del(struct reg *r)
+{
+	size_t i;
+
+	pthread_mutex_lock(&reg_lock);
+	for (i = 0; !r->gone && i < regs_num; i++) {
+		if (regs[i] == r)
+			break;
+	}
+	if (r->gone || i == regs_num) {
+		pthread_mutex_unlock(&reg_lock);
+		return;
+	}
+
+	set_primary(r, 0);
+	memmove(&regs[i], &regs[i + 1], (regs_num - i - 1) * sizeof(struct reg *));
+	regs_num--;
+	r->gone = 1;
+	r->next = removed;
+	removed = r;
+
+	/* indexes into regs[] have moved */
+	rehash();
+	pthread_mutex_unlock(&reg_lock);
+}
+
+/*
+ * Snapshot format, one device per line:
+ *
+ *     SECONDARY PRIMARY BAUDRATE LAST_SEEN BUS
+ *
+ * Where BUS is optional, for single bus setups.
+ */
+int reg_save(const char *file)
+{
+	char tmp[strlen(file) + 5];
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	fp = fopen(tmp, "w");
+	if (!fp)
+		return -1;
+
+	fprintf(fp, "# mbus-master registry: SECONDARY PRIMARY BAUDRATE LAST_SEEN BUS\n");
+	pthread_mutex_lock(&reg_lock);
+	for (size_t i = 0; i < regs_num; i++) {
+		struct reg *r = regs[i];
+
+		fprintf(fp, "%s %d %ld %lld %d\n", r->secondary, r->primary,
+			r->baudrate, (long long)r->last_seen, r->bus);
+	}
+	pthread_mutex_unlock(&reg_lock);
+
+	if (fclose(fp) || rename(tmp, file)) {
+		remove(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Load snapshot, merging with devices already known, returns number read */
+int reg_load(const char *file)
+{
+	char line[80];
+	int num = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		char secondary[17];
+		long long last_seen;
+		struct reg *r;
+		long baudrate;
+		int address;
+		int bus = 0;
+
+		if (line[0] == '#')
+			continue;
+
+		if (sscanf(line, "%16s %d %ld %lld %d", secondary, &address, &baudrate, &last_seen, &bus) < 4)
+			continue;
+
+		/* saved with more buses than we have now */
+		if (bus < 0 || bus >= bus_count()) {
+			warnx("%s: skipping %s, no bus %d", file, secondary, bus);
+			continue;
+		}
+
+		pthread_mutex_lock(&reg_lock);
+		r = add(bus, secondary);
+		if (r) {
+			if (address >= 0 && address < (int)NELEMS(primary[0]))
+				set_primary(r, address);
+			r->baudrate  = baudrate;
+			r->last_seen = (time_t)last_seen;
+			num++;
+		}
+		pthread_mutex_unlock(&reg_lock);
+
+		if (!r)
+			warnx("%s: skipping invalid entry %s", file, secondary);
+	}
+	fclose(fp);
+
+	return num;
+}
@@ -0,0 +1,388 @@
+/* Timer wheel scheduler of periodic polls
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Each scheduled device has an interval and a jitter, in seconds.  The
+ * entries are kept in a hashed timer wheel with one slot per second, an
+ * entry further away than one turn of the wheel counts down the rounds
+ * left.  A scheduler thread advances the wheel once a second and turns
+ * all entries due in a tick into a single 'poll' job per bus, so that
+ * init_slaves() is done only once per batch.
+ *
+ * When a bus cannot keep up, a device still waiting in an earlier poll
+ * job is skipped until its next turn, so the bus queue does not grow
+ * without bounds.  Poll jobs on a bus run in order, so a device is in
+ * flight while its job is later than the last one done on that bus.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbus-master.h"
+
+#define WHEEL_SLOTS 256		/* seconds, power of two */
+
+struct entry {
+	struct entry *next;
+	int           bus;
+	char          addr[17];
+	unsigned      interval;
+	unsigned      jitter;
+	unsigned      rounds;		/* left before due */
+	time_t        due;		/* for listing only */
+	unsigned long job;		/* last polled in, see done[] */
+};
+
+static struct entry   *wheel[WHEEL_SLOTS];
+static unsigned        curr;	/* current slot */
+static size_t          num_entries;
+
+static pthread_t       thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cond;
+static int             started;
+static int             stop;
+static bus_cmd         poll_cb;
+static unsigned long   sent[BUS_MAX];	/* poll jobs per bus */
+static unsigned long   done[BUS_MAX];	/* of them done, in order */
+static unsigned long   skipped;		/* due but still in flight */
+
+#define TIMERS_MAX 4
+
+/* periodic housekeeping, run in the scheduler thread */
+static struct timer {
+	unsigned interval;
+	unsigned left;
+	void   (*cb)(void);
+} timers[TIMERS_MAX];
+
+static void insert(struct entry *e, unsigned delay)
+{
+	unsigned slot;
+
+	if (delay < 1)
+		delay = 1;
+
+	slot = (curr + delay) & (WHEEL_SLOTS - 1);
+	e->rounds = (delay - 1) / WHEEL_SLOTS;
+	e->due = time(NULL) + delay;
+	e->next = wheel[slot];
+	wheel[slot] = e;
+}
+
+static unsigned delay(struct entry *e)
+{
+	return e->interval + (e->jitter ? (unsigned)rand() % (e->jitter + 1) : 0);
+}
+
+/* Unlink entry for device, NULL if not scheduled */
+static struct entry *unlink_entry(int bus, const char *addr)
+{
+	for (size_t i = 0; i < WHEEL_SLOTS; i++) {
+		struct entry **pp;
+
+		for (pp = &wheel[i]; *pp; pp = &(*pp)->next) {
+			struct entry *e = *pp;
+
+			if (e->bus != bus || strcmp(e->addr, addr))
+				continue;
+
+			*pp = e->next;
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/* poll batches, reused, they only grow */
+static char  *batch[BUS_MAX];
+static size_t batch_max[BUS_MAX];
+
+static int append(int bus, size_t *len, const char *addr)
+{
+	size_t n = strlen(addr) + 1;
+
+	if (*len + n + 1 > batch_max[bus]) {
+		size_t max = (*len + n + 1) * 2;
+		char *p;
+
+		p = realloc(batch[bus], max);
+		if (!p)
+			return -1;
+		batch[bus] = p;
+		batch_max[bus] = max;
+	}
+
+	if (*len)
+		batch[bus][(*len)++] = ' ';
+	memcpy(&batch[bus][*len], addr, n);
+	*len += n - 1;
+
+	return 0;
+}
+
+/* called by the bus worker */
+static void poll_done(void *arg, int rc)
+{
+	(void)rc;
+
+	pthread_mutex_lock(&lock);
+	done[(intptr_t)arg]++;
+	pthread_mutex_unlock(&lock);
+}
+
+/* Advance one slot, queue a poll of everything due, one batch per bus */
+static void tick(void)
+{
+	size_t len[BUS_MAX] = { 0 };
+	struct entry *e, *due = NULL;
+
+	pthread_mutex_lock(&lock);
+	curr = (curr + 1) & (WHEEL_SLOTS - 1);
+	e = wheel[curr];
+	wheel[curr] = NULL;
+	while (e) {
+		struct entry *next = e->next;
+
+		if (e->rounds) {
+			e->rounds--;
+			e->next = wheel[curr];
+			wheel[curr] = e;
+		} else {
+			if (e->job > done[e->bus]) {
+				dbg("bus %d: %s still being polled, skipping", e->bus, e->addr);
+				skipped++;
+			} else if (append(e->bus, &len[e->bus], e->addr))
+				warnx("out of memory, skipping scheduled poll of %s", e->addr);
+			else
+				e->job = sent[e->bus] + 1;
+			e->next = due;
+			due = e;
+		}
+		e = next;
+	}
+
+	/* reschedule after collecting, an interval may be a full turn */
+	while (due) {
+		e = due->next;
+		insert(due, delay(due));
+		due = e;
+	}
+	for (int i = 0; i < BUS_MAX; i++) {
+		if (len[i])
+			sent[i]++;
+	}
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < BUS_MAX; i++) {
+		struct bus *bus;
+
+		if (!len[i])
+			continue;
+
+		dbg("bus %d: scheduled poll of %s", i, batch[i]);
+		bus = bus_get(i);
+		if (!bus || bus_submit(bus, poll_cb, batch[i], JOB_LOW, poll_done, (void *)(intptr_t)i)) {
+			if (bus)
+				warn("failed queuing scheduled poll on bus %d", i);
+			poll_done((void *)(intptr_t)i, 1);
+		}
+	}
+
+	for (int i = 0; i < TIMERS_MAX; i++) {
+		struct timer *t = &timers[i];
+
+		if (!t->cb || --t->left)
+			continue;
+
+		t->left = t->interval;
+		t->cb();
+	}
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Ticks are counted from a monotonic clock, a late wakeup catches up */
+static void *scheduler(void *arg)
+{
+	long long next = now_ms() + 1000;
+
+	(void)arg;
+
+	pthread_mutex_lock(&lock);
+	while (!stop) {
+		struct timespec ts;
+
+		ts.tv_sec  = next / 1000;
+		ts.tv_nsec = (next % 1000) * 1000000;
+		pthread_cond_timedwait(&cond, &lock, &ts);
+		if (stop)
+			break;
+
+		pthread_mutex_unlock(&lock);
+		while (now_ms() >= next) {
+			tick();
+			next += 1000;
+		}
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/* Start scheduler, due devices are polled by submitting cb to their bus */
+int sched_start(bus_cmd cb)
+{
+	pthread_condattr_t attr;
+
+	poll_cb = cb;
+	srand((unsigned)time(NULL));
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&thread, NULL, scheduler, NULL))
+		return -1;
+	started = 1;
+
+	return 0;
+}
+
+void sched_stop(void)
+{
+	if (!started)
+		return;
+
+	pthread_mutex_lock(&lock);
+	stop = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	started = 0;
+
+	for (size_t i = 0; i < WHEEL_SLOTS; i++) {
+		while (wheel[i]) {
+			struct entry *e = wheel[i];
+
+			wheel[i] = e->next;
+			free(e);
+		}
+	}
+	num_entries = 0;
+
+	for (int i = 0; i < BUS_MAX; i++) {
+		free(batch[i]);
+		batch[i] = NULL;
+		batch_max[i] = 0;
+	}
+}
+
+/*
+ * Poll device every interval seconds, plus a random 0-jitter seconds.
+ * The first poll is within the jitter, to spread out a schedule that
+ * is set up all at once.  An interval of 0 unschedules the device.
+ */
+int sched_add(int bus, const char *addr, unsigned interval, unsigned jitter)
+{
+	struct entry *e;
+
+	if (bus < 0 || bus >= BUS_MAX || strlen(addr) >= sizeof(e->addr))
+		return -1;
+
+	pthread_mutex_lock(&lock);
+	e = unlink_entry(bus, addr);
+	if (!interval) {
+		if (e) {
+			free(e);
+			num_entries--;
+		}
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+
+	if (!e) {
+		e = calloc(1, sizeof(*e));
+		if (!e) {
+			pthread_mutex_unlock(&lock);
+			return -1;
+		}
+		e->bus = bus;
+		strcpy(e->addr, addr);
+		num_entries++;
+	}
+	e->interval = interval;
+	e->jitter   = jitter;
+	insert(e, 1 + (jitter ? (unsigned)rand() % (jitter + 1) : 0));
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+/* Call cb every interval seconds, set up before sched_start() */
+int sched_timer(unsigned interval, void (*cb)(void))
+{
+	for (int i = 0; i < TIMERS_MAX; i++) {
+		struct timer *t = &timers[i];
+
+		if (t->cb)
+			continue;
+
+		t->interval = t->left = interval ?: 1;
+		t->cb = cb;
+		return 0;
+	}
+
+	return -1;
+}
+
+/* List schedule of bus, or all buses with -1 */
+void sched_show(FILE *fp, int bus)
+{
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&lock);
+	fprintf(fp, "Bus  Address           Interval  Jitter  Next (s)\n");
+	for (size_t i = 0; i < WHEEL_SLOTS; i++) {
+		for (struct entry *e = wheel[i]; e; e = e->next) {
+			if (bus != -1 && e->bus != bus)
+				continue;
+
+			fprintf(fp, "%3d  %-16s  %8u  %6u  %8lld\n", e->bus, e->addr,
+				e->interval, e->jitter, (long long)(e->due - now));
+		}
+	}
+	fprintf(fp, "%zu devices scheduled, %lu polls skipped while busy.\n", num_entries, skipped);
+	pthread_mutex_unlock(&lock);
+}
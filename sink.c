@@ -0,0 +1,416 @@
+/* Output ring between bus workers and a slow stdout, with backpressure
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * When stdout is a pipe to a slow consumer, or a file on a full disk,
+ * writing to it blocks the decode thread, and soon after the bus workers
+ * when all telegram slots are in use.  With an output ring, all default
+ * output goes through a FILE that collects a record, e.g. the output of
+ * one telegram, ended with sink_end(), and copies it whole into a ring
+ * buffer, and a writer thread drains the ring to stdout.  When the ring
+ * is full the policy decides: block until there is room, drop the oldest
+ * records, or spill new records to a file.  So a reader only ever loses
+ * whole records.  A record larger than RECORD_MAX is rejected.
+ *
+ * The FILE lock serializes all writers, so the ring has one producer
+ * at a time, and one consumer, the writer thread.  The indexes are free
+ * running and only ever grow.  To drop the oldest record the producer
+ * moves the tail with a compare-and-swap, the consumer copies a record
+ * before it moves the tail the same way, and throws the copy away if
+ * the record was dropped under its feet.  The mutex is only for sleeping
+ * when the ring is empty, or full.
+ */
+
+#define _GNU_SOURCE		/* fopencookie() */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mbus-master.h"
+
+#define RING_SIZE  (256 * 1024)	/* bytes, power of two */
+#define RECORD_MAX (64 * 1024)	/* largest record */
+#define HDR        sizeof(uint32_t)
+
+static struct {
+	unsigned char   *buf;
+	atomic_size_t    head;		/* written by producer */
+	atomic_size_t    tail;		/* consumer, or producer dropping */
+	atomic_int       sleeping;	/* consumer, on empty ring */
+	atomic_int       waiting;	/* producer, on full ring */
+	atomic_int       stop;
+
+	int              fd;
+	int              policy;
+	int              spill;		/* fd, SINK_SPILL */
+	FILE            *fp;
+	unsigned char   *rec;		/* being written, under the FILE lock */
+	size_t           rec_len;
+	int              oversize;	/* rec overflowed, reject it */
+	int              end;		/* sink_end() flushing */
+
+	pthread_t        thread;
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+
+	atomic_ulong     records, dropped, spilled, waits, rejected;
+} ring = { .fd = -1, .spill = -1 };
+
+static void copy_out(void *dst, size_t pos, size_t len)
+{
+	size_t off = pos & (RING_SIZE - 1);
+	size_t n = RING_SIZE - off < len ? RING_SIZE - off : len;
+
+	memcpy(dst, &ring.buf[off], n);
+	memcpy((unsigned char *)dst + n, ring.buf, len - n);
+}
+
+static void copy_in(size_t pos, const void *src, size_t len)
+{
+	size_t off = pos & (RING_SIZE - 1);
+	size_t n = RING_SIZE - off < len ? RING_SIZE - off : len;
+
+	memcpy(&ring.buf[off], src, n);
+	memcpy(ring.buf, (const unsigned char *)src + n, len - n);
+}
+
+static void wake(atomic_int *flag)
+{
+	if (!atomic_load(flag))
+		return;
+
+	pthread_mutex_lock(&ring.lock);
+	pthread_cond_broadcast(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+}
+
+/* Sleep until woken, or a short while, flag tells the other side */
+static void nap(atomic_int *flag, int (*done)(void))
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 100 * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&ring.lock);
+	atomic_store(flag, 1);
+	if (!done())
+		pthread_cond_timedwait(&ring.cond, &ring.lock, &ts);
+	atomic_store(flag, 0);
+	pthread_mutex_unlock(&ring.lock);
+}
+
+static int has_data(void)
+{
+	return atomic_load(&ring.head) != atomic_load(&ring.tail) || atomic_load(&ring.stop);
+}
+
+static size_t room;		/* needed by the waiting producer */
+
+static int has_room(void)
+{
+	return RING_SIZE - (atomic_load(&ring.head) - atomic_load(&ring.tail)) >= room;
+}
+
+/* Drop oldest record, returns 0 if it was gone already */
+static int drop_oldest(void)
+{
+	size_t tail = atomic_load(&ring.tail);
+	uint32_t len;
+
+	if (tail == atomic_load(&ring.head))
+		return 0;
+
+	copy_out(&len, tail, HDR);
+	if (!atomic_compare_exchange_strong(&ring.tail, &tail, tail + HDR + len))
+		return 0;
+	atomic_fetch_add(&ring.dropped, 1);
+
+	return 1;
+}
+
+static void push(const char *data, size_t len)
+{
+	size_t need = HDR + len;
+	uint32_t hdr = len;
+	size_t head;
+
+	while (1) {
+		head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+		if (RING_SIZE - (head - atomic_load(&ring.tail)) >= need)
+			break;
+
+		switch (ring.policy) {
+		case SINK_DROP:
+			drop_oldest();
+			break;
+
+		case SINK_SPILL:
+			if (write(ring.spill, data, len) != (ssize_t)len)
+				atomic_fetch_add(&ring.dropped, 1);
+			else
+				atomic_fetch_add(&ring.spilled, 1);
+			return;
+
+		default:
+			atomic_fetch_add(&ring.waits, 1);
+			room = need;
+			nap(&ring.waiting, has_room);
+			break;
+		}
+	}
+
+	copy_in(head, &hdr, HDR);
+	copy_in(head + HDR, data, len);
+	atomic_store(&ring.head, head + need);
+	atomic_fetch_add(&ring.records, 1);
+
+	wake(&ring.sleeping);
+}
+
+/* Queue the record collected so far, if any and under the limit */
+static void end_record(void)
+{
+	if (ring.oversize) {
+		atomic_fetch_add(&ring.rejected, 1);
+		warnx("output record over %d KiB, rejected.", RECORD_MAX / 1024);
+	} else if (ring.rec_len)
+		push((const char *)ring.rec, ring.rec_len);
+
+	ring.rec_len = 0;
+	ring.oversize = 0;
+}
+
+/* Collects the record, stdio may flush it in parts when its buffer fills */
+static ssize_t sink_write(void *cookie, const char *buf, size_t len)
+{
+	(void)cookie;
+
+	if (ring.oversize || ring.rec_len + len > RECORD_MAX)
+		ring.oversize = 1;
+	else {
+		memcpy(&ring.rec[ring.rec_len], buf, len);
+		ring.rec_len += len;
+	}
+
+	if (ring.end)
+		end_record();
+
+	return len;
+}
+
+static __thread int ending;	/* in sink_end() of another FILE */
+
+/*
+ * End of a record written to fp, e.g. a telegram, flushes fp.  For the
+ * output ring the record is queued as one, other FILEs are just flushed,
+ * and a FILE which copies to others, e.g. the tee of a merged job, ends
+ * their records from its write function when sink_ending().
+ */
+void sink_end(FILE *fp)
+{
+	if (!fp)
+		return;
+
+	flockfile(fp);
+	if (fp != ring.fp) {
+		ending++;
+		fflush(fp);
+		ending--;
+		funlockfile(fp);
+		return;
+	}
+
+	ring.end = 1;
+	fflush(fp);
+	ring.end = 0;
+
+	/* nothing buffered, but earlier parts of the record may be */
+	end_record();
+	funlockfile(fp);
+}
+
+int sink_ending(void)
+{
+	return ending > 0;
+}
+
+static void write_all(const unsigned char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(ring.fd, buf, len);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return;		/* consumer gone, nothing to do */
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void *writer(void *arg)
+{
+	static unsigned char buf[RECORD_MAX];
+
+	(void)arg;
+
+	while (1) {
+		size_t tail = atomic_load(&ring.tail);
+		uint32_t len;
+
+		if (tail == atomic_load(&ring.head)) {
+			if (atomic_load(&ring.stop))
+				break;
+			nap(&ring.sleeping, has_data);
+			continue;
+		}
+
+		copy_out(&len, tail, HDR);
+		if (len > RECORD_MAX)
+			continue;	/* dropped and overwritten, retry */
+		copy_out(buf, tail + HDR, len);
+		if (!atomic_compare_exchange_strong(&ring.tail, &tail, tail + HDR + len))
+			continue;	/* dropped while we copied it */
+
+		wake(&ring.waiting);
+		write_all(buf, len);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start output ring to fd, with policy SINK_*, spill is the file to
+ * write to when full with SINK_SPILL.  Returns the FILE to write to.
+ */
+FILE *sink_open(int fd, int policy, const char *spill)
+{
+	static const cookie_io_functions_t io = { .write = sink_write };
+
+	ring.buf = malloc(RING_SIZE);
+	ring.rec = malloc(RECORD_MAX);
+	if (!ring.buf || !ring.rec) {
+		free(ring.buf);
+		free(ring.rec);
+		ring.buf = NULL;
+		ring.rec = NULL;
+		return NULL;
+	}
+
+	ring.fd = fd;
+	ring.policy = policy;
+	if (policy == SINK_SPILL) {
+		ring.spill = open(spill, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (ring.spill == -1)
+			goto fail;
+	}
+
+	ring.fp = fopencookie(NULL, "w", io);
+	if (!ring.fp)
+		goto fail;
+	setvbuf(ring.fp, NULL, _IOFBF, BUFSIZ);
+
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.cond, NULL);
+	if (pthread_create(&ring.thread, NULL, writer, NULL)) {
+		fclose(ring.fp);
+		ring.fp = NULL;
+		goto fail;
+	}
+
+	return ring.fp;
+fail:
+	if (ring.spill != -1)
+		close(ring.spill);
+	ring.spill = -1;
+	free(ring.buf);
+	free(ring.rec);
+	ring.buf = NULL;
+	ring.rec = NULL;
+	return NULL;
+}
+
+/* Parse policy: block, drop, or spill:FILE, returns SINK_* or -1 */
+int sink_parse(const char *arg, const char **spill)
+{
+	if (!strcmp(arg, "block"))
+		return SINK_BLOCK;
+	if (!strcmp(arg, "drop"))
+		return SINK_DROP;
+	if (!strncmp(arg, "spill:", 6) && arg[6]) {
+		*spill = &arg[6];
+		return SINK_SPILL;
+	}
+
+	return -1;
+}
+
+void sink_show(FILE *fp)
+{
+	size_t used;
+
+	if (!ring.fp)
+		return;
+
+	used = atomic_load(&ring.head) - atomic_load(&ring.tail);
+	fprintf(fp, "output ring: %lu records, %lu dropped, %lu spilled, %lu rejected, %lu waits, "
+		"%zu/%d KiB queued\n", atomic_load(&ring.records), atomic_load(&ring.dropped),
+		atomic_load(&ring.spilled), atomic_load(&ring.rejected), atomic_load(&ring.waits),
+		used / 1024, RING_SIZE / 1024);
+}
+
+/* Flush and drain the ring, then stop the writer */
+void sink_close(void)
+{
+	if (!ring.fp)
+		return;
+
+	/* whatever is left is the last record */
+	ring.end = 1;
+	fclose(ring.fp);
+	ring.fp = NULL;
+	ring.end = 0;
+	end_record();
+
+	atomic_store(&ring.stop, 1);
+	wake(&ring.sleeping);
+	pthread_join(ring.thread, NULL);
+
+	pthread_mutex_destroy(&ring.lock);
+	pthread_cond_destroy(&ring.cond);
+	if (ring.spill != -1)
+		close(ring.spill);
+	free(ring.buf);
+	free(ring.rec);
+	ring.buf = NULL;
+	ring.rec = NULL;
+}
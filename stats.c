@@ -0,0 +1,288 @@
+/* Bus transaction latency and error statistics
+ *
+ * Copyright (C) 2022  Addiva Elektronik AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The libmbus send and receive event hooks timestamp each transaction
+ * with a monotonic clock.  The hooks do not get the handle, but each
+ * handle is only used by its bus worker, so the transaction in flight
+ * is kept thread local.  A send that is not answered before the next
+ * one is a timeout, and a send to the same address again is a retry.
+ * Collisions are reported by the scan.
+ *
+ * With debug enabled the hooks also dump frames, like the libmbus ones.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbus-master.h"
+
+/* response time histogram, upper bounds in ms */
+static const unsigned buckets[STATS_BUCKETS - 1] = { 50, 100, 200, 500, 1000, 2000 };
+
+struct addr_stats {
+	uint32_t tx, rx;
+	uint32_t timeouts, retries, collisions;
+	uint32_t min, max;
+	uint64_t sum;
+	uint32_t hist[STATS_BUCKETS];
+};
+
+static struct addr_stats *stats[BUS_MAX];	/* [256] per bus, on demand */
+static pthread_mutex_t    lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct {
+	long long sent;
+	int       addr;
+	int       pending;
+} tx;
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* called locked */
+static struct addr_stats *get(int bus, int addr)
+{
+	if (bus < 0 || bus >= BUS_MAX || addr < 0 || addr > 255)
+		return NULL;
+
+	if (!stats[bus] && !(stats[bus] = calloc(256, sizeof(struct addr_stats))))
+		return NULL;
+
+	return &stats[bus][addr];
+}
+
+/* address of short, control and long frames */
+static int frame_addr(const char *buff, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)buff;
+
+	if (len >= 5 && p[0] == MBUS_FRAME_SHORT_START)
+		return p[2];
+	if (len >= 6 && p[0] == MBUS_FRAME_LONG_START)
+		return p[5];
+
+	return -1;
+}
+
+void stats_send_event(unsigned char src_type, const char *buff, size_t len)
+{
+	struct bus *bus = bus_self();
+	int addr = frame_addr(buff, len);
+	struct addr_stats *s;
+
+	if (debug)
+		mbus_dump_send_event(src_type, buff, len);
+
+	if (!bus || addr < 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (tx.pending && (s = get(bus->id, tx.addr))) {
+		s->timeouts++;
+		if (tx.addr == addr)
+			s->retries++;
+	}
+	if ((s = get(bus->id, addr)))
+		s->tx++;
+	pthread_mutex_unlock(&lock);
+
+	tx.sent    = now_ms();
+	tx.addr    = addr;
+	tx.pending = addr != MBUS_ADDRESS_BROADCAST_NOREPLY;
+}
+
+void stats_recv_event(unsigned char src_type, const char *buff, size_t len)
+{
+	struct bus *bus = bus_self();
+	struct addr_stats *s;
+	uint32_t ms;
+	int i;
+
+	if (debug)
+		mbus_dump_recv_event(src_type, buff, len);
+
+	if (!bus || !tx.pending)
+		return;
+
+	ms = (uint32_t)(now_ms() - tx.sent);
+	tx.pending = 0;
+
+	for (i = 0; i < STATS_BUCKETS - 1; i++) {
+		if (ms < buckets[i])
+			break;
+	}
+
+	pthread_mutex_lock(&lock);
+	if ((s = get(bus->id, tx.addr))) {
+		if (!s->rx || ms < s->min)
+			s->min = ms;
+		if (ms > s->max)
+			s->max = ms;
+		s->sum += ms;
+		s->rx++;
+		s->hist[i]++;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void stats_collision(int bus, int addr)
+{
+	struct addr_stats *s;
+
+	pthread_mutex_lock(&lock);
+	if ((s = get(bus, addr)))
+		s->collisions++;
+	pthread_mutex_unlock(&lock);
+}
+
+/* Clear statistics of bus, or all buses with -1 */
+void stats_reset(int bus)
+{
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < BUS_MAX; i++) {
+		if (stats[i] && (bus == -1 || bus == i))
+			memset(stats[i], 0, 256 * sizeof(struct addr_stats));
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* Show statistics of bus, or all buses with -1, addresses with traffic */
+void stats_show(FILE *fp, int bus)
+{
+	fprintf(fp, "Bus Addr      Tx      Rx Timeout  Retry   Coll   Min   Avg   Max"
+		"   <50  <100  <200  <500   <1s   <2s  more\n");
+
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < BUS_MAX; i++) {
+		if (!stats[i] || (bus != -1 && bus != i))
+			continue;
+
+		for (int addr = 0; addr < 256; addr++) {
+			struct addr_stats *s = &stats[i][addr];
+
+			if (!s->tx && !s->collisions)
+				continue;
+
+			fprintf(fp, "%3d %4d %7u %7u %7u %6u %6u %5u %5u %5u", i, addr,
+				s->tx, s->rx, s->timeouts, s->retries, s->collisions,
+				s->min, s->rx ? (unsigned)(s->sum / s->rx) : 0, s->max);
+			for (int b = 0; b < STATS_BUCKETS; b++)
+				fprintf(fp, " %5u", s->hist[b]);
+			fprintf(fp, "\n");
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void counter(FILE *fp, const char *name, const char *help)
+{
+	fprintf(fp, "# TYPE mbus_%s counter\n# HELP mbus_%s %s\n", name, name, help);
+}
+
+/* Statistics of all buses in OpenMetrics text format, see metrics.c */
+void stats_metrics(FILE *fp)
+{
+	static const struct {
+		const char *name, *help;
+		size_t      offset;
+	} counters[] = {
+		{ "frames_sent",    "Frames sent to address.",          offsetof(struct addr_stats, tx) },
+		{ "frames_received", "Replies received from address.",  offsetof(struct addr_stats, rx) },
+		{ "timeouts",       "Requests not answered.",           offsetof(struct addr_stats, timeouts) },
+		{ "retries",        "Requests sent again.",             offsetof(struct addr_stats, retries) },
+		{ "collisions",     "Collisions found by scan.",        offsetof(struct addr_stats, collisions) },
+	};
+
+	pthread_mutex_lock(&lock);
+	for (size_t c = 0; c < NELEMS(counters); c++) {
+		counter(fp, counters[c].name, counters[c].help);
+		for (int i = 0; i < BUS_MAX; i++) {
+			for (int addr = 0; stats[i] && addr < 256; addr++) {
+				struct addr_stats *s = &stats[i][addr];
+
+				if (!s->tx && !s->collisions)
+					continue;
+
+				fprintf(fp, "mbus_%s_total{bus=\"%d\",address=\"%d\"} %u\n", counters[c].name, i, addr,
+					*(uint32_t *)((char *)s + counters[c].offset));
+			}
+		}
+	}
+
+	fprintf(fp, "# TYPE mbus_response_seconds histogram\n"
+		"# HELP mbus_response_seconds Time from request to reply.\n");
+	for (int i = 0; i < BUS_MAX; i++) {
+		for (int addr = 0; stats[i] && addr < 256; addr++) {
+			struct addr_stats *s = &stats[i][addr];
+			uint32_t sum = 0;
+
+			if (!s->rx)
+				continue;
+
+			for (int b = 0; b < STATS_BUCKETS; b++) {
+				sum += s->hist[b];
+				if (b < STATS_BUCKETS - 1)
+					fprintf(fp, "mbus_response_seconds_bucket{bus=\"%d\",address=\"%d\",le=\"%g\"} %u\n",
+						i, addr, buckets[b] / 1000.0, sum);
+				else
+					fprintf(fp, "mbus_response_seconds_bucket{bus=\"%d\",address=\"%d\",le=\"+Inf\"} %u\n",
+						i, addr, sum);
+			}
+			fprintf(fp, "mbus_response_seconds_sum{bus=\"%d\",address=\"%d\"} %g\n",
+				i, addr, s->sum / 1000.0);
+			fprintf(fp, "mbus_response_seconds_count{bus=\"%d\",address=\"%d\"} %u\n",
+				i, addr, s->rx);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* Write statistics of all buses to file, via a temporary file */
+int stats_save(const char *file)
+{
+	char tmp[strlen(file) + 5];
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	fp = fopen(tmp, "w");
+	if (!fp)
+		return -1;
+
+	fprintf(fp, "# mbus-master statistics %lld, times in ms\n", (long long)time(NULL));
+	stats_show(fp, -1);
+
+	if (fclose(fp) || rename(tmp, file)) {
+		remove(tmp);
+		return -1;
+	}
+
+	return 0;
+}